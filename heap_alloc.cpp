@@ -1,124 +1,164 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "data_types.h"
 #include "heap_alloc.h"
-#include "numeric_tools.h"
+#include "numa.h"
+#include "page_map.h"
+#include "percpu.h"
 using namespace shark;
 
-HeapAllocator* HeapAllocator::allocator = NULL;
-const uint32 HeapAllocator::DEBUG_EXTRA_INFO_SIZE = HeapAllocator::s_preBufferSize + HeapAllocator::s_postBufferSize + HeapAllocator::s_blockHeadSize;
-sPreBufferData* HeapAllocator::sTopMemoryBlock = 0;
-uint32 HeapAllocator::sAllocAccount = 0;
-uint32 HeapAllocator::sReleaseAccount = 0;
-uint32 HeapAllocator::sTotalBytesRequested = 0;
-uint32 HeapAllocator::sTotalBytesInUse = 0;
-uint32 HeapAllocator::sMaximumBytesRequested = 0;
-uint32 HeapAllocator::sMaxinumBytesInUse = 0;
-
-HeapAllocator::page* HeapAllocator::bucket::get_free_page() {
-	if (!mPageList.empty()) {
-		page* p = &mPageList.front();
-		if (p->mFreeList)
-			return p;
+template<class Policy>
+BasicHeapAllocator<Policy>* BasicHeapAllocator<Policy>::allocator = NULL;
+
+template<class Policy>
+typename BasicHeapAllocator<Policy>::page* BasicHeapAllocator<Policy>::bucket::get_free_page() {
+	for (unsigned b = BIN_HIGH; b < NUM_BINS; b++) {
+		if (!mBins[b].empty())
+			return &mBins[b].front();
 	}
 	return NULL;
 }
 
-void* HeapAllocator::bucket::alloc(page* p) { 	
-	assert(p && p->mFreeList);
+template<class Policy>
+void* BasicHeapAllocator<Policy>::bucket::alloc(page* p) { 	
+	assert(p && !p->full());
+	unsigned from = bin_of(p);
 	p->inc_ref();
-	free_link* free = p->mFreeList;
-	free_link* next = free->mNext;
-	p->mFreeList = next;
-	//ǰpageѾûпп飬ƶб
-	if (!next) {
+	void* free = p->alloc_slot();
+	unsigned to = bin_of(p);
+	if (from != to) {
 		p->unlink();
-		mPageList.push_back(p);
+		mBins[to].push_front(p);
 	}
-	return (void*)free;
+	return free;
 }
 
-void HeapAllocator::bucket::free(page* p, void* ptr) {
-	free_link* free = p->mFreeList;
-	free_link* lnk = (free_link*)ptr;
-	lnk->mNext = free;
-	p->mFreeList = lnk;
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket::free(page* p, void* ptr) {
+	unsigned from = bin_of(p);
+	p->free_slot(ptr);
 	p->dec_ref();
-	//пֻһˣƶбǰ,֤ÿpageܹȫʹõ
-	if (!free) {
+	unsigned to = bin_of(p);
+	if (from != to) {
 		p->unlink();
-		mPageList.push_front(p);
+		mBins[to].push_front(p);
 	}
 }
 
-bool HeapAllocator::ptr_in_bucket(void* ptr) const {
+// marker check only, takes no lock
+template<class Policy>
+bool BasicHeapAllocator<Policy>::ptr_has_bucket_marker(void* ptr) const {
+	page* p = ptr_get_page(ptr);
+	unsigned bi = p->bucket_index();
+	return bi < NUM_HEAP_BUCKETS && p->check_marker(mBuckets[bi].marker());
+}
+
+// debug builds verify the marker against the bucket's page lists
+template<class Policy>
+bool BasicHeapAllocator<Policy>::ptr_in_bucket(void* ptr) const {
 	bool result = false;
 	page* p = ptr_get_page(ptr);
 	unsigned bi = p->bucket_index();
-	if (bi < NUM_BUCKETS) {
+	if (bi < NUM_HEAP_BUCKETS) {
 		result = p->check_marker(mBuckets[bi].marker());
-		#ifdef MULTITHREADED
-		ScopeLock lock(mBuckets[bi].get_lock());
+		#ifndef NDEBUG
+		scope_lock lock(mBuckets[bi].get_lock());
+		bool found = false;
+		for (unsigned b = 0; b < bucket::NUM_BINS && !found; b++) {
+			const page* pe = mBuckets[bi].bin(b).end();
+			for (const page* pb = mBuckets[bi].bin(b).begin(); pb != pe && !found; pb = pb->next())
+				found = pb == p;
+		}
+		assert(result == found);
 		#endif
-		const page* pe = mBuckets[bi].page_list_end();
-		const page* pb = mBuckets[bi].page_list_begin();
-		for (; pb != pe && pb != p; pb = pb->next()) {}
-		assert(result == (pb == p));
 	}
 	return result;
 }
 
-void* HeapAllocator::bucket_system_alloc()
+template<class Policy>
+void* BasicHeapAllocator<Policy>::bucket_system_alloc()
 {
-	void* ptr = system_alloc(PAGE_SIZE);
+	void* ptr = NULL;
+	{
+		scope_lock lock(mTreeMutex);
+		ptr = mSuperblocks.alloc(1);
+	}
+	//superblocks are bound to the node as a whole when they are reserved
+	if (!ptr) {
+		ptr = system_alloc(PAGE_SIZE);
+		if (ptr && mNode >= 0)
+			numa_bind(ptr, PAGE_SIZE, mNode);
+	}
 	if (ptr) {
+		if (mNode >= 0)
+			page_map_set(ptr, PAGE_SIZE, this);
 		//pageĻַPAGE_SIZEֶ
 		assert(((size_t)ptr & (PAGE_SIZE-1)) == 0);
-		#ifdef MULTITHREADED
-		ScopeLock lock(mTreeMutex);
-		#endif
 	}
 	return ptr;
 }
 
 
-void HeapAllocator::bucket_system_free(void* ptr) {
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_system_free(void* ptr) {
 	assert(ptr);
-	system_free(ptr);
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+	SHARK_PROBE1(bucket_page_free, ptr);
+	if (mNode >= 0)
+		page_map_set(ptr, PAGE_SIZE, NULL);
+	scope_lock lock(mTreeMutex);
+	if (mSuperblocks.owns(ptr))
+		mSuperblocks.free(ptr, 1);
+	else
+		system_free(ptr);
 }
 
-HeapAllocator::page* HeapAllocator::bucket_grow(size_t elemSize, unsigned marker) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::page* BasicHeapAllocator<Policy>::bucket_grow(unsigned bi) {
+	size_t elemSize = bucket_elem_size_of(bi);
 	//֤ᳬpage
 	assert((PAGE_SIZE-sizeof(page))/elemSize <= MAX_UINT16);
-	void* mem = bucket_system_alloc();
+	if (latency_enabled())
+		latency_mark(LATENCY_ALLOC_BUCKET_GROW);
+	void* mem = page_pool_get();
+	if (mRtRunning) {
+		if (mem) {
+			rt_check(mPagePoolSize, mRtPages, 0);
+		} else {
+			__atomic_add_fetch(&mRtMisses, 1, __ATOMIC_RELAXED);
+			SHARK_PROBE1(rt_miss, 0);
+			rt_wake();
+		}
+	}
+	if (!mem)
+		mem = bucket_system_alloc();
 	if (mem) {
-		size_t i = 0;
-		// nõڴ
-		size_t n = ((PAGE_SIZE-sizeof(page))/elemSize)*elemSize;
-		// µpageзֳɶСΪelemSizeĿ
-		for (; i < n-elemSize; i += elemSize)
-			((free_link*)((char*)mem + i))->mNext = (free_link*)((char*)mem + i + elemSize);
-		((free_link*)((char*)mem + i))->mNext = NULL;
-		assert(i + elemSize + sizeof(page) <= PAGE_SIZE);
 		page* p = ptr_get_page(mem);
-		new (p) page((free_link*)mem, (unsigned short)elemSize, marker);
+		size_t offs = slot_offset((char*)mem, bi);
+		size_t slots = slot_tracker::slots_for((char*)p - (char*)mem - offs, elemSize);
+		assert(offs + slots * elemSize <= (size_t)((char*)p - (char*)mem));
+		new (p) page(bi, (unsigned)slots, offs, mBuckets[bi].marker());
+		SHARK_PROBE2(bucket_grow, elemSize, mem);
 		return p;
 	}
 	return NULL;
 }
 
-void* HeapAllocator::bucket_alloc(size_t size) {
+template<class Policy>
+void* BasicHeapAllocator<Policy>::bucket_alloc(size_t size) {
 	assert(size <= MAX_SMALL_ALLOCATION);
 	unsigned bi = bucket_spacing_function(size);
 	assert(bi < NUM_BUCKETS);
-	#ifdef MULTITHREADED
-	ScopeLock lock(mBuckets[bi].get_lock());
-	#endif
+	if (unsigned depth = cpu_cache_depth()) {
+		if (void* ptr = cpu_cache_alloc(bi, depth))
+			return ptr;
+	}
+	scope_lock lock(mBuckets[bi].get_lock());
 	page* p = mBuckets[bi].get_free_page();
 	if (!p) {
-		size_t bsize = bucket_spacing_function_inverse(bi);
-		p = bucket_grow(bsize, mBuckets[bi].marker());
+		p = bucket_grow(bi);
 		if (!p)
 			return NULL;
 		mBuckets[bi].add_free_page(p);
@@ -127,15 +167,18 @@ void* HeapAllocator::bucket_alloc(size_t size) {
 	return mBuckets[bi].alloc(p);
 }
 
-void* HeapAllocator::bucket_alloc_direct(unsigned bi) {
-	assert(bi < NUM_BUCKETS);
-	#ifdef MULTITHREADED
-	ScopeLock lock(mBuckets[bi].get_lock());
-	#endif
+template<class Policy>
+void* BasicHeapAllocator<Policy>::bucket_alloc_direct(unsigned bi) {
+	assert(bi < NUM_HEAP_BUCKETS);
+	unsigned depth = bi < NUM_BUCKETS ? cpu_cache_depth() : 0;
+	if (depth) {
+		if (void* ptr = cpu_cache_alloc(bi, depth))
+			return ptr;
+	}
+	scope_lock lock(mBuckets[bi].get_lock());
 	page* p = mBuckets[bi].get_free_page();
 	if (!p) {
-		size_t bsize = bucket_spacing_function_inverse(bi);
-		p = bucket_grow(bsize, mBuckets[bi].marker());
+		p = bucket_grow(bi);
 		if (!p)
 			return NULL;
 		mBuckets[bi].add_free_page(p);
@@ -143,7 +186,8 @@ void* HeapAllocator::bucket_alloc_direct(unsigned bi) {
 	return mBuckets[bi].alloc(p);
 }
 
-void* HeapAllocator::bucket_realloc(void* ptr, size_t size) {
+template<class Policy>
+void* BasicHeapAllocator<Policy>::bucket_realloc(void* ptr, size_t size) {
 	page* p = ptr_get_page(ptr);
 	size_t elemSize = p->elem_size();
 	if (size <= elemSize)
@@ -156,67 +200,505 @@ void* HeapAllocator::bucket_realloc(void* ptr, size_t size) {
 	return newPtr;
 }
 
-void HeapAllocator::bucket_free(void* ptr) {
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_free(void* ptr) {
+	if (lifetime())
+		lifetime_free(ptr);
 	page* p = ptr_get_page(ptr);
 	unsigned bi = p->bucket_index();
-	assert(bi < NUM_BUCKETS);
-	#ifdef MULTITHREADED
-	ScopeLock lock(mBuckets[bi].get_lock());
-	#endif
-	mBuckets[bi].free(p, ptr);
+	assert(bi < NUM_HEAP_BUCKETS);
+	unsigned depth = bi < NUM_BUCKETS ? cpu_cache_depth() : 0;
+	if (depth && cpu_cache_free(ptr, bi, depth))
+		return;
+	scope_lock lock(mBuckets[bi].get_lock());
+	bucket_free_slot(bi, p, ptr);
 }
 
-void HeapAllocator::bucket_free_direct(void* ptr, unsigned bi) {
-	assert(bi < NUM_BUCKETS);
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_free_direct(void* ptr, unsigned bi) {
+	assert(bi < NUM_HEAP_BUCKETS);
 	page* p = ptr_get_page(ptr);
 	assert(bi == p->bucket_index());
-	#ifdef MULTITHREADED
-	ScopeLock lock(mBuckets[bi].get_lock());
-	#endif
+	if (lifetime())
+		lifetime_free(ptr);
+	unsigned depth = bi < NUM_BUCKETS ? cpu_cache_depth() : 0;
+	if (depth && cpu_cache_free(ptr, bi, depth))
+		return;
+	scope_lock lock(mBuckets[bi].get_lock());
+	bucket_free_slot(bi, p, ptr);
+}
+
+// called with the bucket lock held
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_free_slot(unsigned bi, page* p, void* ptr) {
 	mBuckets[bi].free(p, ptr);
+	if (!p->empty() || mPagePoolMax == 0)
+		return;
+	//p went to the front of the empty bin, keep it when it is the bucket's only empty page
+	page_list& empty = mBuckets[bi].bin(bucket::BIN_EMPTY);
+	if (&empty.back() == p)
+		return;
+	p->unlink();
+	p->mBucketIndex = (unsigned short)-1;
+	page_pool_put(align_down((char*)p, PAGE_SIZE));
 }
 
-//ͷŵδʹõpage
-void HeapAllocator::bucket_purge() {
-	for (unsigned i = 0; i < NUM_BUCKETS; i++) {
-		#ifdef MULTITHREADED
-		ScopeLock lock(mBuckets[i].get_lock());
-		#endif
-		page *pageEnd = mBuckets[i].page_list_end();
-		for (page* p = mBuckets[i].page_list_begin(); p != pageEnd; ) {
-			if (p->mFreeList == NULL) 
+// regular bucket bi, or its short lived copy when the call site is predicted to free soon
+template<class Policy>
+unsigned BasicHeapAllocator<Policy>::lifetime_bucket(unsigned bi, const char* file, int line, bool& sample) {
+	lifetime_tables* tables = lifetime();
+	if (!tables)
+		return bi;
+	static __thread lifetime_countdown sCountdowns[LIFETIME_COUNTDOWNS];
+	lifetime_countdown& c = sCountdowns[(((size_t)this * 0x9E3779B97F4A7C15ULL) >> 32) % LIFETIME_COUNTDOWNS];
+	uint32 rate = __atomic_load_n(&mLifetimeRate, __ATOMIC_RELAXED);
+	if (c.mHeap != this || c.mCount > rate) {
+		c.mHeap = this;
+		c.mCount = 0;
+	}
+	if (c.mCount == 0) {
+		c.mCount = rate;
+		sample = true;
+	}
+	c.mCount--;
+	const lifetime_site& site = lifetime_site_of(tables, file, line);
+	if (site.mShortLived && site.mFile == file && site.mLine == line)
+		return SHORT_LIVED_BUCKETS + bi;
+	return bi;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::lifetime_sample_alloc(void* ptr, const char* file, int line) {
+	uint64 now = latency_now();
+	scope_lock lock(mLifetimeLock);
+	lifetime_site& site = lifetime_site_of(lifetime(), file, line);
+	if (site.mFile != file || site.mLine != line) {
+		site.mShortLived = false;
+		site.mSamples = site.mShort = 0;
+		site.mFile = file;
+		site.mLine = line;
+	}
+	lifetime_sample& s = lifetime_sample_of(lifetime(), ptr);
+	if (s.mPtr) {
+		//the slot is taken by a live sample, replace it only once it has proven long lived
+		if (now - s.mBorn < mLifetimeShortNs)
+			return;
+		lifetime_record(s.mSite, false);
+	}
+	s.mSite = &site;
+	s.mBorn = now;
+	__atomic_store_n(&s.mPtr, ptr, __ATOMIC_RELEASE);
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::lifetime_free(void* ptr) {
+	lifetime_sample& s = lifetime_sample_of(lifetime(), ptr);
+	if (__atomic_load_n(&s.mPtr, __ATOMIC_RELAXED) != ptr)
+		return;
+	uint64 now = latency_now();
+	scope_lock lock(mLifetimeLock);
+	if (s.mPtr != ptr)
+		return;
+	lifetime_record(s.mSite, now - s.mBorn < mLifetimeShortNs);
+	__atomic_store_n(&s.mPtr, (void*)NULL, __ATOMIC_RELAXED);
+}
+
+// called with the lifetime lock held
+template<class Policy>
+void BasicHeapAllocator<Policy>::lifetime_record(lifetime_site* site, bool shortLived) {
+	site->mSamples++;
+	if (shortLived)
+		site->mShort++;
+	if (site->mSamples >= LIFETIME_MAX_SAMPLES) {
+		site->mSamples /= 2;
+		site->mShort /= 2;
+	}
+	if (site->mSamples >= LIFETIME_MIN_SAMPLES)
+		site->mShortLived = site->mShort * 4 >= site->mSamples * 3;
+}
+
+template<class Policy>
+void* BasicHeapAllocator<Policy>::page_pool_get() {
+	if (mPagePoolMax == 0)
+		return NULL;
+	scope_lock lock(mPagePoolLock);
+	if (mPagePool.empty())
+		return NULL;
+	page_pool_trim(mPagePoolMax, latency_now());
+	if (mPagePool.empty())
+		return NULL;
+	pooled_page* pp = &mPagePool.front();
+	pp->unlink();
+	mPagePoolSize--;
+	return pp;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::page_pool_put(void* mem) {
+	scope_lock lock(mPagePoolLock);
+	pooled_page* pp = new (mem) pooled_page();
+	pp->mPooledAt = latency_now();
+	mPagePool.push_front(pp);
+	mPagePoolSize++;
+	page_pool_trim(mPagePoolMax, pp->mPooledAt);
+}
+
+// releases the oldest pages beyond keep and all pages older than the decay time, pool lock held.
+// The real-time reserve is never trimmed while the refill thread runs.
+template<class Policy>
+void BasicHeapAllocator<Policy>::page_pool_trim(size_t keep, uint64 now) {
+	size_t floor = mRtRunning ? mRtPages : 0;
+	while (!mPagePool.empty()) {
+		pooled_page* pp = &mPagePool.back();
+		if (mPagePoolSize <= floor || (mPagePoolSize <= keep && now - pp->mPooledAt < mPagePoolDecay))
+			break;
+		pp->unlink();
+		mPagePoolSize--;
+		bucket_system_free(pp);
+	}
+}
+
+// faults in every OS page of [mem, mem+size) writable, the contents stay as they are
+template<class Policy>
+void BasicHeapAllocator<Policy>::prefault(void* mem, size_t size) {
+	if (size == 0)
+		return;
+	static const size_t osPageSize = (size_t)sysconf(_SC_PAGESIZE);
+	#ifdef MADV_POPULATE_WRITE
+	//one system call instead of a fault per page, Linux 5.14 and later
+	char* from = align_down((char*)mem, osPageSize);
+	char* to = align_up((char*)mem + size, osPageSize);
+	if (madvise(from, to - from, MADV_POPULATE_WRITE) == 0)
+		return;
+	#endif
+	volatile char* p = (volatile char*)mem;
+	for (size_t offs = 0; offs < size; offs += osPageSize)
+		p[offs] = p[offs];
+	p[size - 1] = p[size - 1];	//mem need not be page aligned, the loop may stop short of the last page
+}
+
+// counts a breach and wakes the refill thread when a reserve fell below half its target
+template<class Policy>
+void BasicHeapAllocator<Policy>::rt_check(size_t level, size_t target, unsigned kind) {
+	if (level >= target / 2)
+		return;
+	__atomic_add_fetch(&mRtBreaches, 1, __ATOMIC_RELAXED);
+	SHARK_PROBE2(rt_breach, kind, level);
+	rt_wake();
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::rt_wake() {
+	BasicScopeLock<MutexLock> lock(mRtLock);
+	mRtWake = true;
+	pthread_cond_signal(&mRtCond);
+}
+
+// a reserve segment of at least size bytes, size becomes its real size; tree lock held
+template<class Policy>
+void* BasicHeapAllocator<Policy>::rt_take_segment(size_t& size) {
+	for (segment* seg = mReserveSegments.begin(); seg != mReserveSegments.end(); seg = seg->next()) {
+		if (seg->size() >= size) {
+			seg->unlink();
+			mReserveSegmentCount--;
+			size = seg->size();
+			rt_check(mReserveSegmentCount, mRtSegments, 1);
+			return seg;
+		}
+	}
+	__atomic_add_fetch(&mRtMisses, 1, __ATOMIC_RELAXED);
+	SHARK_PROBE1(rt_miss, 1);
+	rt_wake();
+	return NULL;
+}
+
+// tops both reserves up to their targets, system calls and faults happen here instead of in the grow paths
+template<class Policy>
+void BasicHeapAllocator<Policy>::rt_refill() {
+	while (mRtRunning) {
+		{
+			scope_lock lock(mPagePoolLock);
+			if (mPagePoolSize >= mRtPages || mPagePoolSize >= mPagePoolMax)
 				break;
-			page* next = p->next();
-			if (p->empty()) {
-				assert(p->mFreeList);
-				p->unlink();
-				void* memAddr = align_down((char*)p, PAGE_SIZE);
-				bucket_system_free(memAddr);
-			}
-			p = next;
+		}
+		void* mem = bucket_system_alloc();
+		if (!mem)
+			break;
+		prefault(mem, PAGE_SIZE);
+		page_pool_put(mem);
+	}
+	while (mRtRunning) {
+		size_t size;
+		void* mem;
+		{
+			scope_lock lock(mTreeMutex);
+			if (mReserveSegmentCount >= mRtSegments)
+				break;
+			size = mRtSegmentSize;
+			mem = tree_system_alloc(size);
+		}
+		if (!mem)
+			break;
+		prefault(mem, size);
+		scope_lock lock(mTreeMutex);
+		segment* seg = (segment*)mem;
+		seg->mSize = size;
+		mReserveSegments.push_back(seg);
+		mReserveSegmentCount++;
+	}
+}
+
+template<class Policy>
+void* BasicHeapAllocator<Policy>::rt_main(void* heap) {
+	BasicHeapAllocator* self = (BasicHeapAllocator*)heap;
+	self->mRtLock.lock();
+	while (self->mRtRunning) {
+		self->mRtWake = false;
+		self->mRtLock.unlock();
+		self->rt_refill();
+		//pages beyond the reserve still decay while the program is idle
+		self->decay();
+		self->mRtLock.lock();
+		if (!self->mRtRunning || self->mRtWake)
+			continue;
+		// grows only wake the thread below half the target, top up the rest every 10ms
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&self->mRtCond, self->mRtLock.getPthreadMutex(), &ts);
+	}
+	self->mRtLock.unlock();
+	return NULL;
+}
+
+template<class Policy>
+bool BasicHeapAllocator<Policy>::rt_start() {
+	if (mRtRunning)
+		return true;
+	{
+		scope_lock lock(mPagePoolLock);
+		mRtPoolMax = mPagePoolMax;
+		if (mPagePoolMax < mRtPages)
+			mPagePoolMax = mRtPages;
+		mRtRunning = true;
+	}
+	if (pthread_create(&mRtThread, NULL, &rt_main, this) != 0) {
+		scope_lock lock(mPagePoolLock);
+		mRtRunning = false;
+		mPagePoolMax = mRtPoolMax;
+		return false;
+	}
+	return true;
+}
+
+// joins the refill thread and gives the reserve segments back, the pool keeps its pages
+template<class Policy>
+void BasicHeapAllocator<Policy>::rt_stop() {
+	if (!mRtRunning)
+		return;
+	{
+		BasicScopeLock<MutexLock> lock(mRtLock);
+		mRtRunning = false;
+		pthread_cond_signal(&mRtCond);
+	}
+	pthread_join(mRtThread, NULL);
+	{
+		//the reserve pages beyond the old limit go back to the system
+		scope_lock lock(mPagePoolLock);
+		mPagePoolMax = mRtPoolMax;
+		page_pool_trim(mPagePoolMax, latency_now());
+	}
+	scope_lock lock(mTreeMutex);
+	while (!mReserveSegments.empty()) {
+		segment* seg = &mReserveSegments.front();
+		seg->unlink();
+		tree_system_free(seg, seg->size());
+	}
+	mReserveSegmentCount = 0;
+}
+
+template<class Policy>
+unsigned BasicHeapAllocator<Policy>::bucket_alloc_batch(unsigned bi, void** ptrs, unsigned count) {
+	assert(bi < NUM_BUCKETS);
+	scope_lock lock(mBuckets[bi].get_lock());
+	unsigned n = 0;
+	while (n < count) {
+		page* p = mBuckets[bi].get_free_page();
+		if (!p) {
+			p = bucket_grow(bi);
+			if (!p)
+				break;
+			mBuckets[bi].add_free_page(p);
+		}
+		ptrs[n++] = mBuckets[bi].alloc(p);
+	}
+	return n;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_free_batch(unsigned bi, void** ptrs, unsigned count) {
+	assert(bi < NUM_BUCKETS);
+	scope_lock lock(mBuckets[bi].get_lock());
+	for (unsigned i = 0; i < count; i++) {
+		page* p = ptr_get_page(ptrs[i]);
+		assert(bi == p->bucket_index());
+		bucket_free_slot(bi, p, ptrs[i]);
+	}
+}
+
+template<class Policy>
+typename BasicHeapAllocator<Policy>::cpu_cache* BasicHeapAllocator<Policy>::cpu_cache_lock() {
+	int cpu = rseq_current_cpu();
+	if (cpu < 0 || cpu >= mCpuCount)
+		return NULL;
+	cpu_cache* c = &mCpuCaches[cpu];
+	if (__sync_lock_test_and_set(&c->mLock, 1))
+		return NULL;
+	return c;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::cpu_cache_unlock(cpu_cache* c) {
+	__sync_lock_release(&c->mLock);
+}
+
+/*
+ * depth is the caller's one read of mCpuCacheDepth, set_cpu_cache may change
+ * it at any time. The cache lock is never held across a bucket call, which
+ * can sleep on a bucket lock or grow, so the other threads of the cpu keep
+ * their cache meanwhile.
+ */
+template<class Policy>
+void* BasicHeapAllocator<Policy>::cpu_cache_alloc(unsigned bi, unsigned depth) {
+	cpu_cache* c = cpu_cache_lock();
+	if (!c)
+		return NULL;
+	void* ptr = c->mCount[bi] ? c->mSlots[bi][--c->mCount[bi]] : NULL;
+	cpu_cache_unlock(c);
+	if (ptr)
+		return ptr;
+	//refill half of the cache with one bucket lock
+	void* batch[MAX_CPU_CACHE_DEPTH];
+	unsigned n = bucket_alloc_batch(bi, batch, (depth + 1) / 2);
+	if (n == 0)
+		return NULL;
+	ptr = batch[--n];
+	unsigned kept = 0;
+	if (n && (c = cpu_cache_lock()) != NULL) {
+		//the thread may run on another cpu by now, any cache will do
+		while (kept < n && c->mCount[bi] < depth)
+			c->mSlots[bi][c->mCount[bi]++] = batch[kept++];
+		cpu_cache_unlock(c);
+	}
+	if (kept < n)
+		bucket_free_batch(bi, batch + kept, n - kept);
+	return ptr;
+}
+
+template<class Policy>
+bool BasicHeapAllocator<Policy>::cpu_cache_free(void* ptr, unsigned bi, unsigned depth) {
+	cpu_cache* c = cpu_cache_lock();
+	if (!c)
+		return false;
+	//give the older entries back to the bucket when the cache is full, half of depth stays
+	void* spill[MAX_CPU_CACHE_DEPTH];
+	unsigned n = 0;
+	if (c->mCount[bi] >= depth) {
+		n = c->mCount[bi] - depth / 2;
+		memcpy(spill, c->mSlots[bi], n * sizeof(void*));
+		c->mCount[bi] -= n;
+		memmove(c->mSlots[bi], c->mSlots[bi] + n, c->mCount[bi] * sizeof(void*));
+	}
+	c->mSlots[bi][c->mCount[bi]++] = ptr;
+	cpu_cache_unlock(c);
+	if (n)
+		bucket_free_batch(bi, spill, n);
+	return true;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::cpu_cache_flush() {
+	if (!mCpuCaches)
+		return;
+	void* spill[MAX_CPU_CACHE_DEPTH];
+	for (int cpu = 0; cpu < mCpuCount; cpu++) {
+		cpu_cache* c = &mCpuCaches[cpu];
+		for (unsigned bi = 0; bi < NUM_BUCKETS; bi++) {
+			while (__sync_lock_test_and_set(&c->mLock, 1)) {}
+			unsigned n = c->mCount[bi];
+			memcpy(spill, c->mSlots[bi], n * sizeof(void*));
+			c->mCount[bi] = 0;
+			cpu_cache_unlock(c);
+			bucket_free_batch(bi, spill, n);
 		}
 	}
 }
 
-void HeapAllocator::split_block(block_header* bl, size_t size)
+template<class Policy>
+bool BasicHeapAllocator<Policy>::set_cpu_cache(unsigned depth) {
+	if (depth > MAX_CPU_CACHE_DEPTH)
+		depth = MAX_CPU_CACHE_DEPTH;
+	__atomic_store_n(&mCpuCacheDepth, 0, __ATOMIC_RELEASE);
+	cpu_cache_flush();
+	if (depth == 0 || !rseq_available())
+		return depth == 0;
+	if (!mCpuCaches) {
+		mCpuCount = cpu_count();
+		size_t size = round_up(mCpuCount * sizeof(cpu_cache), VIRTUAL_PAGE_SIZE);
+		mCpuCaches = (cpu_cache*)system_alloc(size);
+		if (!mCpuCaches)
+			return false;
+		memset(mCpuCaches, 0, size);
+	}
+	__atomic_store_n(&mCpuCacheDepth, depth, __ATOMIC_RELEASE);
+	return true;
+}
+
+//ͷŵδʹõpage
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_purge() {
+	for (unsigned i = 0; i < NUM_HEAP_BUCKETS; i++) {
+		scope_lock lock(mBuckets[i].get_lock());
+		page_list& empty = mBuckets[i].bin(bucket::BIN_EMPTY);
+		while (!empty.empty()) {
+			page* p = &empty.front();
+			assert(p->empty());
+			p->unlink();
+			void* memAddr = align_down((char*)p, PAGE_SIZE);
+			bucket_system_free(memAddr);
+		}
+	}
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::split_block(block_header* bl, size_t size)
 {
 	assert(size + sizeof(block_header) + sizeof(free_node) <= bl->size());
 	block_header* newBl = (block_header*)((char*)bl + size + sizeof(block_header));
 	newBl->link_after(bl);
 	newBl->set_unused();
+	newBl->set_zero(bl->zero());
 }
 
-HeapAllocator::block_header* HeapAllocator::shift_block(block_header* bl, size_t offs) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::shift_block(block_header* bl, size_t offs) {
 	assert(offs > 0);
 	block_header* prev = bl->prev();
+	bool zero = bl->zero();
 	bl->unlink();
 	bl = (block_header*)((char*)bl + offs);
 	bl->link_after(prev);
 	bl->set_unused();
+	bl->set_zero(zero);
 	return bl;
 }
 
-HeapAllocator::block_header* HeapAllocator::coalesce_block(block_header* bl) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::coalesce_block(block_header* bl) {
 	assert(!bl->used());
 	block_header* next = bl->next();
 	if (!next->used()) {
@@ -229,23 +711,62 @@ HeapAllocator::block_header* HeapAllocator::coalesce_block(block_header* bl) {
 		bl->unlink();
 		bl = prev;
 	}
+	if (!next->used() || !prev->used()) {
+		bl->set_zero(false);	//the merged headers and links are inside the block now
+		SHARK_PROBE2(coalesce, bl, bl->size());
+	}
 	return bl;
 }
 
-void* HeapAllocator::tree_system_alloc(size_t size) {
+// PAGE_SIZE aligned anonymous mapping, its pages read as zero until written
+static void* map_aligned(size_t size, size_t alignment) {
+	char* mem = (char*)mmap(NULL, size + alignment, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	char* base = align_up(mem, alignment);
+	if (base > mem)
+		munmap(mem, base - mem);
+	munmap(base + size, mem + alignment - base);
+	return base;
+}
+
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_system_alloc(size_t size) {
 	// ȷsizePAGE_SIZEı
 	assert(size/PAGE_SIZE*PAGE_SIZE == size);
-	void* ptr = system_alloc(size);
+	// segments up to a quarter superblock are carved from the superblocks
+	void* ptr = NULL;
+	if (size <= mSuperblocks.superblock_size() / 4)
+		ptr = mSuperblocks.alloc(size / PAGE_SIZE);
+	if (!ptr) {
+		ptr = map_aligned(size, PAGE_SIZE);
+		if (ptr && mNode >= 0)
+			numa_bind(ptr, size, mNode);
+	}
+	if (ptr && mNode >= 0)
+		page_map_set(ptr, size, this);
 	return ptr;
 }
 
-void HeapAllocator::tree_system_free(void* ptr, size_t size) {
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_system_free(void* ptr, size_t size) {
 	assert(ptr);
 	assert(size/PAGE_SIZE*PAGE_SIZE == size);
-	system_free(ptr);
+	if (mNode >= 0)
+		page_map_set(ptr, size, NULL);
+	if (mSuperblocks.owns(ptr))
+		mSuperblocks.free(ptr, size / PAGE_SIZE);
+	else
+		munmap(ptr, size);
 }
 
-HeapAllocator::block_header* HeapAllocator::tree_add_block(void* mem, size_t size) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::tree_add_block(void* mem, size_t size) {
+	segment* seg = (segment*)mem;
+	seg->mSize = size;
+	mSegments.push_back(seg);
+	mem = (char*)mem + sizeof(segment);
+	size -= sizeof(segment);
 	// һٵblockheaderprev()ǷΪNULLļ顣
 	block_header* front = (block_header*)mem;
 	front->prev(0);
@@ -262,21 +783,36 @@ HeapAllocator::block_header* HeapAllocator::tree_add_block(void* mem, size_t siz
 	back->size(0);
 	back->set_used();
 	front->set_unused();
+	front->set_zero(true);	//tree_system_alloc memory is fresh or decommitted
 	front->next(back);
 	back->prev(front);
 	front = coalesce_block(front);     
 	return front;
 }
 
-HeapAllocator::block_header* HeapAllocator::tree_grow(size_t size) {
-	size += 3*sizeof(block_header); //οtree_add_block
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::tree_grow(size_t size) {
+	size_t request = size;
+	if (size > MAX_TREE_GROW)
+		return NULL;
+	size += 3*sizeof(block_header) + sizeof(segment); //οtree_add_block
 	size = round_up(size, PAGE_SIZE);
-	if (void* mem = tree_system_alloc(size))
+	if (size < mGrowSize && !is_huge(size))
+		size = round_up(mGrowSize, PAGE_SIZE);
+	if (latency_enabled())
+		latency_mark(LATENCY_ALLOC_TREE_GROW);
+	void* mem = mRtRunning ? rt_take_segment(size) : NULL;
+	if (!mem)
+		mem = tree_system_alloc(size);
+	if (mem) {
+		SHARK_PROBE3(tree_grow, request, size, mem);
 		return tree_add_block(mem, size);
+	}
 	return NULL;
 }
 
-HeapAllocator::block_header* HeapAllocator::tree_extract(size_t size) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::tree_extract(size_t size) {
 	// ȼʹõĿ
 	block_header* bestBlock = mMRFreeBlock;
 	if (bestBlock && bestBlock->size() >= size) {
@@ -287,13 +823,13 @@ HeapAllocator::block_header* HeapAllocator::tree_extract(size_t size) {
 	free_node* bestNode = mFreeTree.lower_bound(size);
 	if (bestNode == mFreeTree.end())
 		return NULL;
-	bestNode = bestNode->next(); // ʹھӿ飬ͱ
 	bestBlock = bestNode->get_block();
 	tree_detach(bestBlock);
 	return bestBlock;
 }
 
-HeapAllocator::block_header* HeapAllocator::tree_extract_aligned(size_t size, size_t alignment) {
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::tree_extract_aligned(size_t size, size_t alignment) {
 	block_header* bestBlock = mMRFreeBlock;
 	if (bestBlock) {
 		size_t alignmentOffs = align_up((char*)bestBlock->mem(), alignment) - (char*)bestBlock->mem();
@@ -302,25 +838,42 @@ HeapAllocator::block_header* HeapAllocator::tree_extract_aligned(size_t size, si
 			return bestBlock;
 		}
 	}
-	size_t sizeUpper = size + alignment;
+	//best fit in size order, blocks from size + alignment on always fit so the scan stops there
 	free_node* bestNode = mFreeTree.lower_bound(size);
-	free_node* lastNode = mFreeTree.upper_bound(sizeUpper);
-	while (bestNode != lastNode) {
-		size_t alignmentOffs = align_up((char*)bestNode, alignment) - (char*)bestNode;
-		if (bestNode->get_block()->size() >= size + alignmentOffs)
+	for (unsigned scanned = 0; bestNode != mFreeTree.end() && !bestNode->fits_aligned(size, alignment); scanned++) {
+		if (scanned == ALIGNED_SCAN_LIMIT) {
+			//smallest block which is aligned already, or else the smallest one with room for any offset
+			free_node* alignedNode = find_aligned(mFreeTree.root(), size, __builtin_ctzl(alignment));
+			bestNode = mFreeTree.lower_bound(size + alignment);
+			if (alignedNode && (bestNode == mFreeTree.end() || *alignedNode < *bestNode))
+				bestNode = alignedNode;
 			break;
+		}
 		bestNode = bestNode->succ();
 	}
 	if (bestNode == mFreeTree.end())
 		return NULL;
-	if (bestNode == lastNode)
-		bestNode = bestNode->next();
 	bestBlock = bestNode->get_block();
 	tree_detach(bestBlock);
 	return bestBlock;
 }
 
-void HeapAllocator::tree_attach(block_header* bl) {
+// first node of the subtree at least size large whose address is aligned to 2^alignLog2, NULL if none
+template<class Policy>
+typename BasicHeapAllocator<Policy>::free_node* BasicHeapAllocator<Policy>::find_aligned(free_node* node, size_t size, unsigned alignLog2) {
+	if (node->nil() || node->mMaxAlignLog2 < alignLog2)
+		return NULL;
+	if (*node < size)
+		return find_aligned(node->right(), size, alignLog2);
+	if (free_node* found = find_aligned(node->left(), size, alignLog2))
+		return found;
+	if (node->align_log2() >= alignLog2)
+		return node;
+	return find_aligned(node->right(), size, alignLog2);
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_attach(block_header* bl) {
 	if (mMRFreeBlock) {
 		block_header* lastBl = mMRFreeBlock;
 		if (lastBl->size() > MAX_SMALL_ALLOCATION) {
@@ -332,7 +885,8 @@ void HeapAllocator::tree_attach(block_header* bl) {
 	mMRFreeBlock = bl;
 }
 
-void HeapAllocator::tree_detach(block_header* bl) {
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_detach(block_header* bl) {
 	if (mMRFreeBlock == bl) {
 		mMRFreeBlock = NULL;
 		return;
@@ -344,38 +898,72 @@ void HeapAllocator::tree_detach(block_header* bl) {
 	}
 }
 
-void* HeapAllocator::tree_alloc(size_t size) {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_alloc(size_t size, bool* zero) {
+	scope_lock lock(mTreeMutex);
+	return tree_alloc_unlocked(size, zero);
+}
+
+// zero (optional) tells whether the block is zero past its first sizeof(free_node) bytes
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_alloc_unlocked(size_t size, bool* zero) {
 	if (size < sizeof(free_node))
 		size = sizeof(free_node);
 	size = round_up(size, sizeof(block_header));
-	block_header* newBl = tree_extract(size);
+	//huge blocks keep their whole segment, so it can be released on free
+	bool huge = is_huge(size);
+	block_header* newBl = NULL;
+	if (mQuickCount && !huge) {
+		if ((newBl = tree_quick_get(size)) != NULL)
+			return newBl->mem();
+	}
+	if (!huge) {
+		newBl = tree_extract(size);
+		if (!newBl && mQuickCount) {
+			tree_quick_flush();
+			newBl = tree_extract(size);
+		}
+	}
 	if (!newBl) {
+		SHARK_PROBE2(tree_extract_miss, size, 0);
 		newBl = tree_grow(size);
 		if (!newBl)
 			return NULL;
 	}
 	
 	assert(newBl && newBl->size() >= size);
-	if (newBl->size() >= size + sizeof(block_header) + sizeof(free_node)) {
+	if (!huge && newBl->size() >= size + sizeof(block_header) + sizeof(free_node)) {
 		split_block(newBl, size);
 		tree_attach(newBl->next());
 	}
+	if (zero)
+		*zero = newBl->zero();
 	newBl->set_used();
 	return newBl->mem();
 }
 
-void* HeapAllocator::tree_alloc_aligned(size_t size, size_t alignment) {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_alloc_aligned(size_t size, size_t alignment) {
+	scope_lock lock(mTreeMutex);
+	return tree_alloc_aligned_unlocked(size, alignment);
+}
+
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_alloc_aligned_unlocked(size_t size, size_t alignment) {
 	if (size < sizeof(free_node))
 		size = sizeof(free_node);
 	size = round_up(size, sizeof(block_header));
-	block_header* newBl = tree_extract_aligned(size, alignment);
+	bool huge = is_huge(size);
+	block_header* newBl = NULL;
+	if (!huge) {
+		newBl = tree_extract_aligned(size, alignment);
+		if (!newBl && mQuickCount) {
+			tree_quick_flush();
+			newBl = tree_extract_aligned(size, alignment);
+		}
+	}
 	if (!newBl) {
+		SHARK_PROBE2(tree_extract_miss, size, alignment);
 		newBl = tree_grow(size + alignment);
 		if (!newBl)
 			return NULL;
@@ -390,7 +978,7 @@ void* HeapAllocator::tree_alloc_aligned(size_t size, size_t alignment) {
 	} else if (alignmentOffs > 0) {
 		newBl = shift_block(newBl, alignmentOffs);
 	}
-	if (newBl->size() >= size + sizeof(block_header) + sizeof(free_node)) {
+	if (!huge && newBl->size() >= size + sizeof(block_header) + sizeof(free_node)) {
 		split_block(newBl, size);
 		tree_attach(newBl->next());
 	}
@@ -399,10 +987,9 @@ void* HeapAllocator::tree_alloc_aligned(size_t size, size_t alignment) {
 	return newBl->mem();
 }
 
-void* HeapAllocator::tree_realloc(void* ptr, size_t size) {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_realloc(void* ptr, size_t size) {
+	scope_lock lock(mTreeMutex);
 	if (size < sizeof(free_node))
 		size = sizeof(free_node);
 	size = round_up(size, sizeof(block_header));
@@ -456,20 +1043,19 @@ void* HeapAllocator::tree_realloc(void* ptr, size_t size) {
 		return newPtr;
 	}
 	
-	void* newPtr = tree_alloc(size);
+	void* newPtr = tree_alloc_unlocked(size);
 	if (newPtr) {
 		memcpy(newPtr, ptr, blSize);
-		tree_free(ptr);
+		tree_free_unlocked(ptr);
 		return newPtr;
 	}
 	return NULL;
 }
 
-void* HeapAllocator::tree_realloc_aligned(void* ptr, size_t size, size_t alignment) {
+template<class Policy>
+void* BasicHeapAllocator<Policy>::tree_realloc_aligned(void* ptr, size_t size, size_t alignment) {
 	assert(((size_t)ptr & (alignment-1)) == 0);
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+	scope_lock lock(mTreeMutex);
 	if (size < sizeof(free_node))
 		size = sizeof(free_node);
 	size = round_up(size, sizeof(block_header));
@@ -527,22 +1113,23 @@ void* HeapAllocator::tree_realloc_aligned(void* ptr, size_t size, size_t alignme
 		}
 		return newPtr;
 	}
-	void* newPtr = tree_alloc_aligned(size, alignment);
+	void* newPtr = tree_alloc_aligned_unlocked(size, alignment);
 	if (newPtr) {
 		memcpy(newPtr, ptr, blSize - DEBUG_EXTRA_INFO_SIZE);
-		tree_free(ptr);
+		tree_free_unlocked(ptr);
 		return newPtr;
 	}
 	return NULL;
 }
 
-size_t HeapAllocator::tree_resize(void* ptr, size_t size) {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+size_t BasicHeapAllocator<Policy>::tree_resize(void* ptr, size_t minSize, size_t size) {
+	scope_lock lock(mTreeMutex);
 	if (size < sizeof(free_node))
 		size = sizeof(free_node);
 	size = round_up(size, sizeof(block_header));
+	minSize = round_up(minSize, sizeof(block_header));
+	assert(minSize <= size);
 	block_header* bl = ptr_get_block_header(ptr); 
 	size_t blSize = bl->size();
 	if (blSize >= size) {
@@ -555,82 +1142,172 @@ size_t HeapAllocator::tree_resize(void* ptr, size_t size) {
 		assert(bl->size() >= size);
 		return bl->size();
 	}
+	//grow into the free right neighbour, as far as size if it is big enough
 	block_header* next = bl->next();
-	if (!next->used() && blSize + next->size() + sizeof(block_header) >= size) {
+	if (next->used() && mQuickCount)
+		tree_quick_flush();	//the neighbour may only be waiting in a quick list
+	if (!next->used() && blSize + next->size() + sizeof(block_header) >= minSize) {
 		tree_detach(next);
 		next->unlink();
 		if (bl->size() >= size + sizeof(block_header) + sizeof(free_node)) {
 			split_block(bl, size);
 			tree_attach(bl->next());
 		}
-		assert(bl->size() >= size);
+		assert(bl->size() >= minSize);
 	}
 	return bl->size();
 }
 
-void HeapAllocator::tree_free(void* ptr) {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_free(void* ptr) {
+	scope_lock lock(mTreeMutex);
+	tree_free_unlocked(ptr);
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_free_unlocked(void* ptr) {
 	block_header* bl = ptr_get_block_header(ptr);
+	if (mQuickMax && !is_huge(bl->size())) {
+		//the block stays marked used, so neighbours don't merge with it while it waits
+		mQuickLists[quick_index(bl->size())].push_front((quick_node*)ptr);
+		if (++mQuickCount > mQuickMax)
+			tree_quick_flush();
+		return;
+	}
 	bl->set_unused();
+	if (latency_enabled() && (!bl->prev()->used() || !bl->next()->used()))
+		latency_mark(LATENCY_FREE_COALESCE);
 	bl = coalesce_block(bl);
 	tree_attach(bl);
+	if (is_huge(bl->size()))
+		tree_purge_block(bl);
+}
+
+// deferred block of exactly size, NULL if there is none
+template<class Policy>
+typename BasicHeapAllocator<Policy>::block_header* BasicHeapAllocator<Policy>::tree_quick_get(size_t size) {
+	quick_node_list& list = mQuickLists[quick_index(size)];
+	for (quick_node* node = list.begin(); node != list.end(); node = node->next()) {
+		block_header* bl = ptr_get_block_header(node);
+		if (bl->size() == size) {
+			node->unlink();
+			mQuickCount--;
+			return bl;
+		}
+	}
+	return NULL;
 }
 
-void HeapAllocator::tree_purge_block(block_header* bl) {
+// merges every deferred block into the tree
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_quick_flush() {
+	SHARK_PROBE1(quick_flush, mQuickCount);
+	for (unsigned i = 0; i < QUICK_LISTS && mQuickCount; i++) {
+		quick_node_list& list = mQuickLists[i];
+		while (!list.empty()) {
+			quick_node* node = &list.front();
+			node->unlink();
+			mQuickCount--;
+			block_header* bl = ptr_get_block_header(node);
+			bl->set_unused();
+			bl = coalesce_block(bl);
+			tree_attach(bl);
+		}
+	}
+	assert(mQuickCount == 0);
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_purge_block(block_header* bl) {
 	assert(!bl->used());
 	assert(bl->prev() && bl->prev()->used());
 	assert(bl->next() && bl->next()->used());
 	if (bl->prev()->prev() == NULL && bl->next()->size() == 0) {
 		tree_detach(bl);
-		char* memStart = (char*)bl->prev();
+		char* memStart = (char*)bl->prev() - sizeof(segment);
 		char* memEnd = (char*)bl->mem() + bl->size() + sizeof(block_header);
 		void* mem = memStart;
 		size_t size = memEnd - memStart;
 		assert(((size_t)mem & (PAGE_SIZE-1)) == 0);
 		assert((size & (PAGE_SIZE-1)) == 0);
+		segment* seg = (segment*)mem;
+		assert(seg->size() == size);
+		seg->unlink();
+		SHARK_PROBE2(tree_purge_block, mem, size);
 		tree_system_free(mem, size);
 	}
 }
 
-void HeapAllocator::tree_purge() {
-	#ifdef MULTITHREADED
-	ScopeLock lock(mTreeMutex);
-	#endif
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_purge() {
+	scope_lock lock(mTreeMutex);
 	
+	if (mQuickCount)
+		tree_quick_flush();
 	tree_attach(NULL);
-	size_t pageSize = PAGE_SIZE-3*sizeof(block_header)-sizeof(free_node);
+	size_t pageSize = PAGE_SIZE-3*sizeof(block_header)-sizeof(segment)-sizeof(free_node);
 	free_node* node = mFreeTree.lower_bound(pageSize);
 	free_node* end = mFreeTree.end();
+	size_t retained = 0;
 	while (node != end) {
 		block_header* cur = node->get_block();
 		node = node->succ();
+		//keep up to mRetainBytes of whole free segments, smallest first
+		if (cur->prev()->prev() == NULL && cur->next()->size() == 0 && retained + cur->size() <= mRetainBytes) {
+			retained += cur->size();
+			continue;
+		}
 		tree_purge_block(cur);
 	}
 	tree_attach(NULL);
 }
 
-HeapAllocator::HeapAllocator() : mMRFreeBlock(NULL)
+template<class Policy>
+BasicHeapAllocator<Policy>::BasicHeapAllocator() : mMRFreeBlock(NULL), mFreeTree(&free_node::augment), mQuickCount(0), mQuickMax(0), mNode(-1), mCpuCaches(NULL), mCpuCount(0), mCpuCacheDepth(0),
+	mGrowSize(PAGE_SIZE), mHugeThreshold(0), mRetainBytes(0), mLatencyStats(false),
+	mPagePoolSize(0), mPagePoolMax(64), mPagePoolDecay(10000000000ULL),
+	mLifetime(NULL), mLifetimeRate(0), mLifetimeShortNs(1000000),
+	mReserveSegmentCount(0), mRtPages(64), mRtPoolMax(64), mRtSegments(4), mRtSegmentSize(1024*1024), mRtBreaches(0), mRtMisses(0),
+	mRtRunning(false), mRtWake(false), mSuperblocks(PAGE_SIZE_LOG2)
 {
+	pthread_cond_init(&mRtCond, NULL);
+	if (const char* conf = getenv("SHARK_HEAP_CONF"))
+		configure(conf);
 }
 
-HeapAllocator::~HeapAllocator()
+template<class Policy>
+BasicHeapAllocator<Policy>::~BasicHeapAllocator()
 {
+	if (allocator == this)
+		allocator = NULL;
+	rt_stop();
+	pthread_cond_destroy(&mRtCond);
+	//retained segments have nobody left to reuse them
+	mRetainBytes = 0;
 	purge();
-	#ifdef DEBUG_ALLOCATOR
-	check();
-	report();
-	#endif
-	for (unsigned i = 0; i < NUM_BUCKETS; i++)
+	if (mCpuCaches) {
+		system_free(mCpuCaches);
+		mCpuCaches = NULL;
+	}
+	if (mLifetime) {
+		system_free(mLifetime);
+		mLifetime = NULL;
+	}
+	if (debug_type::ENABLED) {
+		check();
+		report();
+	}
+	for (unsigned i = 0; i < NUM_HEAP_BUCKETS; i++)
 		assert(mBuckets[i].page_list_empty());
 	assert(mFreeTree.empty());
 	assert(mSmallFreeList.empty());
 	assert(mMRFreeBlock == NULL);
 }
 
-HeapAllocator::bucket::bucket() 
+template<class Policy>
+BasicHeapAllocator<Policy>::bucket::bucket() 
 { 	
+	mLock.set_spin_count(SPIN_COUNT);
 	#if (RAND_MAX <= SHRT_MAX)
 	mMarker = (rand()*(RAND_MAX+1) + rand()) ^ MARKER;
 	#else
@@ -638,48 +1315,74 @@ HeapAllocator::bucket::bucket()
 	#endif
 }
 
-void* HeapAllocator::alloc(size_t size, const char* filename, int linenum)
+template<class Policy>
+void* BasicHeapAllocator<Policy>::alloc(size_t size, const char* filename, int linenum)
 {
 	if (!is_small_allocation(size)) {
+		LatencyScope timer(latency_enabled(), LATENCY_ALLOC_TREE);
 		uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 		void* ptr = tree_alloc(trueSize);
-		return debug_alloc(ptr, size,  trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
+		return mDebug.alloc(ptr, size,  trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
 	}
 	if (size == 0)
 		return NULL;
+	LatencyScope timer(latency_enabled(), LATENCY_ALLOC_BUCKET);
 	size = clamp_small_allocation(size);
 	uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
-	void* ptr = bucket_alloc_direct(bucket_spacing_function(trueSize));
+	unsigned bi = bucket_spacing_function(trueSize);
+	bool sample = false;
+	if (__atomic_load_n(&mLifetimeRate, __ATOMIC_RELAXED))
+		bi = lifetime_bucket(bi, filename, linenum, sample);
+	void* ptr = bucket_alloc_direct(bi);
+	if (sample && ptr)
+		lifetime_sample_alloc(ptr, filename, linenum);
 	trueSize = round_up(trueSize, MIN_ALLOCATION);
-	return debug_alloc(ptr, size, trueSize, DEBUG_SOURCE_BUCKETS, ALIGN_NONE, filename, linenum);
+	return mDebug.alloc(ptr, size, trueSize, DEBUG_SOURCE_BUCKETS, ALIGN_NONE, filename, linenum);
 }
 
-void* HeapAllocator::alloc(size_t size, size_t alignment, const char* filename, int linenum)
+template<class Policy>
+void* BasicHeapAllocator<Policy>::alloc(size_t size, size_t alignment, const char* filename, int linenum)
 {
 	assert((alignment & (alignment-1)) == 0);
 	if (alignment <= DEFAULT_ALIGNMENT)
 			return alloc(size);
-	if (!is_small_allocation(size) || alignment > MAX_SMALL_ALLOCATION) {
+	if (!is_small_aligned_allocation(size, alignment)) {
+		LatencyScope timer(latency_enabled(), LATENCY_ALLOC_TREE);
 		uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 		void* ptr = tree_alloc_aligned(trueSize, alignment);
-		return debug_alloc(ptr, size, trueSize, DEBUG_SOURCE_TREE, alignment, filename, linenum);
+		return mDebug.alloc(ptr, size, trueSize, DEBUG_SOURCE_TREE, alignment, filename, linenum);
 	}
 	if (size == 0)
 		return NULL;
-	size = clamp_small_allocation(size);
-	uint32 trueSize = round_up(size + DEBUG_EXTRA_INFO_SIZE, alignment);
-	void* ptr = bucket_alloc_direct(bucket_spacing_function(trueSize));
-	return debug_alloc(ptr, size, trueSize, DEBUG_SOURCE_BUCKETS, alignment, filename, linenum);
+	LatencyScope timer(latency_enabled(), LATENCY_ALLOC_BUCKET);
+	uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
+	unsigned bi = aligned_bucket_index(trueSize, alignment);
+	void* ptr = bucket_alloc_direct(bi);
+	return mDebug.alloc(ptr, size, bucket_elem_size_of(bi), DEBUG_SOURCE_BUCKETS, alignment, filename, linenum);
 }
 
-void* HeapAllocator::calloc(size_t count, size_t size)
+template<class Policy>
+void* BasicHeapAllocator<Policy>::calloc(size_t count, size_t size)
 {
-	void* p = alloc(count * size);
+	if (size && count > (size_t)-1 / size)
+		return NULL;
+	size = count * size;
+	if (debug_type::ENABLED || is_small_allocation(size)) {
+		void* p = alloc(size);
+		if (p)
+			memset(p, 0, size);
+		return p;
+	}
+	// blocks carved from fresh segments only need their free list links cleared
+	LatencyScope timer(latency_enabled(), LATENCY_ALLOC_TREE);
+	bool zero = false;
+	void* p = tree_alloc(size, &zero);
 	if (p)
-		memset(p, 0, count * size);
+		memset(p, 0, zero && size > sizeof(free_node) ? sizeof(free_node) : size);
 	return p;
 }
-void* HeapAllocator::realloc(void* ptr, size_t size, const char* filename, int linenum)
+template<class Policy>
+void* BasicHeapAllocator<Policy>::realloc(void* ptr, size_t size, const char* filename, int linenum)
 {
 	if (ptr == NULL)
 		return alloc(size);
@@ -687,29 +1390,31 @@ void* HeapAllocator::realloc(void* ptr, size_t size, const char* filename, int l
 		free(ptr);
 		return NULL;
 	}
-	debug_check(ptr);
-	void* pRealMem = (void*)debug_free(ptr);
+	LatencyScope timer(latency_enabled(), LATENCY_REALLOC);
+	mDebug.check(ptr);
+	void* pRealMem = (void*)mDebug.free(ptr);
 	if (ptr_in_bucket(pRealMem)) {
 		size = clamp_small_allocation(size);
 		if (is_small_allocation(size)) {
 			uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 			void* newPtr = bucket_realloc(pRealMem,trueSize);
-			return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_BUCKETS, ALIGN_NONE, filename, linenum);
+			return mDebug.alloc(newPtr, size, trueSize, DEBUG_SOURCE_BUCKETS, ALIGN_NONE, filename, linenum);
 		}
 		uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 		void* newPtr = tree_alloc(trueSize);
 		if (!newPtr)
 			return NULL;
 		uint32 origSize = ptr_get_page(pRealMem)->elem_size();
-		memcpy(newPtr, pRealMem, origSize);
+		memcpy(newPtr, pRealMem, origSize < trueSize ? origSize : trueSize);
 		bucket_free(pRealMem);
-		return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
+		return mDebug.alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
 	}
 	uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 	void* newPtr = tree_realloc(pRealMem, trueSize);
-	return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
+	return mDebug.alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, ALIGN_NONE, filename, linenum);
 }
-void* HeapAllocator::realloc(void* ptr, size_t size, size_t alignment, const char* filename, int linenum)
+template<class Policy>
+void* BasicHeapAllocator<Policy>::realloc(void* ptr, size_t size, size_t alignment, const char* filename, int linenum)
 {
 	assert((alignment & (alignment-1)) == 0);
 	if (alignment <= DEFAULT_ALIGNMENT)
@@ -720,43 +1425,45 @@ void* HeapAllocator::realloc(void* ptr, size_t size, size_t alignment, const cha
 		free(ptr);
 		return NULL;
 	}
-	
-	void* pRealMem = (void*)debug_free(ptr);
+	LatencyScope timer(latency_enabled(), LATENCY_REALLOC);
+	void* pRealMem = (void*)mDebug.free(ptr);
 	if ((size_t)ptr & (alignment-1)) {
-		uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
-		void* newPtr = alloc(trueSize, alignment);
+		void* newPtr = alloc(size, alignment, filename, linenum);
 		if (!newPtr)
 			return NULL;
 		size_t count = this->size(pRealMem);
 		if (count > size)
 			count = size;
 		memcpy(newPtr, ptr, count);
-		free(ptr);
+		//the debug record of ptr is already gone, release the raw block
+		if (ptr_in_bucket(pRealMem))
+			bucket_free(pRealMem);
+		else
+			tree_free(pRealMem);
 		return newPtr;
 	}
-	debug_check(ptr);
+	mDebug.check(ptr);
 	if (ptr_in_bucket(pRealMem)) {
-		size = clamp_small_allocation(size);
-		if (is_small_allocation(size) && alignment <= MAX_SMALL_ALLOCATION) {
-			uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
-			void* newPtr = bucket_realloc(ptr, trueSize);
-			return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_BUCKETS, alignment, filename, linenum);
-		}
 		uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
-		void* newPtr = tree_alloc_aligned(trueSize, alignment);
+		size_t origSize = ptr_get_page(pRealMem)->elem_size();
+		if (trueSize <= origSize)
+			return mDebug.alloc(pRealMem, size, trueSize, DEBUG_SOURCE_BUCKETS, alignment, filename, linenum);
+		bool small = is_small_aligned_allocation(size, alignment);
+		void* newPtr = small ? bucket_alloc_direct(aligned_bucket_index(trueSize, alignment)) : tree_alloc_aligned(trueSize, alignment);
 		if (!newPtr)
 			return NULL;
-		memcpy(newPtr, pRealMem, ptr_get_page(pRealMem)->elem_size());
+		memcpy(newPtr, pRealMem, origSize);
 		bucket_free(pRealMem);
-		return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, alignment, filename, linenum);
+		return mDebug.alloc(newPtr, size, trueSize, small ? DEBUG_SOURCE_BUCKETS : DEBUG_SOURCE_TREE, alignment, filename, linenum);
 	}
 	uint32 trueSize = size + DEBUG_EXTRA_INFO_SIZE;
 	void* newPtr = tree_realloc_aligned(ptr, trueSize, alignment);
-	return debug_alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, alignment, filename, linenum);
+	return mDebug.alloc(newPtr, size, trueSize, DEBUG_SOURCE_TREE, alignment, filename, linenum);
 }
 
 //ʵҪڴ棬ҪȥϢ
-size_t HeapAllocator::size(void* pRealMem) const
+template<class Policy>
+size_t BasicHeapAllocator<Policy>::size(void* pRealMem) const
 {
 	if (pRealMem == NULL)
 		return 0;
@@ -765,174 +1472,643 @@ size_t HeapAllocator::size(void* pRealMem) const
 	return ptr_get_block_header(pRealMem)->size() - DEBUG_EXTRA_INFO_SIZE;
 }
 
-void HeapAllocator::free(void* ptr)
+template<class Policy>
+size_t BasicHeapAllocator<Policy>::usable_size(void* ptr) const
+{
+	if (ptr == NULL)
+		return 0;
+	void* realPtr = debug_type::getMemoryBlockHeader(ptr);
+	size_t capacity = ptr_has_bucket_marker(realPtr) ? ptr_get_page(realPtr)->elem_size() : ptr_get_block_header(realPtr)->size();
+	return debug_type::usable_size(ptr, capacity - DEBUG_EXTRA_INFO_SIZE);
+}
+
+template<class Policy>
+size_t BasicHeapAllocator<Policy>::try_expand(void* ptr, size_t minSize, size_t preferredSize)
+{
+	if (ptr == NULL)
+		return 0;
+	if (preferredSize < minSize)
+		preferredSize = minSize;
+	size_t cur = usable_size(ptr);
+	if (cur >= preferredSize)
+		return cur;
+	void* realPtr = debug_type::getMemoryBlockHeader(ptr);
+	//bucket slots have a fixed size, only their unused tail can be handed out
+	size_t capacity = ptr_in_bucket(realPtr) ? ptr_get_page(realPtr)->elem_size() : 
+		tree_resize(realPtr, minSize + DEBUG_EXTRA_INFO_SIZE, preferredSize + DEBUG_EXTRA_INFO_SIZE);
+	if (capacity < minSize + DEBUG_EXTRA_INFO_SIZE)
+		return cur;
+	size_t size = capacity - DEBUG_EXTRA_INFO_SIZE;
+	mDebug.resize(ptr, size < preferredSize ? size : preferredSize, capacity);
+	return usable_size(ptr);
+}
+
+template<class Policy>
+size_t BasicHeapAllocator<Policy>::shrink(void* ptr, size_t size)
+{
+	if (ptr == NULL)
+		return 0;
+	size_t cur = usable_size(ptr);
+	if (size >= cur)
+		return cur;
+	void* realPtr = debug_type::getMemoryBlockHeader(ptr);
+	size_t trueSize = size + DEBUG_EXTRA_INFO_SIZE;
+	size_t capacity = ptr_in_bucket(realPtr) ? ptr_get_page(realPtr)->elem_size() : tree_resize(realPtr, trueSize, trueSize);
+	mDebug.resize(ptr, size, capacity);
+	return usable_size(ptr);
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::free(void* ptr)
 {
 	if (ptr == NULL)
 		return;
-	char* realPtr = (char*)debug_free(ptr);
+	char* realPtr = (char*)mDebug.free(ptr);
+	if (ptr_in_bucket(realPtr)) {
+		LatencyScope timer(latency_enabled(), LATENCY_FREE_BUCKET);
+		return bucket_free(realPtr);
+	}
+	LatencyScope timer(latency_enabled(), LATENCY_FREE_TREE);
+	tree_free(realPtr);
+}
+
+template<class Policy>
+bool BasicHeapAllocator<Policy>::owns(void* ptr) const
+{
+	if (ptr == NULL)
+		return false;
+	char* realPtr = (char*)debug_type::getMemoryBlockHeader(ptr);
 	if (ptr_in_bucket(realPtr))
+		return true;
+	scope_lock lock(mTreeMutex);
+	for (const segment* seg = mSegments.begin(); seg != mSegments.end(); seg = seg->next()) {
+		if (realPtr > (char*)seg && realPtr < (char*)seg + seg->size())
+			return true;
+	}
+	return false;
+}
+
+template<class Policy>
+void BasicHeapAllocator<Policy>::free(void* ptr, size_t size, size_t alignment)
+{
+	if (ptr == NULL)
+		return;
+	char* realPtr = (char*)mDebug.free(ptr);
+	//alloc() sends these sizes to the buckets, so there is no need to look the page up
+	if (alignment <= DEFAULT_ALIGNMENT ? is_small_allocation(size) : is_small_aligned_allocation(size, alignment)) {
+		assert(ptr_in_bucket(realPtr));
+		LatencyScope timer(latency_enabled(), LATENCY_FREE_BUCKET);
 		return bucket_free(realPtr);
+	}
+	assert(!ptr_in_bucket(realPtr));
+	LatencyScope timer(latency_enabled(), LATENCY_FREE_TREE);
 	tree_free(realPtr);
 }
 
-void HeapAllocator::purge()
+template<class Policy>
+void BasicHeapAllocator<Policy>::purge()
 {
+	cpu_cache_flush();
 	tree_purge();
 	bucket_purge();
+	scope_lock lock(mPagePoolLock);
+	page_pool_trim(0, latency_now());
 }
 
-void* HeapAllocator::debug_alloc(void* pRealMem, size_t size, size_t trueSize, debug_source src, uint8 align, const char* filename, int linenum)
+template<class Policy>
+void BasicHeapAllocator<Policy>::decay()
 {
-	char* pClientMem = (char*)pRealMem;
-	#ifdef DEBUG_ALLOCATOR
-	pClientMem = (char*)pRealMem + s_blockHeadSize + s_preBufferSize;
-	
-	sMemoryBlockHeader* blockHeader = (sMemoryBlockHeader*)pRealMem;
-	blockHeader->actualSize = trueSize;
-	blockHeader->pointerOffset = pClientMem - (char*)pRealMem;
+	scope_lock lock(mPagePoolLock);
+	page_pool_trim(mPagePoolMax, latency_now());
+}
 
-	sPreBufferData* pPreBufferData = getPreBufferData(pClientMem);
-	if(pPreBufferData == sTopMemoryBlock)
-		return pClientMem;
-	
-	pPreBufferData->nextHeader = sTopMemoryBlock;
-	pPreBufferData->previousHeader = 0;
-	pPreBufferData->requestedSize =  size;
-	pPreBufferData->userChecksum = 0;
-	pPreBufferData->fileLine = linenum;
-	pPreBufferData->alignment = align;
-	pPreBufferData->debug_source = src;
-
-	if (sTopMemoryBlock)
-	{
-		sTopMemoryBlock->previousHeader = pPreBufferData;
-	}
-	sTopMemoryBlock = pPreBufferData;
+template<class Policy>
+bool BasicHeapAllocator<Policy>::reserve_commit(void* mem, size_t size, unsigned flags)
+{
+	if (flags & RESERVE_POPULATE)
+		prefault(mem, size);
+	// mlock faults the pages in by itself
+	return !(flags & RESERVE_LOCK) || mlock(mem, size) == 0;
+}
 
-	if (filename)
-	{
-		strncpy(pPreBufferData->fileName, filename, MAX_FILEPATH); // filename of the caller
+// grows bucket bi until its pages hold at least slots free slots
+template<class Policy>
+bool BasicHeapAllocator<Policy>::reserve_bucket(unsigned bi, size_t slots, unsigned flags)
+{
+	assert(bi < NUM_HEAP_BUCKETS);
+	scope_lock lock(mBuckets[bi].get_lock());
+	size_t free = 0;
+	for (unsigned b = bucket::BIN_HIGH; b < bucket::NUM_BINS; b++) {
+		const page* pe = mBuckets[bi].bin(b).end();
+		for (const page* p = mBuckets[bi].bin(b).begin(); p != pe; p = p->next())
+			free += p->slot_count() - p->count();
 	}
-	else
-	{
-		strncpy(pPreBufferData->fileName, "unknown", MAX_FILEPATH); // filename of the caller
+	bool ok = true;
+	while (free < slots) {
+		page* p = bucket_grow(bi);
+		if (!p)
+			return false;
+		mBuckets[bi].add_free_page(p);
+		free += p->slot_count();
+		if (!reserve_commit(align_down((char*)p, PAGE_SIZE), PAGE_SIZE, flags))
+			ok = false;
 	}
+	return ok;
+}
 
-	uint8* prePattern = pPreBufferData->bytePattern;
-	uint8* postPattern = (uint8*)pClientMem + size;
-	for (int i=0;i< PATTERN_SIZE;i++)
-	{
-		prePattern[i]=(char) PRE_PATTERN;
-		postPattern[i]=(char) POST_PATTERN;
+// adds one free tree block of at least bytes
+template<class Policy>
+bool BasicHeapAllocator<Policy>::reserve_tree(size_t bytes, unsigned flags)
+{
+	scope_lock lock(mTreeMutex);
+	block_header* bl = tree_grow(bytes);
+	if (!bl)
+		return false;
+	tree_attach(bl);
+	return reserve_commit(bl->mem(), bl->size(), flags);
+}
+
+template<class Policy>
+bool BasicHeapAllocator<Policy>::reserve(size_t size, size_t count, unsigned flags)
+{
+	if (size == 0 || count == 0)
+		return true;
+	if (is_small_allocation(size)) {
+		size = clamp_small_allocation(size);
+		return reserve_bucket(bucket_spacing_function(size + DEBUG_EXTRA_INFO_SIZE), count, flags);
 	}
-	
-	sAllocAccount++;
-	sTotalBytesRequested += size;
-	sTotalBytesInUse += trueSize;
-	
-	sMaximumBytesRequested = 
-		maximum(sMaximumBytesRequested,
-				sTotalBytesRequested);
+	size_t blockSize = round_up(size + DEBUG_EXTRA_INFO_SIZE, sizeof(block_header)) + sizeof(block_header);
+	// huge requests map their own segment anyway
+	if (blockSize < size || count > (size_t)-1 / blockSize || is_huge(blockSize))
+		return false;
+	return reserve_tree(blockSize * count, flags);
+}
 
-	sMaxinumBytesInUse = 
-		maximum(sMaxinumBytesInUse,
-				sTotalBytesInUse);
-	#endif
-	return pClientMem;
+/*
+ * Profile format, one entry per line:
+ *	bucket <index> <elem_size> <slots_used>
+ *	tree <bytes_used>
+ * Lines starting with # are comments.
+ */
+template<class Policy>
+int BasicHeapAllocator<Policy>::dump_profile(const char* path) const
+{
+	FILE* f = fopen(path, "w");
+	if (!f)
+		return errno;
+	fprintf(f, "# shark heap profile\n");
+	for (unsigned bi = 0; bi < NUM_HEAP_BUCKETS; bi++) {
+		size_t pages, used, slots, emptyPages;
+		bucket_stats(bi, pages, used, slots, emptyPages);
+		if (used)
+			fprintf(f, "bucket %u %zu %zu\n", bi, bucket_elem_size_of(bi), used);
+	}
+	size_t freeBytes, freeBlocks, smallFreeBlocks, segments, segmentBytes;
+	tree_stats(freeBytes, freeBlocks, smallFreeBlocks, segments, segmentBytes);
+	if (segmentBytes > freeBytes)
+		fprintf(f, "tree %zu\n", segmentBytes - freeBytes);
+	int err = ferror(f) ? EIO : 0;
+	if (fclose(f) != 0 && !err)
+		err = errno;
+	return err;
 }
 
-void* HeapAllocator::debug_free(void* pClientMem)
+template<class Policy>
+int BasicHeapAllocator<Policy>::prewarm(const char* path, unsigned flags)
 {
-	void* pRealPtr = pClientMem;
-	#ifdef DEBUG_ALLOCATOR
-	sMemoryBlockHeader* pHeader = getMemoryBlockHeader((char*)pClientMem);
-	pRealPtr = (void*)pHeader;
-
-	sPreBufferData* pPreBufferData = getPreBufferData(pClientMem);
-	uint8* prePattern = pPreBufferData->bytePattern;
-	uint8* postPattern = (uint8*)pPreBufferData + s_preBufferSize + pPreBufferData->requestedSize;
-	for (int i=0;i<PATTERN_SIZE;++i)
-	{
-		assert(prePattern[i]==(uint8)PRE_PATTERN);	//memory overrun detected
-		assert(postPattern[i]==(uint8)POST_PATTERN);//memory overrun detected
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return errno;
+	int result = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned bi;
+		size_t elemSize, count;
+		bool ok = true;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		} else if (sscanf(line, "bucket %u %zu %zu", &bi, &elemSize, &count) == 3) {
+			// a profile of another heap configuration still maps by element size
+			if (bi < NUM_HEAP_BUCKETS && bucket_elem_size_of(bi) == elemSize)
+				ok = reserve_bucket(bi, count, flags);
+			else if (elemSize && elemSize <= MAX_SMALL_ALLOCATION)
+				ok = reserve_bucket(bucket_spacing_function(elemSize), count, flags);
+		} else if (sscanf(line, "tree %zu", &count) == 1) {
+			ok = is_huge(count) || reserve_tree(count, flags);
+		} else {
+			result = EINVAL;
+		}
+		if (!ok && !result)
+			result = ENOMEM;
 	}
-	sReleaseAccount++;
-	sTotalBytesRequested -= pPreBufferData->requestedSize;
-	sTotalBytesInUse -= pHeader->actualSize;
-	if (sTopMemoryBlock == pPreBufferData)
-	{
-		sTopMemoryBlock = sTopMemoryBlock->nextHeader;
+	fclose(f);
+	return result;
+}
+
+// Hand every page and segment back to the system, live blocks are not visited.
+template<class Policy>
+void BasicHeapAllocator<Policy>::destroy()
+{
+	rt_stop();
+	if (mCpuCaches) {
+		for (int cpu = 0; cpu < mCpuCount; cpu++)
+			memset(mCpuCaches[cpu].mCount, 0, sizeof(mCpuCaches[cpu].mCount));
 	}
-	if (pPreBufferData->nextHeader)
-	{
-		pPreBufferData->nextHeader->previousHeader = pPreBufferData->previousHeader;
+	for (unsigned i = 0; i < NUM_HEAP_BUCKETS; i++) {
+		scope_lock lock(mBuckets[i].get_lock());
+		for (unsigned b = 0; b < bucket::NUM_BINS; b++) {
+			page_list& pages = mBuckets[i].bin(b);
+			while (!pages.empty()) {
+				page* p = &pages.front();
+				p->unlink();
+				bucket_system_free(align_down((char*)p, PAGE_SIZE));
+			}
+		}
 	}
-	if (pPreBufferData->previousHeader)
 	{
-		pPreBufferData->previousHeader->nextHeader = pPreBufferData->nextHeader;
+		scope_lock lock(mPagePoolLock);
+		page_pool_trim(0, 0);
 	}
-	#endif
-	return pRealPtr;
+	//samples of the released blocks would be matched by the next block at their address
+	if (lifetime_tables* tables = lifetime()) {
+		scope_lock lock(mLifetimeLock);
+		memset(tables->mSamples, 0, sizeof(tables->mSamples));
+	}
+	scope_lock lock(mTreeMutex);
+	mMRFreeBlock = NULL;
+	mFreeTree.reset();
+	mSmallFreeList.reset();
+	for (unsigned i = 0; i < QUICK_LISTS; i++)
+		mQuickLists[i].reset();
+	mQuickCount = 0;
+	while (!mSegments.empty()) {
+		segment* seg = &mSegments.front();
+		seg->unlink();
+		tree_system_free(seg, seg->size());
+	}
+	mDebug.reset();
 }
 
-void HeapAllocator::debug_check(void* pClientMem)
+template<class Policy>
+void BasicHeapAllocator<Policy>::lock_report() const
 {
-	#ifdef DEBUG_ALLOCATOR
-	sPreBufferData* pPreBufferData = getPreBufferData((char*)pClientMem);
-	uint8* prePattern = pPreBufferData->bytePattern;
-	uint8* postPattern = (uint8*)pPreBufferData + s_preBufferSize + pPreBufferData->requestedSize;
-	for (int i=0;i<PATTERN_SIZE;++i)
-	{
-		assert(prePattern[i]==(uint8)PRE_PATTERN);
-		assert(postPattern[i]==(uint8)POST_PATTERN);
+	printf("\n*** Lock Statistics ***\n");
+	for (unsigned i = 0; i < NUM_HEAP_BUCKETS; i++) {
+		const LockStats& s = bucket_lock_stats(i);
+		if (s.mAcquisitions == 0)
+			continue;
+		printf("bucket[%u bytes] acquisitions %llu contended %llu wait %llu us\n", (unsigned)bucket_elem_size(i),
+			(unsigned long long)s.mAcquisitions, (unsigned long long)s.mContended, (unsigned long long)(s.mWaitNanos / 1000));
 	}
-	#endif
+	const LockStats& s = tree_lock_stats();
+	printf("tree acquisitions %llu contended %llu wait %llu us\n",
+		(unsigned long long)s.mAcquisitions, (unsigned long long)s.mContended, (unsigned long long)(s.mWaitNanos / 1000));
+	printf("*** End Lock Statistics ***\n\n");
 }
 
-void HeapAllocator::check()
+template<class Policy>
+void BasicHeapAllocator<Policy>::bucket_stats(unsigned bi, size_t& pages, size_t& used, size_t& slots, size_t& emptyPages) const
 {
-	#ifdef DEBUG_ALLOCATOR
-	sPreBufferData* cur_buf = sTopMemoryBlock;
-	while(cur_buf)
-	{
-		uint8* prePattern = cur_buf->bytePattern;
-		uint8* postPattern = (uint8*)cur_buf + s_preBufferSize + cur_buf->requestedSize;
-		for (int i=0;i<PATTERN_SIZE;++i)
-		{
-			assert(prePattern[i]==(uint8)PRE_PATTERN);
-			assert(postPattern[i]==(uint8)POST_PATTERN);
+	pages = used = slots = emptyPages = 0;
+	scope_lock lock(mBuckets[bi].get_lock());
+	for (unsigned b = 0; b < bucket::NUM_BINS; b++) {
+		const page* pe = mBuckets[bi].bin(b).end();
+		for (const page* p = mBuckets[bi].bin(b).begin(); p != pe; p = p->next()) {
+			pages++;
+			used += p->count();
+			slots += p->slot_count();
+			if (b == bucket::BIN_EMPTY)
+				emptyPages++;
 		}
-		cur_buf = cur_buf->nextHeader;
 	}
-	#endif
 }
 
-void HeapAllocator::report()
+template<class Policy>
+void BasicHeapAllocator<Policy>::tree_stats(size_t& freeBytes, size_t& freeBlocks, size_t& smallFreeBlocks, size_t& segments, size_t& segmentBytes) const
 {
-	#ifdef DEBUG_ALLOCATOR
-	printf("\n*** Memory Use Statistics ***\n");
-	printf("Total Allocations: %d\n", sAllocAccount);
-	printf("Total Deallocations: %d\n", sReleaseAccount);
-	printf("Maximum memory used (including debug info): %d\n", sMaxinumBytesInUse);
-	printf("Maximum memory required: %d\n", sMaximumBytesRequested);
-	printf("Current memory used (including debug info): %d\n", sTotalBytesInUse);
-	printf("Current memory used by Client: %d\n", sTotalBytesRequested);
-	printf("*** End Memory Use Statistics ***\n");
-	printf("\n*** Memory Use Details ***\n");
-	sPreBufferData* cur_buf = sTopMemoryBlock;
-	int index = 0;
-	while(cur_buf)
-	{
-		printf("\n[memory alloc info %d]\n", ++index);
-		printf("filename[%s]\n", cur_buf->fileName);
-		printf("line[%d]\n", cur_buf->fileLine);
-		printf("request size[%d]\n", cur_buf->requestedSize);
+	freeBytes = freeBlocks = smallFreeBlocks = segments = segmentBytes = 0;
+	scope_lock lock(mTreeMutex);
+	if (mMRFreeBlock) {
+		freeBytes += mMRFreeBlock->size();
+		freeBlocks++;
+	}
+	for (const free_node* node = mFreeTree.begin(); node != mFreeTree.end(); node = node->succ()) {
+		freeBytes += node->get_block()->size();
+		freeBlocks++;
+	}
+	for (const small_free_node* node = mSmallFreeList.begin(); node != mSmallFreeList.end(); node = node->next()) {
+		freeBytes += ptr_get_block_header((void*)node)->size();
+		freeBlocks++;
+		smallFreeBlocks++;
+	}
+	for (const segment* seg = mSegments.begin(); seg != mSegments.end(); seg = seg->next()) {
+		segments++;
+		segmentBytes += seg->size();
+	}
+}
 
-		cur_buf = cur_buf->nextHeader;
+template<class Policy>
+int BasicHeapAllocator<Policy>::ctl(const char* name, size_t* oldp, const size_t* newp)
+{
+	//knobs read under a lock are set under that lock, the others atomically
+	if (strcmp(name, "tree.grow_size") == 0) {
+		scope_lock lock(mTreeMutex);
+		if (oldp)
+			*oldp = mGrowSize;
+		if (newp) {
+			//tree_grow rounds it up again, keep that from wrapping
+			if (*newp == 0 || *newp > MAX_TREE_GROW)
+				return EINVAL;
+			mGrowSize = round_up(*newp, VIRTUAL_PAGE_SIZE);
+		}
+		return 0;
 	}
-	printf("*** End Memory Use Details ***\n\n");
-	#else
-	printf("*** memory allocation info is not available***\n\n");
-	#endif
+	if (strcmp(name, "tree.huge_threshold") == 0) {
+		if (oldp)
+			*oldp = __atomic_load_n(&mHugeThreshold, __ATOMIC_RELAXED);
+		if (newp) {
+			//smaller blocks would waste most of a page
+			if (*newp && *newp < PAGE_SIZE)
+				return EINVAL;
+			//reserve() checks it without the tree lock
+			scope_lock lock(mTreeMutex);
+			__atomic_store_n(&mHugeThreshold, *newp, __ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+	if (strcmp(name, "tree.quick_list_max") == 0) {
+		scope_lock lock(mTreeMutex);
+		if (oldp)
+			*oldp = mQuickMax;
+		if (newp) {
+			mQuickMax = *newp;
+			if (mQuickCount > mQuickMax)
+				tree_quick_flush();
+		}
+		return 0;
+	}
+	if (strcmp(name, "tree.retain_bytes") == 0) {
+		scope_lock lock(mTreeMutex);
+		if (oldp)
+			*oldp = mRetainBytes;
+		if (newp)
+			mRetainBytes = *newp;
+		return 0;
+	}
+	if (strcmp(name, "page_pool.max_pages") == 0) {
+		scope_lock lock(mPagePoolLock);
+		if (oldp)
+			*oldp = mPagePoolMax;
+		if (newp) {
+			mPagePoolMax = *newp;
+			//an explicit limit is also the one real-time mode leaves behind
+			mRtPoolMax = *newp;
+			page_pool_trim(mPagePoolMax, latency_now());
+		}
+		return 0;
+	}
+	if (strcmp(name, "page_pool.decay_ms") == 0) {
+		scope_lock lock(mPagePoolLock);
+		if (oldp)
+			*oldp = (size_t)(mPagePoolDecay / 1000000);
+		if (newp)
+			mPagePoolDecay = (uint64)*newp * 1000000;
+		return 0;
+	}
+	if (strcmp(name, "rt.enabled") == 0) {
+		if (oldp)
+			*oldp = mRtRunning;
+		if (newp) {
+			if (!Policy::THREAD_SAFE)
+				return EINVAL;
+			if (!*newp)
+				rt_stop();
+			else if (!rt_start())
+				return EAGAIN;
+		}
+		return 0;
+	}
+	if (strcmp(name, "rt.reserve_pages") == 0) {
+		scope_lock lock(mPagePoolLock);
+		if (oldp)
+			*oldp = mRtPages;
+		if (newp) {
+			mRtPages = *newp;
+			if (mRtRunning && mPagePoolMax < mRtPages)
+				mPagePoolMax = mRtPages;
+		}
+		return 0;
+	}
+	if (strcmp(name, "rt.reserve_segments") == 0) {
+		scope_lock lock(mTreeMutex);
+		if (oldp)
+			*oldp = mRtSegments;
+		if (newp)
+			mRtSegments = *newp;
+		return 0;
+	}
+	if (strcmp(name, "rt.segment_size") == 0) {
+		scope_lock lock(mTreeMutex);
+		if (oldp)
+			*oldp = mRtSegmentSize;
+		if (newp) {
+			if (*newp == 0)
+				return EINVAL;
+			mRtSegmentSize = round_up(*newp, PAGE_SIZE);
+		}
+		return 0;
+	}
+	if (strcmp(name, "lifetime.sample_rate") == 0) {
+		if (oldp)
+			*oldp = __atomic_load_n(&mLifetimeRate, __ATOMIC_RELAXED);
+		if (newp) {
+			if (*newp > MAX_UINT32)
+				return EINVAL;
+			if (*newp && !lifetime()) {
+				scope_lock lock(mLifetimeLock);
+				if (!mLifetime) {
+					void* mem = system_alloc(round_up(sizeof(lifetime_tables), VIRTUAL_PAGE_SIZE));
+					if (!mem)
+						return ENOMEM;
+					memset(mem, 0, sizeof(lifetime_tables));
+					//lock free readers load it with acquire, the tables must be zero before they can see it
+					__atomic_store_n(&mLifetime, (lifetime_tables*)mem, __ATOMIC_RELEASE);
+				}
+			}
+			__atomic_store_n(&mLifetimeRate, (uint32)*newp, __ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+	if (strcmp(name, "lifetime.short_us") == 0) {
+		scope_lock lock(mLifetimeLock);
+		if (oldp)
+			*oldp = (size_t)(mLifetimeShortNs / 1000);
+		if (newp)
+			mLifetimeShortNs = (uint64)*newp * 1000;
+		return 0;
+	}
+	if (strcmp(name, "latency.enabled") == 0) {
+		if (oldp)
+			*oldp = latency_enabled();
+		if (newp)
+			__atomic_store_n(&mLatencyStats, *newp != 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (strcmp(name, "cpu_cache.depth") == 0) {
+		if (oldp)
+			*oldp = cpu_cache_depth();
+		if (newp && !set_cpu_cache((unsigned)*newp))
+			return EINVAL;
+		return 0;
+	}
+
+	size_t value = 0;
+	if (strcmp(name, "config.page_size") == 0) {
+		value = PAGE_SIZE;
+	} else if (strcmp(name, "config.max_small_allocation") == 0) {
+		value = MAX_SMALL_ALLOCATION;
+	} else if (strcmp(name, "config.max_aligned_allocation") == 0) {
+		value = MAX_ALIGNED_ALLOCATION;
+	} else if (strcmp(name, "stats.buckets") == 0) {
+		value = NUM_HEAP_BUCKETS;
+	} else if (strcmp(name, "stats.page_pool.pages") == 0) {
+		value = mPagePoolSize;
+	} else if (strcmp(name, "stats.rt.breaches") == 0) {
+		value = (size_t)__atomic_load_n(&mRtBreaches, __ATOMIC_RELAXED);
+	} else if (strcmp(name, "stats.rt.misses") == 0) {
+		value = (size_t)__atomic_load_n(&mRtMisses, __ATOMIC_RELAXED);
+	} else if (strcmp(name, "stats.rt.reserve_segments") == 0) {
+		scope_lock lock(mTreeMutex);
+		value = mReserveSegmentCount;
+	} else if (strncmp(name, "stats.buckets.", 14) == 0) {
+		size_t used = 0, slots = 0;
+		for (unsigned bi = 0; bi < NUM_HEAP_BUCKETS; bi++) {
+			size_t p, u, s, e;
+			bucket_stats(bi, p, u, s, e);
+			used += u;
+			slots += s;
+		}
+		if (strcmp(name + 14, "slots_used") == 0)
+			value = used;
+		else if (strcmp(name + 14, "slots_total") == 0)
+			value = slots;
+		else if (strcmp(name + 14, "utilization") == 0)
+			value = slots ? used * 1000 / slots : 0;
+		else
+			return ENOENT;
+	} else if (strncmp(name, "stats.bucket.", 13) == 0) {
+		char* field;
+		unsigned long bi = strtoul(name + 13, &field, 10);
+		if (field == name + 13 || *field != '.' || bi >= NUM_HEAP_BUCKETS)
+			return ENOENT;
+		field++;
+		size_t pages, used, slots, emptyPages;
+		bucket_stats((unsigned)bi, pages, used, slots, emptyPages);
+		if (strcmp(field, "elem_size") == 0)
+			value = bucket_elem_size_of((unsigned)bi);
+		else if (strcmp(field, "pages") == 0)
+			value = pages;
+		else if (strcmp(field, "empty_pages") == 0)
+			value = emptyPages;
+		else if (strcmp(field, "slots_used") == 0)
+			value = used;
+		else if (strcmp(field, "slots_total") == 0)
+			value = slots;
+		else
+			return ENOENT;
+	} else if (strncmp(name, "latency.", 8) == 0) {
+		const char* field = strchr(name + 8, '.');
+		unsigned path = 0;
+		while (path < NUM_LATENCY_PATHS && !(field && strlen(latency_path_name(path)) == (size_t)(field - name - 8) &&
+			strncmp(latency_path_name(path), name + 8, field - name - 8) == 0))
+			path++;
+		if (path == NUM_LATENCY_PATHS)
+			return ENOENT;
+		field++;
+		LatencyHistogram h;
+		latency_snapshot(path, h);
+		if (strcmp(field, "count") == 0)
+			value = h.count();
+		else if (strcmp(field, "p50") == 0)
+			value = h.percentile(0.5);
+		else if (strcmp(field, "p99") == 0)
+			value = h.percentile(0.99);
+		else if (strcmp(field, "p999") == 0)
+			value = h.percentile(0.999);
+		else if (strcmp(field, "max") == 0)
+			value = h.max();
+		else
+			return ENOENT;
+	} else if (strcmp(name, "stats.lifetime.short_sites") == 0) {
+		if (lifetime_tables* tables = lifetime()) {
+			scope_lock lock(mLifetimeLock);
+			for (unsigned i = 0; i < LIFETIME_SITES; i++)
+				value += tables->mSites[i].mShortLived;
+		}
+	} else if (strncmp(name, "stats.superblocks.", 18) == 0) {
+		scope_lock lock(mTreeMutex);
+		if (strcmp(name + 18, "count") == 0)
+			value = mSuperblocks.superblock_count();
+		else if (strcmp(name + 18, "used_pages") == 0)
+			value = mSuperblocks.used_pages();
+		else if (strcmp(name + 18, "committed_bytes") == 0)
+			value = mSuperblocks.committed_bytes();
+		else
+			return ENOENT;
+	} else if (strncmp(name, "stats.", 6) == 0) {
+		size_t freeBytes, freeBlocks, smallFreeBlocks, segments, segmentBytes;
+		tree_stats(freeBytes, freeBlocks, smallFreeBlocks, segments, segmentBytes);
+		if (strcmp(name, "stats.tree.free_bytes") == 0)
+			value = freeBytes;
+		else if (strcmp(name, "stats.tree.free_blocks") == 0)
+			value = freeBlocks;
+		else if (strcmp(name, "stats.tree.small_free_blocks") == 0)
+			value = smallFreeBlocks;
+		else if (strcmp(name, "stats.tree.quick_blocks") == 0)
+			value = mQuickCount;
+		else if (strcmp(name, "stats.segments") == 0)
+			value = segments;
+		else if (strcmp(name, "stats.segment_bytes") == 0)
+			value = segmentBytes;
+		else
+			return ENOENT;
+	} else {
+		return ENOENT;
+	}
+	if (newp)
+		return EPERM;
+	if (oldp)
+		*oldp = value;
+	return 0;
+}
+
+template<class Policy>
+int BasicHeapAllocator<Policy>::configure(const char* conf)
+{
+	int result = 0;
+	while (*conf) {
+		const char* end = strchr(conf, ',');
+		if (!end)
+			end = conf + strlen(conf);
+		const char* sep = (const char*)memchr(conf, ':', end - conf);
+		char name[64];
+		if (!sep || (size_t)(sep - conf) >= sizeof(name)) {
+			result = EINVAL;
+		} else {
+			memcpy(name, conf, sep - conf);
+			name[sep - conf] = 0;
+			char* numEnd;
+			size_t value = (size_t)strtoull(sep + 1, &numEnd, 0);
+			int err = numEnd == sep + 1 || numEnd != end ? EINVAL : ctl(name, NULL, &value);
+			if (err)
+				result = err;
+		}
+		conf = *end ? end + 1 : end;
+	}
+	return result;
 }
 
+template class shark::BasicHeapAllocator<shark::default_heap_policy>;
+template class shark::BasicHeapAllocator<shark::single_thread_heap_policy>;
+template class shark::BasicHeapAllocator<shark::debug_heap_policy>;
+template class shark::BasicHeapAllocator<shark::bitmap_heap_policy>;
@@ -9,6 +9,10 @@
 #include "rbtree.h"
 #include "ptr_bitset.h"
 #include "mutex.h"
+#include "heap_debug.h"
+#include "latency.h"
+#include "probes.h"
+#include "superblock.h"
 
 #define g_allocator shark::HeapAllocator::getInstance()
 #define heap_alloc(size) 			g_allocator->alloc(size, __FILE__, __LINE__)
@@ -26,8 +30,6 @@ namespace shark
 #define DEBUG_MULTI_RBTREE
 #endif
 
-#define MULTITHREADED
-
 // ϵͳҳС:64KB
 const size_t VIRTUAL_PAGE_SIZE_LOG2 = 16;
 const size_t VIRTUAL_PAGE_SIZE  = (size_t)1 << VIRTUAL_PAGE_SIZE_LOG2;
@@ -55,58 +57,189 @@ enum ALIGNMENT
 	ALING_32			=32
 };
 
-enum MEM_CONSTANTS
-{
-	MAX_CALL_DEPTH		= 16,	// depth of the recorded callstack
-	MAX_CLIENT_FILENAME    = 32,	// number of letters recorded for the client filename
-	MAX_FILEPATH = 128,
-	PATTERN_SIZE = 32,
+/*
+ * Compile time configuration of a heap. Derive from default_heap_policy and
+ * override what differs, e.g. a heap owned by an event loop thread:
+ *	struct loop_heap_policy : default_heap_policy {static const bool THREAD_SAFE = false;};
+ * THREAD_SAFE	bucket and tree locks are AdaptiveLock, or NullLock for a heap used by one thread
+ * DEBUG_INFO	guard patterns and live allocation tracking (DebugTracker)
+ * LOCK_STATS	contention statistics on the locks
+ * MAX_ALIGNED_ALLOCATION_LOG2	largest power of two size class for aligned allocations
+ * BITMAP_PAGES	bucket pages track free slots in a bitmap instead of a free list
+ * PAGE_COLORS	number of cache line offsets bucket page headers and slots rotate through, 1 disables
+ * New policies need an explicit instantiation at the end of heap_alloc.cpp.
+ */
+struct default_heap_policy {
+	static const bool THREAD_SAFE = true;
+	#ifdef DEBUG_ALLOCATOR
+	static const bool DEBUG_INFO = true;
+	#else
+	static const bool DEBUG_INFO = false;
+	#endif
+	static const bool LOCK_STATS = true;
+	static const uint32 PAGE_SIZE_LOG2 = VIRTUAL_PAGE_SIZE_LOG2;
+	static const uint32 MAX_SMALL_ALLOCATION_LOG2 = 8UL;
+	static const uint32 MAX_ALIGNED_ALLOCATION_LOG2 = 12UL;
+	static const bool BITMAP_PAGES = false;
+	static const uint32 PAGE_COLORS = 16;
 };
 
-enum MEM_PATTERNS
-{
-	PRE_PATTERN	= 0xab,	// memory pattern written ahead of allocated client space (GAIA_MEM_DEBUG only)	
-	POST_PATTERN	= 0xef,	// memory pattern written after allocated client space (GAIA_MEM_DEBUG only)
+struct single_thread_heap_policy : default_heap_policy {
+	static const bool THREAD_SAFE = false;
+	static const bool LOCK_STATS = false;
 };
 
-struct sMemoryBlockHeader
-{
-	uint32	actualSize : 24;	// the true size of the allocation
-	uint32	pointerOffset : 8;	// an offset to the top of the allocation
+struct debug_heap_policy : default_heap_policy {
+	static const bool DEBUG_INFO = true;
 };
 
-struct sPreBufferData
-{
-	sPreBufferData* nextHeader;			
-	sPreBufferData* previousHeader;
-	uint32		requestedSize;		
-	uint32		userChecksum;
-	uint32		fileLine;
-	char			fileName[MAX_FILEPATH];
-	uint8		bytePattern[PATTERN_SIZE];
-	uint8   		alignment;		
-	uint8		debug_source;
+struct bitmap_heap_policy : default_heap_policy {
+	static const bool BITMAP_PAGES = true;
 };
 
-struct sPostBufferData
-{
-	uint8 bytePattern[PATTERN_SIZE];
+template<bool THREAD_SAFE, bool STATS> struct heap_lock_selector {typedef BasicAdaptiveLock<STATS> type;};
+template<bool STATS> struct heap_lock_selector<false, STATS> {typedef NullLock type;};
+template<bool DEBUG_INFO> struct heap_debug_selector {typedef DebugTracker type;};
+template<> struct heap_debug_selector<false> {typedef NullDebugTracker type;};
+
+/*
+ * Free slot tracking of a bucket page. base is the first slot of the page,
+ * slots are elemSize apart.
+ * slots_for tells how many slots fit into the avail bytes between the first
+ * slot and the page header, init may keep tracker data below limit (the
+ * header) after the last slot.
+ * free_list_slots threads a list through the free slots themselves.
+ */
+class free_list_slots {
+	struct free_link {
+		free_link* mNext;
+	};
+	free_link* mFreeList;
+public:
+	static unsigned slots_for(size_t avail, size_t elemSize) {return (unsigned)(avail / elemSize);}
+	void init(char* base, size_t elemSize, unsigned count, char*) {
+		size_t n = (size_t)(count - 1) * elemSize;
+		for (size_t i = 0; i < n; i += elemSize)
+			((free_link*)(base + i))->mNext = (free_link*)(base + i + elemSize);
+		((free_link*)(base + n))->mNext = NULL;
+		mFreeList = (free_link*)base;
+	}
+	void* alloc(char*, size_t) {
+		free_link* free = mFreeList;
+		mFreeList = free->mNext;
+		return free;
+	}
+	void free(char*, size_t, void* ptr) {
+		free_link* lnk = (free_link*)ptr;
+		lnk->mNext = mFreeList;
+		mFreeList = lnk;
+	}
 };
 
-class HeapAllocator{
-	HeapAllocator();
-	HeapAllocator(const HeapAllocator&);
-	HeapAllocator& operator=(const HeapAllocator&);
-	static HeapAllocator* allocator;
+/*
+ * bitmap_slots keeps one bit per slot (set = free) in the page header, so
+ * allocating never touches the slot and a freed object is never written to.
+ * alloc scans 64 slots per word with ctz starting at the lowest word which
+ * may have a free slot, free maps the offset back to the slot index with a
+ * multiplication by the reciprocal of the slot size.
+ * The bitmap is sized to the slot count of the page's class and sits right
+ * below the page header: 8 byte slots give up one bit each, a page of 2KB
+ * slots keeps a single word.
+ */
+class bitmap_slots {
+	uint64* mFree;		// (count + 63) / 64 words ending at the page header
+	uint32 mReciprocal;	// 2^32 / elemSize rounded up, exact for offsets within a page
+	unsigned mHint;		// no free slot below this word
+	static size_t bitmap_bytes(unsigned count) {return (size_t)(count + 63) / 64 * sizeof(uint64);}
+public:
+	static unsigned slots_for(size_t avail, size_t elemSize) {
+		unsigned n = (unsigned)(avail * 8 / (elemSize * 8 + 1));
+		while (n * elemSize + bitmap_bytes(n) > avail)
+			n--;
+		return n;
+	}
+	void init(char*, size_t elemSize, unsigned count, char* limit) {
+		size_t words = bitmap_bytes(count) / sizeof(uint64);
+		mFree = (uint64*)limit - words;
+		assert(((size_t)limit & (sizeof(uint64) - 1)) == 0);
+		for (unsigned w = 0; w < count / 64; w++)
+			mFree[w] = ~(uint64)0;
+		if (count % 64)
+			mFree[count / 64] = ((uint64)1 << (count % 64)) - 1;
+		mReciprocal = (uint32)((((uint64)1) << 32) / elemSize + 1);
+		mHint = 0;
+	}
+	void* alloc(char* base, size_t elemSize) {
+		unsigned w = mHint;
+		while (mFree[w] == 0)
+			w++;
+		unsigned bit = __builtin_ctzll(mFree[w]);
+		mFree[w] &= mFree[w] - 1;
+		mHint = w;
+		return base + ((size_t)w * 64 + bit) * elemSize;
+	}
+	void free(char* base, size_t elemSize, void* ptr) {
+		unsigned i = (unsigned)(((uint64)((char*)ptr - base) * mReciprocal) >> 32);
+		assert(base + (size_t)i * elemSize == (char*)ptr);
+		(void)elemSize;
+		assert(!(mFree[i / 64] & ((uint64)1 << (i % 64))));
+		mFree[i / 64] |= (uint64)1 << (i % 64);
+		if (i / 64 < mHint)
+			mHint = i / 64;
+	}
+	bool is_free(unsigned i) const {return (mFree[i / 64] >> (i % 64)) & 1;}
+};
+
+template<bool BITMAP> struct heap_slots_selector {typedef bitmap_slots type;};
+template<> struct heap_slots_selector<false> {typedef free_list_slots type;};
+
+template<class Policy>
+class BasicHeapAllocator{
+	BasicHeapAllocator(const BasicHeapAllocator&);
+	BasicHeapAllocator& operator=(const BasicHeapAllocator&);
+	static BasicHeapAllocator* allocator;
+	typedef typename heap_lock_selector<Policy::THREAD_SAFE, Policy::LOCK_STATS>::type lock_type;
+	typedef BasicScopeLock<lock_type> scope_lock;
+	typedef typename heap_debug_selector<Policy::DEBUG_INFO>::type debug_type;
 	//Ͱϵͳ
 	static const uint32 MIN_ALLOCATION_LOG2 = 3UL;
 	static const uint32 MIN_ALLOCATION  = 1UL << MIN_ALLOCATION_LOG2; 
-	static const uint32 MAX_SMALL_ALLOCATION_LOG2 = 8UL;
+	static const uint32 MAX_SMALL_ALLOCATION_LOG2 = Policy::MAX_SMALL_ALLOCATION_LOG2;
 	static const uint32 MAX_SMALL_ALLOCATION  = 1UL << MAX_SMALL_ALLOCATION_LOG2;
-	static const uint32 PAGE_SIZE_LOG2  = VIRTUAL_PAGE_SIZE_LOG2;
+	static const uint32 PAGE_SIZE_LOG2  = Policy::PAGE_SIZE_LOG2;
 	static const uint32 PAGE_SIZE  = 1UL << PAGE_SIZE_LOG2;
 	static const uint32 NUM_BUCKETS  = (MAX_SMALL_ALLOCATION / MIN_ALLOCATION);
-	static const uint32 DEBUG_EXTRA_INFO_SIZE;
+	/*
+	 * Aligned allocations use their own power of two size classes. Pages are
+	 * PAGE_SIZE aligned and slots are cut from the page start, so a slot of a
+	 * power of two class is naturally aligned to its size. They follow the
+	 * regular buckets in mBuckets.
+	 */
+	static const uint32 MIN_ALIGNED_ALLOCATION_LOG2 = 4UL;
+	static const uint32 MAX_ALIGNED_ALLOCATION_LOG2 = Policy::MAX_ALIGNED_ALLOCATION_LOG2;
+	static const uint32 MAX_ALIGNED_ALLOCATION = 1UL << MAX_ALIGNED_ALLOCATION_LOG2;
+	static const uint32 NUM_ALIGNED_BUCKETS = MAX_ALIGNED_ALLOCATION_LOG2 - MIN_ALIGNED_ALLOCATION_LOG2 + 1;
+	static const uint32 NUM_ALL_BUCKETS = NUM_BUCKETS + NUM_ALIGNED_BUCKETS;
+	// copies of the regular classes for call sites predicted to be short lived, see lifetime_bucket
+	static const uint32 SHORT_LIVED_BUCKETS = NUM_ALL_BUCKETS;
+	static const uint32 NUM_HEAP_BUCKETS = NUM_ALL_BUCKETS + NUM_BUCKETS;
+	static const uint32 DEBUG_EXTRA_INFO_SIZE = debug_type::EXTRA_INFO_SIZE;
+	// pages come from system_alloc, and page::mUseCount has to be able to count all slots of a page
+	static_assert(PAGE_SIZE_LOG2 >= VIRTUAL_PAGE_SIZE_LOG2, "heap pages must be multiples of VIRTUAL_PAGE_SIZE");
+	static_assert((PAGE_SIZE >> MIN_ALLOCATION_LOG2) <= 0xffff, "too many slots per page");
+	static_assert(MAX_ALIGNED_ALLOCATION_LOG2 >= MIN_ALIGNED_ALLOCATION_LOG2 && MAX_ALIGNED_ALLOCATION <= PAGE_SIZE / 8,
+		"aligned size classes must fit several times into a page");
+	/*
+	 * Cache coloring: with every page header at the same offset of a PAGE_SIZE
+	 * aligned page, all headers (and all first slots) map to the same cache sets.
+	 * The color of a page, taken from its address, moves the header down and the
+	 * first slot up by whole cache lines. Aligned classes above a cache line
+	 * keep their slots at the page start to stay naturally aligned.
+	 */
+	static const uint32 CACHE_LINE_SIZE = 64;
+	static const uint32 PAGE_COLORS = Policy::PAGE_COLORS;
+	static_assert(PAGE_COLORS > 0 && (PAGE_COLORS & (PAGE_COLORS - 1)) == 0, "PAGE_COLORS must be a power of two");
+	static_assert(PAGE_COLORS * CACHE_LINE_SIZE * 2 <= PAGE_SIZE / 16, "too many page colors for the page size");
 	
 	static inline bool is_small_allocation(size_t s) {
 		return s + DEBUG_EXTRA_INFO_SIZE <= MAX_SMALL_ALLOCATION;
@@ -122,27 +255,27 @@ class HeapAllocator{
 		// ҪĿСڵͰ(Բ)
 		return (unsigned)(size >> MIN_ALLOCATION_LOG2) - 1;
 	}
+	static inline bool is_small_aligned_allocation(size_t s, size_t alignment) {
+		return alignment <= MAX_ALIGNED_ALLOCATION && s + DEBUG_EXTRA_INFO_SIZE <= MAX_ALIGNED_ALLOCATION;
+	}
+	// index of the smallest power of two class holding trueSize bytes aligned to alignment
+	static inline unsigned aligned_bucket_index(size_t trueSize, size_t alignment) {
+		size_t s = trueSize > alignment ? trueSize : alignment;
+		unsigned log2 = s <= (1UL << MIN_ALIGNED_ALLOCATION_LOG2) ? MIN_ALIGNED_ALLOCATION_LOG2 : 
+			(unsigned)(sizeof(unsigned long) * 8 - __builtin_clzl((unsigned long)s - 1));
+		return NUM_BUCKETS + log2 - MIN_ALIGNED_ALLOCATION_LOG2;
+	}
+	static inline size_t bucket_elem_size_of(unsigned index) {
+		if (index < NUM_BUCKETS)
+			return bucket_spacing_function_inverse(index);
+		if (index >= SHORT_LIVED_BUCKETS)
+			return bucket_spacing_function_inverse(index - SHORT_LIVED_BUCKETS);
+		return (size_t)1 << (index - NUM_BUCKETS + MIN_ALIGNED_ALLOCATION_LOG2);
+	}
 	static inline size_t bucket_spacing_function_inverse(unsigned index) { 
 		//ͰͰݿĴС
 		return (size_t)(index + 1) << MIN_ALLOCATION_LOG2;
 	}
-	static sMemoryBlockHeader* getMemoryBlockHeader(void* pClientMem)
-	{
-		#ifdef DEBUG_ALLOCATOR
-		return (sMemoryBlockHeader*)((char*)pClientMem - s_preBufferSize - s_blockHeadSize);
-		#else
-		return (sMemoryBlockHeader*)pClientMem;
-		#endif
-	}
-	static sPreBufferData* getPreBufferData(void* pClientMem)
-	{
-		#ifdef DEBUG_ALLOCATOR
-		char* header = (char*)getMemoryBlockHeader(pClientMem);
-		return (sPreBufferData*)(header + s_blockHeadSize);
-		#else
-		return (sPreBufferData*)pClientMem;
-		#endif
-	}
 	
 	/* 
 	 * bucketģͷΪ
@@ -150,22 +283,29 @@ class HeapAllocator{
 	 * ڶpageṹ
 	 * ڲǶ̶Сڴ顣
 	 */
-	struct free_link {
-		free_link* mNext;
-	};
+	typedef typename heap_slots_selector<Policy::BITMAP_PAGES>::type slot_tracker;
 	struct page : intrusive_list<page>::node {
-		page(free_link* freeList, size_t elemSize, unsigned marker) 
-			: mFreeList(freeList), mBucketIndex((unsigned short)bucket_spacing_function_aligned(elemSize)), mUseCount(0) {
+		page(unsigned bi, unsigned slotCount, size_t slotOffset, unsigned marker) 
+			: mBucketIndex((unsigned short)bi), mUseCount(0), mSlotCount((unsigned short)slotCount), mSlotOffset((unsigned short)slotOffset) {
 			mMarker = marker ^ (unsigned)((size_t)this); 
+			mSlots.init(base(), elem_size(), slotCount, (char*)this);
 		}
-		free_link* mFreeList;
+		slot_tracker mSlots;
 		unsigned short mBucketIndex;
 		unsigned short mUseCount;
+		unsigned short mSlotCount;
+		unsigned short mSlotOffset;
 		unsigned mMarker;
-		size_t elem_size() const {return bucket_spacing_function_inverse(mBucketIndex);}
+		// first slot of the page
+		char* base() const {return align_down((char*)this, PAGE_SIZE) + mSlotOffset;}
+		size_t elem_size() const {return bucket_elem_size_of(mBucketIndex);}
 		unsigned bucket_index() const {return mBucketIndex;}
 		size_t count() const {return mUseCount;}
+		size_t slot_count() const {return mSlotCount;}
 		bool empty() const {return mUseCount == 0;}
+		bool full() const {return mUseCount == mSlotCount;}
+		void* alloc_slot() {return mSlots.alloc(base(), elem_size());}
+		void free_slot(void* ptr) {mSlots.free(base(), elem_size(), ptr);}
 		void inc_ref() {mUseCount++;}
 		void dec_ref() {assert(mUseCount > 0); mUseCount--;}
 		bool check_marker(unsigned marker) const {return mMarker == (marker ^ (unsigned)((size_t)this));}
@@ -178,7 +318,16 @@ class HeapAllocator{
 		 * ԶλpageָλõʱȽָƶڴλã
 		 * Ȼٻsizeof(page)Сƫ
 		 */
-		return (page*)(align_down((char*)ptr, PAGE_SIZE) + (PAGE_SIZE - sizeof(page)));
+		char* base = align_down((char*)ptr, PAGE_SIZE);
+		return (page*)(base + (PAGE_SIZE - sizeof(page)) - page_color(base) * CACHE_LINE_SIZE);
+	}
+	static inline size_t page_color(const char* base) {
+		return ((size_t)base >> PAGE_SIZE_LOG2) & (PAGE_COLORS - 1);
+	}
+	static inline size_t slot_offset(const char* base, unsigned bi) {
+		if (bi >= NUM_BUCKETS && bi < NUM_ALL_BUCKETS && bucket_elem_size_of(bi) > CACHE_LINE_SIZE)
+			return 0;
+		return page_color(base) * CACHE_LINE_SIZE;
 	}
 	/*
 	 * Ͱṹ
@@ -187,47 +336,87 @@ class HeapAllocator{
 		bucket(const bucket&);
 		bucket& operator=(const bucket&);
 		
-		page_list mPageList;
-		#ifdef MULTITHREADED
-		static const size_t SPIN_COUNT = 256;//ʱûõ,Ϊƿʹ
-		mutable MutexLock mLock;	//ͰȵֻԵͰ
-		#endif
+	public:
+		/*
+		 * Pages are grouped by occupancy and allocation takes the fullest page
+		 * which still has a free slot, so live objects concentrate on few pages
+		 * and the others drain into BIN_EMPTY, where purge finds them.
+		 */
+		enum {BIN_FULL, BIN_HIGH, BIN_MID, BIN_LOW, BIN_EMPTY, NUM_BINS};
+		static unsigned bin_of(const page* p) {
+			if (p->full())
+				return BIN_FULL;
+			if (p->empty())
+				return BIN_EMPTY;
+			size_t used = p->count() * 4;
+			return used >= p->slot_count() * 3 ? BIN_HIGH : (used >= p->slot_count() ? BIN_MID : BIN_LOW);
+		}
+	private:
+		page_list mBins[NUM_BINS];
+		static const unsigned SPIN_COUNT = 256;//spins before the lock sleeps, bucket critical sections are tens of nanoseconds
+		mutable lock_type mLock;	//ͰȵֻԵͰ
 		unsigned mMarker;
-		#ifdef MULTITHREADED
-		unsigned char _padding[sizeof(void*)*16 - sizeof(page_list) - sizeof(MutexLock) - sizeof(unsigned)];
-		#else
-		unsigned char _padding[sizeof(void*)*4 - sizeof(page_list) - sizeof(unsigned)];
-		#endif
+		unsigned char _padding[sizeof(void*)*16 - NUM_BINS*sizeof(page_list) - sizeof(lock_type) - sizeof(unsigned)];
 		static const unsigned MARKER = 0xdeadbeef;
 	public:
 		bucket();
-		#ifdef MULTITHREADED
-		MutexLock& get_lock() const {return mLock;}
-		#endif
+		lock_type& get_lock() const {return mLock;}
 		unsigned marker() const {return mMarker;}
-		const page* page_list_begin() const {return mPageList.begin();}
-		page* page_list_begin() {return mPageList.begin();}
-		const page* page_list_end() const {return mPageList.end();}
-		page* page_list_end() {return mPageList.end();}
-		bool page_list_empty() const {return mPageList.empty();}
-		void add_free_page(page* p) {mPageList.push_front(p);}
+		const page_list& bin(unsigned b) const {return mBins[b];}
+		page_list& bin(unsigned b) {return mBins[b];}
+		bool page_list_empty() const {
+			for (unsigned b = 0; b < NUM_BINS; b++) {
+				if (!mBins[b].empty())
+					return false;
+			}
+			return true;
+		}
+		void add_free_page(page* p) {mBins[bin_of(p)].push_front(p);}
 		page* get_free_page();
 		void* alloc(page* p);	
 		void free(page* p, void* ptr);
 	};
 	void* bucket_system_alloc();
 	void bucket_system_free(void* ptr);
-	page* bucket_grow(size_t elemSize, unsigned marker);
+	page* bucket_grow(unsigned bi);
 	void* bucket_alloc(size_t size);
 	void* bucket_alloc_direct(unsigned bi);
 	void* bucket_realloc(void* ptr, size_t size);
 	void bucket_free(void* ptr);
 	void bucket_free_direct(void* ptr, unsigned bi);
+	unsigned bucket_alloc_batch(unsigned bi, void** ptrs, unsigned count);
+	void bucket_free_batch(unsigned bi, void** ptrs, unsigned count);
+	void bucket_free_slot(unsigned bi, page* p, void* ptr);
 	void bucket_purge();
 
+	/*
+	 * Optional per-cpu caches in front of the buckets, so memory held in caches
+	 * scales with the number of cores rather than the number of threads.
+	 * The cpu number comes from the rseq area, every cache is guarded by a
+	 * try-lock which is only contended when a thread got preempted or migrated
+	 * in the middle of an operation; in that case, and when rseq is not
+	 * available, the locked bucket path is used.
+	 */
+	static const unsigned MAX_CPU_CACHE_DEPTH = 64;
+	struct cpu_cache {
+		volatile int mLock;
+		unsigned short mCount[NUM_BUCKETS];
+		void* mSlots[NUM_BUCKETS][MAX_CPU_CACHE_DEPTH];
+	};
+	cpu_cache* cpu_cache_lock();
+	void cpu_cache_unlock(cpu_cache* c);
+	void* cpu_cache_alloc(unsigned bi, unsigned depth);
+	bool cpu_cache_free(void* ptr, unsigned bi, unsigned depth);
+	void cpu_cache_flush();
+
 	//ڴĿͷϢ
 	class block_header {
-		enum block_flags {BL_USED = 1};//һλʾڴǷѾ
+		/*
+		 * BL_ZERO marks a free block whose memory is known to be zero past the
+		 * free list links at its start, set for the block of a fresh segment.
+		 * Splits pass it on, merges and set_used drop it.
+		 */
+		enum block_flags {BL_USED = 1, BL_ZERO = 2};//һλʾڴǷѾ
 		block_header* mPrev;
 		size_t mSizeAndFlags;
 		unsigned char _padding[DEFAULT_ALIGNMENT <= sizeof(block_header*) + sizeof(size_t) ? 0 : DEFAULT_ALIGNMENT - sizeof(block_header*) - sizeof(size_t)];
@@ -238,7 +427,9 @@ class HeapAllocator{
 		block_ptr prev() const {return mPrev;}
 		void* mem() const {return (void*)((char*)this + sizeof(block_header));}
 		bool used() const {return (mSizeAndFlags & BL_USED) != 0;}
-		void set_used() {mSizeAndFlags |= BL_USED;}
+		void set_used() {mSizeAndFlags = (mSizeAndFlags | BL_USED) & ~(size_t)BL_ZERO;}
+		bool zero() const {return (mSizeAndFlags & BL_ZERO) != 0;}
+		void set_zero(bool zero) {mSizeAndFlags = zero ? mSizeAndFlags | BL_ZERO : mSizeAndFlags & ~(size_t)BL_ZERO;}
 		void set_unused() {mSizeAndFlags &= ~BL_USED;}
 		void unlink() {
 			next()->prev(prev());
@@ -266,17 +457,73 @@ class HeapAllocator{
 		return (block_header*)((char*)ptr - sizeof(block_header));
 	}
 
+	/*
+	 * Every segment obtained by tree_system_alloc starts with a segment header
+	 * so the heap can hand all of its segments back in one pass (destroy),
+	 * without walking the blocks inside them.
+	 */
+	struct segment : public intrusive_list<segment>::node {
+		typedef typename intrusive_list<segment>::node node_type;
+		size_t mSize;
+		unsigned char _padding[(sizeof(node_type) + sizeof(size_t)) % (2*sizeof(size_t)) == 0 ? 0 : 
+			2*sizeof(size_t) - (sizeof(node_type) + sizeof(size_t)) % (2*sizeof(size_t))];
+		size_t size() const {return mSize;}
+	};
+	typedef intrusive_list<segment> segment_list;
+
 	struct small_free_node : public intrusive_list<small_free_node>::node {};
 	typedef intrusive_list<small_free_node> small_free_node_list;
+	/*
+	 * With deferred coalescing (tree.quick_list_max) freed blocks keep their
+	 * used flag and wait in exact size quick lists, where an allocation of the
+	 * same size takes them back without touching the tree. The lists are merged
+	 * into the tree in one batch when they hold more than mQuickMax blocks or
+	 * when an allocation finds nothing else.
+	 */
+	struct quick_node : public intrusive_list<quick_node>::node {};
+	typedef intrusive_list<quick_node> quick_node_list;
+	static const unsigned QUICK_LISTS = 32;
+	static unsigned quick_index(size_t size) {return (unsigned)(size / sizeof(block_header)) % QUICK_LISTS;}
+	/*
+	 * Free blocks are ordered by size, then by address, so equal sizes never
+	 * chain and every block is a tree node. Each node keeps the best natural
+	 * alignment (trailing zero bits of the address) found in its subtree, which
+	 * lets aligned requests skip subtrees without a suitably aligned block.
+	 * Blocks between size and size + alignment fit an aligned request only if
+	 * their offset to the next aligned address is small enough; up to
+	 * ALIGNED_SCAN_LIMIT of them are tried in size order before falling back
+	 * to the augmented search.
+	 */
+	static const unsigned ALIGNED_SCAN_LIMIT = 16;
 	struct free_node : public intrusive_multi_rbtree<free_node>::node {
+		unsigned char mMaxAlignLog2;
 		block_header* get_block() const {return (block_header*)((char*)this - sizeof(block_header));}
-		bool operator<(const free_node& rhs) const {return get_block()->size() < rhs.get_block()->size();}
-		bool operator>(const free_node& rhs) const {return get_block()->size() > rhs.get_block()->size();}
+		unsigned align_log2() const {return __builtin_ctzl((size_t)this);}
+		// size bytes are left once the start is moved up to alignment
+		bool fits_aligned(size_t size, size_t alignment) const {
+			return get_block()->size() >= size + (align_up((char*)this, alignment) - (char*)this);
+		}
+		bool operator<(const free_node& rhs) const {
+			return get_block()->size() < rhs.get_block()->size() || (get_block()->size() == rhs.get_block()->size() && this < &rhs);
+		}
+		bool operator>(const free_node& rhs) const {return rhs < *this;}
 		bool operator<(size_t size) const {return get_block()->size() < size;}
 		bool operator>(size_t size) const {return get_block()->size() > size;}
+		static void augment(intrusive_multi_rbtree_base::node_base* node) {
+			free_node* n = static_cast<free_node*>(node);
+			unsigned maxAlign = n->align_log2();
+			for (unsigned s = 0; s < 2; s++) {
+				free_node* c = n->child((intrusive_multi_rbtree_base::side)s);
+				if (!c->nil() && c->mMaxAlignLog2 > maxAlign)
+					maxAlign = c->mMaxAlignLog2;
+			}
+			n->mMaxAlignLog2 = (unsigned char)maxAlign;
+		}
 	};
 	typedef intrusive_multi_rbtree<free_node> free_node_tree;
+	static free_node* find_aligned(free_node* node, size_t size, unsigned alignLog2);
 
+	bool ptr_has_bucket_marker(void* ptr) const;
 	bool ptr_in_bucket(void* ptr) const;
 	void split_block(block_header* bl, size_t size);
 	block_header* shift_block(block_header* bl, size_t offs);
@@ -290,48 +537,168 @@ class HeapAllocator{
 	void tree_attach(block_header* bl);
 	void tree_detach(block_header* bl);
 	void tree_purge_block(block_header* bl);
-	void* tree_alloc(size_t size);
+	void* tree_alloc(size_t size, bool* zero = NULL);
+	void* tree_alloc_unlocked(size_t size, bool* zero = NULL);
 	void* tree_alloc_aligned(size_t size, size_t alignment);
+	void* tree_alloc_aligned_unlocked(size_t size, size_t alignment);
 	void* tree_realloc(void* ptr, size_t size);
 	void* tree_realloc_aligned(void* ptr, size_t size, size_t alignment);
-	size_t tree_resize(void* ptr, size_t size);
+	size_t tree_resize(void* ptr, size_t minSize, size_t size);
 	void tree_free(void* ptr);
+	void tree_free_unlocked(void* ptr);
 	void tree_purge();
+	block_header* tree_quick_get(size_t size);
+	void tree_quick_flush();
 
-	enum debug_source {DEBUG_SOURCE_BUCKETS = 0, DEBUG_SOURCE_TREE = 1};
-	bucket mBuckets[NUM_BUCKETS];
+	bucket mBuckets[NUM_HEAP_BUCKETS];
 	block_header* mMRFreeBlock;
 	free_node_tree mFreeTree;
 	small_free_node_list mSmallFreeList;
-	#ifdef MULTITHREADED
-	MutexLock mDebugMutex;
-	MutexLock mTreeMutex;
-	#endif
-	#ifdef DEBUG_ALLOCATOR
-	static sPreBufferData* sTopMemoryBlock;
-	static uint32 sAllocAccount;
-	static uint32 sReleaseAccount;
-	static uint32 sTotalBytesRequested;
-	static uint32 sTotalBytesInUse;
-	static uint32 sMaximumBytesRequested;
-	static uint32 sMaxinumBytesInUse;
-	static const uint32 s_preBufferSize = sizeof(sPreBufferData);
-	static const uint32 s_postBufferSize = sizeof(sPostBufferData);
-	static const uint32 s_blockHeadSize = sizeof(sMemoryBlockHeader);
-	#else
-	static const uint32 s_preBufferSize = 0;
-	static const uint32 s_postBufferSize = 0;
-	static const uint32 s_blockHeadSize = 0;
-	#endif
+	segment_list mSegments;
+	quick_node_list mQuickLists[QUICK_LISTS];	// hashed by size, a list may mix sizes
+	size_t mQuickCount;
+	size_t mQuickMax;	// deferred blocks before a batch merge, 0 coalesces on every free
+	int mNode;	// NUMA node the heap's memory is bound to, -1 for no binding
+	cpu_cache* mCpuCaches;
+	int mCpuCount;
+	unsigned mCpuCacheDepth;	// objects cached per cpu and size class, 0 disables the caches
+	// runtime knobs, see ctl(). The tree knobs change under mTreeMutex, mHugeThreshold
+	// is also read without it and mLatencyStats under no lock, those two use __atomic
+	size_t mGrowSize;	// smallest segment the tree takes from the system
+	static const size_t MAX_TREE_GROW = (size_t)-1 >> 1;	// larger segments can't be sized without overflow
+	size_t mHugeThreshold;	// tree requests this large get their own segment, 0 disables
+	size_t mRetainBytes;	// bytes of free segments purge() keeps for reuse
+	bool mLatencyStats;	// time alloc/free/realloc into the per-thread latency histograms
+
+	/*
+	 * Empty bucket pages shared by all size classes. A bucket keeps one empty
+	 * page of its own, further pages that run empty go to the pool, where any
+	 * bucket_grow picks them up before asking the system. The pool holds at
+	 * most mPagePoolMax pages, pages unused for mPagePoolDecay nanoseconds
+	 * go back to the system.
+	 */
+	struct pooled_page : intrusive_list<pooled_page>::node {
+		uint64 mPooledAt;
+	};
+	typedef intrusive_list<pooled_page> pooled_page_list;
+	pooled_page_list mPagePool;	// most recently pooled in front
+	size_t mPagePoolSize;
+	size_t mPagePoolMax;
+	uint64 mPagePoolDecay;
+	mutable lock_type mPagePoolLock;
+	void* page_pool_get();
+	void page_pool_put(void* mem);
+	void page_pool_trim(size_t keep, uint64 now);
+
+	/*
+	 * Call site lifetime learning (lifetime.sample_rate). Every n-th small
+	 * allocation of a thread is sampled together with the file:line passed by
+	 * the heap_alloc macros, and its free tells whether it lived shorter than
+	 * mLifetimeShortNs. Sites whose samples are mostly short lived allocate from
+	 * the SHORT_LIVED_BUCKETS, so their pages run empty together instead of
+	 * being pinned by a few long lived neighbours. Both tables are direct
+	 * mapped, a colliding site or sample simply replaces the old one.
+	 */
+	struct lifetime_site {
+		const char* mFile;
+		int mLine;
+		uint32 mSamples;
+		uint32 mShort;
+		bool mShortLived;
+	};
+	struct lifetime_sample {
+		void* mPtr;
+		uint64 mBorn;
+		lifetime_site* mSite;
+	};
+	/*
+	 * Per-thread countdowns to the next sample, one per heap. The slots are
+	 * hashed by heap address and tagged, two heaps only share a countdown
+	 * when more than LIFETIME_COUNTDOWNS of them sample on the same thread.
+	 */
+	struct lifetime_countdown {
+		const void* mHeap;
+		uint32 mCount;
+	};
+	static const unsigned LIFETIME_COUNTDOWNS = 8;
+	static const unsigned LIFETIME_SITES = 1024;
+	static const unsigned LIFETIME_SAMPLES = 1024;
+	static const uint32 LIFETIME_MIN_SAMPLES = 16;	// before a site gets a prediction
+	static const uint32 LIFETIME_MAX_SAMPLES = 256;	// counts are halved beyond, so sites can change their mind
+	struct lifetime_tables {
+		lifetime_site mSites[LIFETIME_SITES];
+		lifetime_sample mSamples[LIFETIME_SAMPLES];
+	};
+	lifetime_tables* mLifetime;	// allocated when sampling is first enabled, published with a release store
+	uint32 mLifetimeRate;	// 1 in n small allocations is sampled, 0 disables
+	uint64 mLifetimeShortNs;
+	mutable lock_type mLifetimeLock;
+	static lifetime_site& lifetime_site_of(lifetime_tables* t, const char* file, int line) {
+		return t->mSites[(((size_t)file >> 3) ^ (size_t)line * 2654435761U) % LIFETIME_SITES];
+	}
+	static lifetime_sample& lifetime_sample_of(lifetime_tables* t, const void* ptr) {
+		return t->mSamples[(((size_t)ptr >> 4) * 2654435761U >> 8) % LIFETIME_SAMPLES];
+	}
+	lifetime_tables* lifetime() const {return __atomic_load_n(&mLifetime, __ATOMIC_ACQUIRE);}
+	unsigned lifetime_bucket(unsigned bi, const char* file, int line, bool& sample);
+	void lifetime_sample_alloc(void* ptr, const char* file, int line);
+	void lifetime_free(void* ptr);
+	void lifetime_record(lifetime_site* site, bool shortLived);
+
+	/*
+	 * Real-time mode (rt.enabled): a background thread keeps mRtPages
+	 * pre-faulted pages in the page pool and mRtSegments pre-faulted segments
+	 * of mRtSegmentSize bytes in mReserveSegments, so bucket_grow and
+	 * tree_grow take memory without a system call or page fault. A grow that
+	 * finds its reserve below half the target counts as a breach and wakes the
+	 * thread; one that finds nothing fitting counts as a miss and still falls
+	 * back to the system. The page pool is raised to hold the reserve while
+	 * the mode runs and gets its own limit back when it stops.
+	 */
+	segment_list mReserveSegments;	// guarded by mTreeMutex
+	size_t mReserveSegmentCount;
+	size_t mRtPages;
+	size_t mRtPoolMax;	// page_pool.max_pages to restore in rt_stop, guarded by mPagePoolLock
+	size_t mRtSegments;
+	size_t mRtSegmentSize;
+	uint64 mRtBreaches;
+	uint64 mRtMisses;
+	volatile bool mRtRunning;
+	bool mRtWake;	// guarded by mRtLock
+	pthread_t mRtThread;
+	MutexLock mRtLock;
+	pthread_cond_t mRtCond;
+	bool rt_start();
+	void rt_stop();
+	void rt_wake();
+	void rt_refill();
+	void rt_check(size_t level, size_t target, unsigned kind);
+	void* rt_take_segment(size_t& size);
+	static void* rt_main(void* heap);
+	static void prefault(void* mem, size_t size);
+	bool reserve_bucket(unsigned bi, size_t slots, unsigned flags);
+	bool reserve_tree(size_t bytes, unsigned flags);
+	static bool reserve_commit(void* mem, size_t size, unsigned flags);
+	bool is_huge(size_t size) const {
+		size_t threshold = __atomic_load_n(&mHugeThreshold, __ATOMIC_RELAXED);
+		return threshold && size >= threshold;
+	}
+	bool latency_enabled() const {return __atomic_load_n(&mLatencyStats, __ATOMIC_RELAXED);}
+	void bucket_stats(unsigned bi, size_t& pages, size_t& used, size_t& slots, size_t& emptyPages) const;
+	void tree_stats(size_t& freeBytes, size_t& freeBlocks, size_t& smallFreeBlocks, size_t& segments, size_t& segmentBytes) const;
+	mutable lock_type mTreeMutex;
+	SuperblockArena mSuperblocks;	// bucket pages and small segments, guarded by mTreeMutex
+	debug_type mDebug;
 	
 public:
-	static HeapAllocator* getInstance()
+	static BasicHeapAllocator* getInstance()
 	{
 		if(allocator == NULL)
-			allocator = new HeapAllocator();
+			allocator = new BasicHeapAllocator();
 		return allocator;
 	}
-	~HeapAllocator();
+	BasicHeapAllocator();
+	~BasicHeapAllocator();
 	void* alloc(size_t size, const char* filename = __FILE__, int linenum = __LINE__);
 	void* alloc(size_t size, size_t alignment, const char* filename = __FILE__, int linenum = __LINE__);
 	void* calloc(size_t count, size_t size);
@@ -339,18 +706,123 @@ public:
 	void* realloc(void* ptr, size_t size, size_t alignment, const char* filename = __FILE__, int linenum = __LINE__);
 	size_t size(void* ptr) const;
 	void free(void* ptr);
+	// sized free, skips the bucket lookup. size and alignment must be the ones
+	// passed to alloc, memory which went through realloc, try_expand or shrink must use free(ptr).
+	void free(void* ptr, size_t size, size_t alignment = DEFAULT_ALIGNMENT);
+	// In place resizing, the block never moves. usable_size is the number of bytes
+	// the caller may use and takes no locks. try_expand grows the block towards
+	// preferredSize out of its slot or its free right neighbour and leaves it alone
+	// when minSize can't be reached; shrink hands the tail of a large block back.
+	// Both return the usable size afterwards.
+	size_t usable_size(void* ptr) const;
+	size_t try_expand(void* ptr, size_t minSize, size_t preferredSize);
+	size_t shrink(void* ptr, size_t size);
 	void purge();
-	#ifdef DEBUG_ALLOCATOR
-	void* debug_alloc(void* ptr, size_t size, size_t trueSize, debug_source src, uint8 align, const char* filename, int linenum);
-	void debug_realloc(void* ptr);
-	void* debug_free(void* ptr);
-	void debug_check(void* ptr);
-	void check();
-	void report();
-	#endif
+	// The page pool decays lazily, when a bucket grows or empties a page; a
+	// heap which went idle keeps its pooled pages until decay (or purge) runs,
+	// so long running programs call it from their idle loop or timer.
+	void decay();
+	void destroy();
+	/*
+	 * Warm-up: reserve makes room for count allocations of size bytes ahead of
+	 * time, as empty pages of the size class or as one free tree block, so the
+	 * first allocations don't pay for growing. Slots already free in the size
+	 * class count towards the reservation, tree blocks are always added.
+	 * RESERVE_POPULATE touches the memory so it is faulted in, RESERVE_LOCK
+	 * also mlocks it. Returns false when memory (or the lock) couldn't be had.
+	 * Reserved memory is ordinary free memory, purge() hands it back.
+	 *
+	 * dump_profile writes the slots in use per size class and the bytes in use
+	 * in the tree to a text file, prewarm reserves all of it again, e.g. with
+	 * a profile taken from the steady state of the previous run. Both return
+	 * 0 or an errno value.
+	 */
+	enum reserve_flags {RESERVE_POPULATE = 1, RESERVE_LOCK = 2};
+	bool reserve(size_t size, size_t count, unsigned flags = 0);
+	int dump_profile(const char* path) const;
+	int prewarm(const char* path, unsigned flags = 0);
+	// true when ptr was allocated from this heap
+	bool owns(void* ptr) const;
+	// bind all memory the heap takes from the system from now on to a NUMA node,
+	// and record it in the page map (page_map.h) so its owner can be looked up
+	void set_node(int node) {
+		mNode = node;
+		mSuperblocks.set_node(node);
+	}
+	int node() const {return mNode;}
+	// enable (depth > 0) or disable the per-cpu caches, meant to be called at startup.
+	// returns false when rseq is not available and the caches stay off.
+	bool set_cpu_cache(unsigned depth);
+	unsigned cpu_cache_depth() const {return __atomic_load_n(&mCpuCacheDepth, __ATOMIC_ACQUIRE);}
+	// contention statistics of the bucket locks (one per size class) and of the tree lock
+	static unsigned bucket_count() {return NUM_HEAP_BUCKETS;}
+	static size_t bucket_elem_size(unsigned bi) {return bucket_elem_size_of(bi);}
+	const LockStats& bucket_lock_stats(unsigned bi) const {return mBuckets[bi].get_lock().stats();}
+	const LockStats& tree_lock_stats() const {return mTreeMutex.stats();}
+	void lock_report() const;
+	/*
+	 * Named control interface in the spirit of mallctl, every value is a size_t.
+	 * oldp (may be NULL) receives the current value, newp (may be NULL) sets it.
+	 * Returns 0, ENOENT for an unknown name, EPERM when writing a statistic and
+	 * EINVAL for a rejected value. Knobs may be set while other threads use the
+	 * heap, a new value applies from the next operation that reads it.
+	 *	tree.grow_size		smallest segment taken from the system, rounded up to
+	 *				VIRTUAL_PAGE_SIZE, 0 is rejected (PAGE_SIZE)
+	 *	tree.huge_threshold	tree requests of at least this size get their own
+	 *				segment which goes back to the system when freed (0, off)
+	 *	tree.retain_bytes	free segment bytes purge() keeps for reuse (0)
+	 *	tree.quick_list_max	freed blocks held back from coalescing for same size reuse (0, off)
+	 *	stats.tree.quick_blocks	blocks currently waiting in the quick lists
+	 *	cpu_cache.depth		per-cpu cache depth, see set_cpu_cache (0)
+	 *	page_pool.max_pages	empty bucket pages shared between size classes, 0 disables (64)
+	 *	page_pool.decay_ms	pooled pages unused this long go back to the system (10000)
+	 *	stats.page_pool.pages	pages currently pooled
+	 *	rt.enabled		1 starts the reserve refill thread, thread safe heaps only (0)
+	 *	rt.reserve_pages	pre-faulted pages kept in the page pool (64)
+	 *	rt.reserve_segments	pre-faulted tree segments kept aside (4)
+	 *	rt.segment_size		size of a reserve segment, larger tree grows miss (1MB)
+	 *	stats.rt.breaches, stats.rt.misses, stats.rt.reserve_segments
+	 *	lifetime.sample_rate	sample 1 in n small allocations to learn call site lifetimes, 0 disables (0)
+	 *	lifetime.short_us	samples freed within this many microseconds count as short lived (1000)
+	 *	stats.lifetime.short_sites	call sites currently placed in the short lived buckets
+	 *	latency.enabled		1 records per path latency histograms, see latency.h (0)
+	 *	latency.<path>.count, .p50, .p99, .p999, .max	process wide, in nanoseconds
+	 *	config.page_size, config.max_small_allocation, config.max_aligned_allocation
+	 *	stats.buckets		number of size classes
+	 *	stats.bucket.<i>.elem_size, .pages, .empty_pages, .slots_used, .slots_total
+	 *	stats.buckets.slots_used, .slots_total, .utilization (used per mille of the slots in pages)
+	 *	stats.tree.free_bytes, stats.tree.free_blocks, stats.tree.small_free_blocks
+	 *	stats.segments, stats.segment_bytes
+	 *	stats.superblocks.count, .used_pages, .committed_bytes
+	 */
+	int ctl(const char* name, size_t* oldp, const size_t* newp = NULL);
+	// applies "name:value,name:value" settings, every heap reads SHARK_HEAP_CONF on construction
+	int configure(const char* conf);
+	// guard pattern check of all live blocks and leak report, only with DEBUG_INFO
+	void check() {mDebug.check();}
+	void report() {mDebug.report();}
 	
 };
 
+typedef BasicHeapAllocator<default_heap_policy> HeapAllocator;
+typedef BasicHeapAllocator<single_thread_heap_policy> SingleThreadHeapAllocator;
+typedef BasicHeapAllocator<debug_heap_policy> DebugHeapAllocator;
+typedef BasicHeapAllocator<bitmap_heap_policy> BitmapHeapAllocator;
+
+// Independent heaps: every instance owns its own buckets, free tree and segments.
+inline HeapAllocator* heap_create() {
+	return new HeapAllocator();
+}
+
+// Releases all segments of the heap at once, live blocks included, then deletes it.
+template<class Policy>
+inline void heap_destroy(BasicHeapAllocator<Policy>* heap) {
+	if (heap) {
+		heap->destroy();
+		delete heap;
+	}
+}
+
 }
 
 #endif
\ No newline at end of file
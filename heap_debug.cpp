@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "heap_debug.h"
+using namespace shark;
+
+DebugTracker::DebugTracker()
+	: mTopMemoryBlock(0), mAllocAccount(0), mReleaseAccount(0), mTotalBytesRequested(0),
+	mTotalBytesInUse(0), mMaximumBytesRequested(0), mMaxinumBytesInUse(0)
+{
+}
+
+void* DebugTracker::alloc(void* pRealMem, size_t size, size_t trueSize, debug_source src, uint8 align, const char* filename, int linenum)
+{
+	if (pRealMem == NULL)
+		return NULL;
+	ScopeLock lock(mLock);
+	char* pClientMem = (char*)pRealMem + s_blockHeadSize + s_preBufferSize;
+	
+	sMemoryBlockHeader* blockHeader = (sMemoryBlockHeader*)pRealMem;
+	blockHeader->actualSize = trueSize;
+	blockHeader->pointerOffset = pClientMem - (char*)pRealMem;
+
+	sPreBufferData* pPreBufferData = getPreBufferData(pClientMem);
+	if(pPreBufferData == mTopMemoryBlock)
+		return pClientMem;
+	
+	pPreBufferData->nextHeader = mTopMemoryBlock;
+	pPreBufferData->previousHeader = 0;
+	pPreBufferData->requestedSize =  size;
+	pPreBufferData->userChecksum = 0;
+	pPreBufferData->fileLine = linenum;
+	pPreBufferData->alignment = align;
+	pPreBufferData->debug_source = src;
+
+	if (mTopMemoryBlock)
+	{
+		mTopMemoryBlock->previousHeader = pPreBufferData;
+	}
+	mTopMemoryBlock = pPreBufferData;
+
+	if (filename)
+	{
+		strncpy(pPreBufferData->fileName, filename, MAX_FILEPATH); // filename of the caller
+	}
+	else
+	{
+		strncpy(pPreBufferData->fileName, "unknown", MAX_FILEPATH); // filename of the caller
+	}
+
+	uint8* prePattern = pPreBufferData->bytePattern;
+	uint8* postPattern = (uint8*)pClientMem + size;
+	for (int i=0;i< PATTERN_SIZE;i++)
+	{
+		prePattern[i]=(char) PRE_PATTERN;
+		postPattern[i]=(char) POST_PATTERN;
+	}
+	
+	mAllocAccount++;
+	mTotalBytesRequested += size;
+	mTotalBytesInUse += trueSize;
+	
+	mMaximumBytesRequested = 
+		std::max(mMaximumBytesRequested,
+				mTotalBytesRequested);
+
+	mMaxinumBytesInUse = 
+		std::max(mMaxinumBytesInUse,
+				mTotalBytesInUse);
+	return pClientMem;
+}
+
+void* DebugTracker::free(void* pClientMem)
+{
+	ScopeLock lock(mLock);
+	sMemoryBlockHeader* pHeader = getMemoryBlockHeader((char*)pClientMem);
+	void* pRealPtr = (void*)pHeader;
+
+	sPreBufferData* pPreBufferData = getPreBufferData(pClientMem);
+	uint8* prePattern = pPreBufferData->bytePattern;
+	uint8* postPattern = (uint8*)pPreBufferData + s_preBufferSize + pPreBufferData->requestedSize;
+	for (int i=0;i<PATTERN_SIZE;++i)
+	{
+		assert(prePattern[i]==(uint8)PRE_PATTERN);	//memory overrun detected
+		assert(postPattern[i]==(uint8)POST_PATTERN);//memory overrun detected
+	}
+	mReleaseAccount++;
+	mTotalBytesRequested -= pPreBufferData->requestedSize;
+	mTotalBytesInUse -= pHeader->actualSize;
+	if (mTopMemoryBlock == pPreBufferData)
+	{
+		mTopMemoryBlock = mTopMemoryBlock->nextHeader;
+	}
+	if (pPreBufferData->nextHeader)
+	{
+		pPreBufferData->nextHeader->previousHeader = pPreBufferData->previousHeader;
+	}
+	if (pPreBufferData->previousHeader)
+	{
+		pPreBufferData->previousHeader->nextHeader = pPreBufferData->nextHeader;
+	}
+	return pRealPtr;
+}
+
+void DebugTracker::resize(void* pClientMem, size_t size, size_t trueSize)
+{
+	ScopeLock lock(mLock);
+	check(pClientMem);
+	sMemoryBlockHeader* pHeader = getMemoryBlockHeader(pClientMem);
+	sPreBufferData* pPreBufferData = getPreBufferData(pClientMem);
+	mTotalBytesRequested += size - pPreBufferData->requestedSize;
+	mTotalBytesInUse += trueSize - pHeader->actualSize;
+	pPreBufferData->requestedSize = size;
+	pHeader->actualSize = trueSize;
+
+	uint8* postPattern = (uint8*)pClientMem + size;
+	for (int i=0;i< PATTERN_SIZE;i++)
+		postPattern[i]=(char) POST_PATTERN;
+
+	mMaximumBytesRequested = std::max(mMaximumBytesRequested, mTotalBytesRequested);
+	mMaxinumBytesInUse = std::max(mMaxinumBytesInUse, mTotalBytesInUse);
+}
+
+void DebugTracker::check(void* pClientMem)
+{
+	sPreBufferData* pPreBufferData = getPreBufferData((char*)pClientMem);
+	uint8* prePattern = pPreBufferData->bytePattern;
+	uint8* postPattern = (uint8*)pPreBufferData + s_preBufferSize + pPreBufferData->requestedSize;
+	for (int i=0;i<PATTERN_SIZE;++i)
+	{
+		assert(prePattern[i]==(uint8)PRE_PATTERN);
+		assert(postPattern[i]==(uint8)POST_PATTERN);
+	}
+}
+
+void DebugTracker::check()
+{
+	ScopeLock lock(mLock);
+	sPreBufferData* cur_buf = mTopMemoryBlock;
+	while(cur_buf)
+	{
+		uint8* prePattern = cur_buf->bytePattern;
+		uint8* postPattern = (uint8*)cur_buf + s_preBufferSize + cur_buf->requestedSize;
+		for (int i=0;i<PATTERN_SIZE;++i)
+		{
+			assert(prePattern[i]==(uint8)PRE_PATTERN);
+			assert(postPattern[i]==(uint8)POST_PATTERN);
+		}
+		cur_buf = cur_buf->nextHeader;
+	}
+}
+
+void DebugTracker::report()
+{
+	ScopeLock lock(mLock);
+	printf("\n*** Memory Use Statistics ***\n");
+	printf("Total Allocations: %lu\n", mAllocAccount);
+	printf("Total Deallocations: %lu\n", mReleaseAccount);
+	printf("Maximum memory used (including debug info): %lu\n", mMaxinumBytesInUse);
+	printf("Maximum memory required: %lu\n", mMaximumBytesRequested);
+	printf("Current memory used (including debug info): %lu\n", mTotalBytesInUse);
+	printf("Current memory used by Client: %lu\n", mTotalBytesRequested);
+	printf("*** End Memory Use Statistics ***\n");
+	printf("\n*** Memory Use Details ***\n");
+	sPreBufferData* cur_buf = mTopMemoryBlock;
+	int index = 0;
+	while(cur_buf)
+	{
+		printf("\n[memory alloc info %d]\n", ++index);
+		printf("filename[%s]\n", cur_buf->fileName);
+		printf("line[%lu]\n", cur_buf->fileLine);
+		printf("request size[%lu]\n", cur_buf->requestedSize);
+
+		cur_buf = cur_buf->nextHeader;
+	}
+	printf("*** End Memory Use Details ***\n\n");
+}
+
+void DebugTracker::reset()
+{
+	ScopeLock lock(mLock);
+	mTopMemoryBlock = 0;
+	mTotalBytesRequested = 0;
+	mTotalBytesInUse = 0;
+}
+
+void NullDebugTracker::report()
+{
+	printf("*** memory allocation info is not available***\n\n");
+}
+
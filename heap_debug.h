@@ -0,0 +1,124 @@
+#ifndef SHARK_HEAP_DEBUG_H
+#define SHARK_HEAP_DEBUG_H
+#include <stddef.h>
+#include "data_types.h"
+#include "mutex.h"
+
+namespace shark
+{
+
+enum MEM_CONSTANTS
+{
+	MAX_CALL_DEPTH		= 16,	// depth of the recorded callstack
+	MAX_CLIENT_FILENAME    = 32,	// number of letters recorded for the client filename
+	MAX_FILEPATH = 128,
+	PATTERN_SIZE = 32,
+};
+
+enum MEM_PATTERNS
+{
+	PRE_PATTERN	= 0xab,	// memory pattern written ahead of allocated client space (GAIA_MEM_DEBUG only)
+	POST_PATTERN	= 0xef,	// memory pattern written after allocated client space (GAIA_MEM_DEBUG only)
+};
+
+enum debug_source {DEBUG_SOURCE_BUCKETS = 0, DEBUG_SOURCE_TREE = 1};
+
+struct sMemoryBlockHeader
+{
+	uint32	actualSize : 24;	// the true size of the allocation
+	uint32	pointerOffset : 8;	// an offset to the top of the allocation
+};
+
+struct sPreBufferData
+{
+	sPreBufferData* nextHeader;			
+	sPreBufferData* previousHeader;
+	uint32		requestedSize;		
+	uint32		userChecksum;
+	uint32		fileLine;
+	char			fileName[MAX_FILEPATH];
+	uint8		bytePattern[PATTERN_SIZE];
+	uint8   		alignment;		
+	uint8		debug_source;
+};
+
+struct sPostBufferData
+{
+	uint8 bytePattern[PATTERN_SIZE];
+};
+
+/*
+ * Debug instrumentation of a heap, selected by the DEBUG_INFO heap policy.
+ * Every block is surrounded by guard patterns and chained into a list of live
+ * allocations with the file and line of the caller, which report() prints.
+ */
+class DebugTracker {
+	DebugTracker(const DebugTracker&);
+	DebugTracker& operator=(const DebugTracker&);
+	MutexLock mLock;
+	sPreBufferData* mTopMemoryBlock;
+	uint32 mAllocAccount;
+	uint32 mReleaseAccount;
+	uint32 mTotalBytesRequested;
+	uint32 mTotalBytesInUse;
+	uint32 mMaximumBytesRequested;
+	uint32 mMaxinumBytesInUse;
+public:
+	static const bool ENABLED = true;
+	static const uint32 s_preBufferSize = sizeof(sPreBufferData);
+	static const uint32 s_postBufferSize = sizeof(sPostBufferData);
+	static const uint32 s_blockHeadSize = sizeof(sMemoryBlockHeader);
+	static const uint32 EXTRA_INFO_SIZE = s_preBufferSize + s_postBufferSize + s_blockHeadSize;
+
+	static sMemoryBlockHeader* getMemoryBlockHeader(void* pClientMem)
+	{
+		return (sMemoryBlockHeader*)((char*)pClientMem - s_preBufferSize - s_blockHeadSize);
+	}
+	static sPreBufferData* getPreBufferData(void* pClientMem)
+	{
+		char* header = (char*)getMemoryBlockHeader(pClientMem);
+		return (sPreBufferData*)(header + s_blockHeadSize);
+	}
+
+	// the guard pattern follows the requested size, nothing behind it may be used
+	static size_t usable_size(void* pClientMem, size_t) {return getPreBufferData(pClientMem)->requestedSize;}
+
+	DebugTracker();
+	void* alloc(void* pRealMem, size_t size, size_t trueSize, debug_source src, uint8 align, const char* filename, int linenum);
+	void* free(void* pClientMem);
+	// the block was resized in place, move the post pattern
+	void resize(void* pClientMem, size_t size, size_t trueSize);
+	void check(void* pClientMem);
+	void check();
+	void report();
+	void reset();
+};
+
+// no instrumentation, client pointers are the real blocks
+class NullDebugTracker {
+	NullDebugTracker(const NullDebugTracker&);
+	NullDebugTracker& operator=(const NullDebugTracker&);
+public:
+	static const bool ENABLED = false;
+	static const uint32 s_preBufferSize = 0;
+	static const uint32 s_postBufferSize = 0;
+	static const uint32 s_blockHeadSize = 0;
+	static const uint32 EXTRA_INFO_SIZE = 0;
+
+	static sMemoryBlockHeader* getMemoryBlockHeader(void* pClientMem) {return (sMemoryBlockHeader*)pClientMem;}
+	static sPreBufferData* getPreBufferData(void* pClientMem) {return (sPreBufferData*)pClientMem;}
+	static size_t usable_size(void*, size_t capacity) {return capacity;}
+
+	NullDebugTracker() {}
+	void* alloc(void* pRealMem, size_t, size_t, debug_source, uint8, const char*, int) {return pRealMem;}
+	void* free(void* pClientMem) {return pClientMem;}
+	void resize(void*, size_t, size_t) {}
+	void check(void*) {}
+	void check() {}
+	void report();
+	void reset() {}
+};
+
+}
+
+#endif
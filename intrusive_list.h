@@ -41,6 +41,8 @@ public:
 		mHead.reset();
 	}
 	bool empty() const {return mHead.next() == &mHead;}
+	// drop all nodes without unlinking them one by one
+	void reset() {mHead.reset();}
 
 	//only switch both lists' head nodes
 	void swap(intrusive_list_base& other) {
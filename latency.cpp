@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include "latency.h"
+#include "mutex.h"
+using namespace shark;
+
+__thread LatencyScope* LatencyScope::sCurrent = NULL;
+
+static const char* s_pathNames[NUM_LATENCY_PATHS] = {
+	"alloc_bucket", "alloc_bucket_grow", "alloc_tree", "alloc_tree_grow",
+	"free_bucket", "free_tree", "free_coalesce", "realloc"
+};
+
+const char* shark::latency_path_name(unsigned path) {
+	return path < NUM_LATENCY_PATHS ? s_pathNames[path] : "unknown";
+}
+
+void LatencyHistogram::reset() {
+	memset(mCounts, 0, sizeof(mCounts));
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& rhs) {
+	for (unsigned i = 0; i < NUM_COUNTS; i++)
+		mCounts[i] += __atomic_load_n(&rhs.mCounts[i], __ATOMIC_RELAXED);
+}
+
+uint64 LatencyHistogram::count() const {
+	uint64 n = 0;
+	for (unsigned i = 0; i < NUM_COUNTS; i++)
+		n += __atomic_load_n(&mCounts[i], __ATOMIC_RELAXED);
+	return n;
+}
+
+uint64 LatencyHistogram::percentile(double q) const {
+	uint64 total = count();
+	if (total == 0)
+		return 0;
+	uint64 rank = (uint64)(q * total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+	uint64 seen = 0;
+	unsigned last = 0;
+	for (unsigned i = 0; i < NUM_COUNTS; i++) {
+		uint64 c = __atomic_load_n(&mCounts[i], __ATOMIC_RELAXED);
+		if (c == 0)
+			continue;
+		last = i;
+		seen += c;
+		if (seen >= rank)
+			return highest_equivalent(i);
+	}
+	return highest_equivalent(last);
+}
+
+namespace
+{
+
+struct thread_latency {
+	thread_latency* mNext;
+	thread_latency* mPrev;
+	uint32 mGeneration;	// reset generation the histograms belong to, published by the owner
+	LatencyHistogram mPaths[NUM_LATENCY_PATHS];
+};
+
+/*
+ * latency_reset only bumps the generation: a thread's histograms are written
+ * without atomics by their owner, so the owner zeroes them itself on its next
+ * record. Until then readers treat histograms of an older generation as empty.
+ */
+uint32 s_generation = 0;
+
+// registry of the live threads' histograms and the sum of the exited ones
+struct latency_registry {
+	MutexLock mLock;
+	thread_latency mHead;
+	LatencyHistogram mRetired[NUM_LATENCY_PATHS];
+	latency_registry() {mHead.mNext = mHead.mPrev = &mHead;}
+};
+
+latency_registry& registry() {
+	static latency_registry* r = new latency_registry();	// outlives exiting threads
+	return *r;
+}
+
+struct thread_latency_holder {
+	thread_latency* mStats;
+	thread_latency_holder() : mStats(NULL) {}
+	~thread_latency_holder() {
+		if (!mStats)
+			return;
+		latency_registry& r = registry();
+		ScopeLock lock(r.mLock);
+		if (mStats->mGeneration == __atomic_load_n(&s_generation, __ATOMIC_RELAXED)) {
+			for (unsigned i = 0; i < NUM_LATENCY_PATHS; i++)
+				r.mRetired[i].merge(mStats->mPaths[i]);
+		}
+		mStats->mPrev->mNext = mStats->mNext;
+		mStats->mNext->mPrev = mStats->mPrev;
+		delete mStats;
+	}
+	thread_latency* get() {
+		if (!mStats) {
+			mStats = new thread_latency();
+			latency_registry& r = registry();
+			ScopeLock lock(r.mLock);
+			mStats->mGeneration = __atomic_load_n(&s_generation, __ATOMIC_RELAXED);
+			mStats->mPrev = &r.mHead;
+			mStats->mNext = r.mHead.mNext;
+			r.mHead.mNext->mPrev = mStats;
+			r.mHead.mNext = mStats;
+		}
+		return mStats;
+	}
+};
+
+thread_local thread_latency_holder s_threadLatency;
+
+}
+
+void shark::latency_record(unsigned path, uint64 nanos) {
+	thread_latency* t = s_threadLatency.get();
+	uint32 generation = __atomic_load_n(&s_generation, __ATOMIC_ACQUIRE);
+	if (t->mGeneration != generation) {
+		for (unsigned i = 0; i < NUM_LATENCY_PATHS; i++)
+			t->mPaths[i].reset();
+		__atomic_store_n(&t->mGeneration, generation, __ATOMIC_RELEASE);
+	}
+	t->mPaths[path].record(nanos);
+}
+
+void shark::latency_snapshot(unsigned path, LatencyHistogram& out) {
+	out.reset();
+	latency_registry& r = registry();
+	ScopeLock lock(r.mLock);
+	out.merge(r.mRetired[path]);
+	// the generation can't move while we hold the lock, so a current owner won't zero under us
+	uint32 generation = __atomic_load_n(&s_generation, __ATOMIC_RELAXED);
+	for (thread_latency* t = r.mHead.mNext; t != &r.mHead; t = t->mNext) {
+		if (__atomic_load_n(&t->mGeneration, __ATOMIC_ACQUIRE) == generation)
+			out.merge(t->mPaths[path]);
+	}
+}
+
+void shark::latency_reset() {
+	latency_registry& r = registry();
+	ScopeLock lock(r.mLock);
+	for (unsigned i = 0; i < NUM_LATENCY_PATHS; i++)
+		r.mRetired[i].reset();
+	__atomic_store_n(&s_generation, s_generation + 1, __ATOMIC_RELEASE);
+}
+
+void shark::latency_report() {
+	printf("\n*** Allocator Latency (ns) ***\n");
+	LatencyHistogram h;
+	for (unsigned i = 0; i < NUM_LATENCY_PATHS; i++) {
+		latency_snapshot(i, h);
+		uint64 n = h.count();
+		if (n == 0)
+			continue;
+		printf("%-18s count %llu p50 %llu p99 %llu p99.9 %llu max %llu\n", latency_path_name(i), (unsigned long long)n,
+			(unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+			(unsigned long long)h.percentile(0.999), (unsigned long long)h.max());
+	}
+	printf("*** End Allocator Latency ***\n\n");
+}
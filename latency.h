@@ -0,0 +1,124 @@
+#ifndef SHARK_LATENCY_H
+#define SHARK_LATENCY_H
+#include <stddef.h>
+#include <time.h>
+#include "data_types.h"
+
+namespace shark
+{
+
+// allocator paths timed by the latency instrumentation, ordered so that marks only raise them
+enum latency_path {
+	LATENCY_ALLOC_BUCKET,		// bucket slot from a page or a per-cpu cache
+	LATENCY_ALLOC_BUCKET_GROW,	// the bucket had to take a fresh page
+	LATENCY_ALLOC_TREE,		// block extracted from the free tree
+	LATENCY_ALLOC_TREE_GROW,	// the tree had to take a new segment
+	LATENCY_FREE_BUCKET,
+	LATENCY_FREE_TREE,
+	LATENCY_FREE_COALESCE,		// the freed block merged with a neighbour
+	LATENCY_REALLOC,
+	NUM_LATENCY_PATHS
+};
+
+const char* latency_path_name(unsigned path);
+
+/*
+ * Log-linear (HDR style) histogram of nanosecond values: 16 linear sub-buckets
+ * per power of two, so every recorded value is off by less than 1/16.
+ * A histogram is only written by its owning thread, readers may see a count
+ * which is a few records behind.
+ */
+class LatencyHistogram {
+public:
+	static const unsigned SUB_BUCKET_BITS = 4;
+	static const unsigned SUB_BUCKETS = 1U << SUB_BUCKET_BITS;
+	static const unsigned MAX_VALUE_BITS = 40;	// about 18 minutes, larger values are clamped
+	static const unsigned NUM_COUNTS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	LatencyHistogram() {reset();}
+	void reset();
+	void record(uint64 nanos) {
+		unsigned i = index_of(nanos);
+		__atomic_store_n(&mCounts[i], __atomic_load_n(&mCounts[i], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	}
+	void merge(const LatencyHistogram& rhs);
+	uint64 count() const;
+	// highest value equivalent to the q-th quantile (0 <= q <= 1), 0 when empty
+	uint64 percentile(double q) const;
+	uint64 max() const {return percentile(1.0);}
+
+	static unsigned index_of(uint64 v) {
+		if (v >= ((uint64)1 << MAX_VALUE_BITS))
+			v = ((uint64)1 << MAX_VALUE_BITS) - 1;
+		if (v < SUB_BUCKETS)
+			return (unsigned)v;
+		unsigned shift = 63 - __builtin_clzll(v) - SUB_BUCKET_BITS;
+		return (shift + 1) * SUB_BUCKETS + (unsigned)((v >> shift) & (SUB_BUCKETS - 1));
+	}
+	static uint64 highest_equivalent(unsigned index) {
+		if (index < SUB_BUCKETS)
+			return index;
+		unsigned shift = index / SUB_BUCKETS - 1;
+		return (((uint64)(SUB_BUCKETS + index % SUB_BUCKETS) + 1) << shift) - 1;
+	}
+private:
+	uint64 mCounts[NUM_COUNTS];
+};
+
+inline uint64 latency_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Per-thread histograms, one per path, shared by all heaps of the process.
+ * Recording never locks: every thread writes its own histograms, which are
+ * registered once per thread and folded into a retired set when it exits.
+ */
+void latency_record(unsigned path, uint64 nanos);
+// sum over all threads, live and exited
+void latency_snapshot(unsigned path, LatencyHistogram& out);
+// safe while threads record: each owner zeroes its own histograms on its next record
+void latency_reset();
+void latency_report();
+
+/*
+ * Times one allocator call. Inner functions upgrade the path of the innermost
+ * active scope of the thread with latency_mark (e.g. bucket hit -> bucket grow);
+ * a mark only ever raises the path, so a realloc stays a realloc.
+ */
+class LatencyScope {
+	LatencyScope(const LatencyScope&);
+	LatencyScope& operator=(const LatencyScope&);
+	static __thread LatencyScope* sCurrent;
+	LatencyScope* mOuter;
+	uint64 mStart;
+	unsigned mPath;
+	bool mActive;
+public:
+	LatencyScope(bool active, unsigned path) : mActive(active) {
+		if (active) {
+			mPath = path;
+			mOuter = sCurrent;
+			sCurrent = this;
+			mStart = latency_now();
+		}
+	}
+	~LatencyScope() {
+		if (mActive) {
+			latency_record(mPath, latency_now() - mStart);
+			sCurrent = mOuter;
+		}
+	}
+	static void mark(unsigned path) {
+		if (sCurrent && sCurrent->mPath < path)
+			sCurrent->mPath = path;
+	}
+};
+
+inline void latency_mark(unsigned path) {LatencyScope::mark(path);}
+
+}
+
+#endif
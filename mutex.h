@@ -1,6 +1,13 @@
 #ifndef SCOPE_LOCK_H_20141202
 #define SCOPE_LOCK_H_20141202
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "data_types.h"
+#include "probes.h"
 
 namespace shark
 {
@@ -38,25 +45,193 @@ private:
   	pthread_mutex_t mutex_;
 };
 
-class ScopeLock
+struct LockStats{
+	uint64 mAcquisitions;
+	uint64 mContended;		// acquisitions which found the lock taken
+	uint64 mWaitNanos;		// total time spent waiting in contended acquisitions
+};
+
+/*
+ * Lock for very short critical sections: spins a bounded number of times
+ * with a pause, then sleeps on a futex. The state word follows Drepper's
+ * "Futexes Are Tricky" mutex: 0 unlocked, 1 locked, 2 locked with waiters.
+ * Statistics (STATS = true) are updated while the lock is held, so they need no atomics.
+ */
+template<bool STATS>
+class BasicAdaptiveLock{
+	BasicAdaptiveLock(const BasicAdaptiveLock&);
+	BasicAdaptiveLock& operator=(const BasicAdaptiveLock&);
+
+	static void cpu_relax()
+	{
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+	#endif
+	}
+	static uint64 now_nanos()
+	{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	void lock_slow()
+	{
+	uint64 start = STATS ? now_nanos() : 0;
+	SHARK_PROBE1(lock_wait, this);
+	int c = 1;
+	for (unsigned i = 0; i < spinCount_; i++) {
+		cpu_relax();
+		if (state_ == 0 && (c = __sync_val_compare_and_swap(&state_, 0, 1)) == 0)
+			break;
+	}
+	if (c != 0) {
+		if (c != 2)
+			c = __sync_lock_test_and_set(&state_, 2);
+		while (c != 0) {
+			syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+			c = __sync_lock_test_and_set(&state_, 2);
+		}
+	}
+	SHARK_PROBE1(lock_acquired, this);
+	if (STATS) {
+		stats_.mAcquisitions++;
+		stats_.mContended++;
+		stats_.mWaitNanos += now_nanos() - start;
+	}
+	}
+public:
+	explicit BasicAdaptiveLock(unsigned spinCount = 100)
+		: state_(0), spinCount_(spinCount)
+	{
+	stats_.mAcquisitions = 0;
+	stats_.mContended = 0;
+	stats_.mWaitNanos = 0;
+	}
+
+	void lock()
+	{
+	if (__sync_bool_compare_and_swap(&state_, 0, 1)) {
+		if (STATS)
+			stats_.mAcquisitions++;
+		return;
+	}
+	lock_slow();
+	}
+
+	bool try_lock()
+	{
+	if (!__sync_bool_compare_and_swap(&state_, 0, 1))
+		return false;
+	if (STATS)
+		stats_.mAcquisitions++;
+	return true;
+	}
+
+	void unlock()
+	{
+	if (__sync_fetch_and_sub(&state_, 1) != 1) {
+		state_ = 0;
+		syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+	}
+
+	void set_spin_count(unsigned spinCount) {spinCount_ = spinCount;}
+	const LockStats& stats() const {return stats_;}
+
+private:
+	volatile int state_;
+	unsigned spinCount_;
+	LockStats stats_;
+};
+
+typedef BasicAdaptiveLock<true> AdaptiveLock;
+
+//lock type for data which is never shared between threads
+class NullLock{
+	NullLock(const NullLock&);
+	NullLock& operator=(const NullLock&);
+public:
+	NullLock() {}
+	void lock() {}
+	bool try_lock() {return true;}
+	void unlock() {}
+	void set_spin_count(unsigned) {}
+	const LockStats& stats() const
+	{
+	static const LockStats none = {0, 0, 0};
+	return none;
+	}
+};
+
+/*
+ * Mutex living in memory shared between processes. It has no constructor:
+ * whoever creates the shared memory calls init() once, the others just lock.
+ * init returns 0 or the pthread error.
+ * The mutex is robust: when a process dies holding it, the next lock() takes
+ * it over, marks it consistent again and returns true. The data it guards
+ * may have been left half updated, the caller has to check or repair it.
+ */
+class ProcessSharedLock{
+	ProcessSharedLock(const ProcessSharedLock&);
+	ProcessSharedLock& operator=(const ProcessSharedLock&);
+public:
+	int init()
+	{
+	pthread_mutexattr_t attr;
+	int err = pthread_mutexattr_init(&attr);
+	if (err != 0)
+		return err;
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (err == 0)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (err == 0)
+		err = pthread_mutex_init(&mutex_, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return err;
+	}
+
+	// true when the previous owner died holding the lock
+	bool lock()
+	{
+	if (pthread_mutex_lock(&mutex_) != EOWNERDEAD)
+		return false;
+	pthread_mutex_consistent(&mutex_);
+	return true;
+	}
+
+	void unlock()
+	{
+	pthread_mutex_unlock(&mutex_);
+	}
+
+private:
+  	pthread_mutex_t mutex_;
+};
+
+template<class Lock>
+class BasicScopeLock
 {
 public:
-	explicit ScopeLock(MutexLock& mutex)
+	explicit BasicScopeLock(Lock& mutex)
 		: mutex_(mutex)
 	{
 		mutex_.lock();
 	}
 
-	~ScopeLock()
+	~BasicScopeLock()
 	{
 		mutex_.unlock();
 	}
 private:
-	ScopeLock(const ScopeLock&);
-	ScopeLock& operator=(const ScopeLock&);
-	MutexLock& mutex_;//don't hold the instance of MutexLock, just a reference.
+	BasicScopeLock(const BasicScopeLock&);
+	BasicScopeLock& operator=(const BasicScopeLock&);
+	Lock& mutex_;//don't hold the instance of the lock, just a reference.
 };
 
+typedef BasicScopeLock<MutexLock> ScopeLock;
+typedef BasicScopeLock<AdaptiveLock> AdaptiveScopeLock;
+
 //prevent the misusing, the following usage is fatal.
 #define ScopeLock(x) error "Missing guard object name"
 
@@ -0,0 +1,91 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "numa.h"
+#include "percpu.h"
+using namespace shark;
+
+#define MPOL_BIND		2
+#define MPOL_MF_MOVE	(1<<1)
+
+static int read_node_count() {
+	FILE* f = fopen("/sys/devices/system/node/possible", "r");
+	if (!f)
+		return 1;
+	// format is a cpulist style range such as "0" or "0-1"
+	int first = 0, last = 0;
+	int n = fscanf(f, "%d-%d", &first, &last);
+	fclose(f);
+	if (n < 1)
+		return 1;
+	if (n == 1)
+		last = first;
+	int count = last + 1;
+	if (count < 1)
+		count = 1;
+	if (count > MAX_NUMA_NODES)
+		count = MAX_NUMA_NODES;
+	return count;
+}
+
+int shark::numa_node_count() {
+	static int count = read_node_count();
+	return count;
+}
+
+// node of every cpu from /sys/devices/system/node/node<n>/cpulist, 0 for cpus in no list
+static unsigned char* read_cpu_nodes() {
+	int cpus = cpu_count();
+	unsigned char* nodes = (unsigned char*)calloc(cpus, 1);
+	if (!nodes)
+		return NULL;
+	for (int node = 0; node < numa_node_count(); node++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			continue;
+		// "0-3,8-11"
+		int first, last;
+		while (fscanf(f, "%d", &first) == 1) {
+			last = first;
+			int c = fgetc(f);
+			if (c == '-') {
+				if (fscanf(f, "%d", &last) != 1)
+					break;
+				c = fgetc(f);
+			}
+			for (int cpu = first; cpu <= last && cpu < cpus; cpu++)
+				nodes[cpu] = (unsigned char)node;
+			if (c != ',')
+				break;
+		}
+		fclose(f);
+	}
+	return nodes;
+}
+
+int shark::numa_current_node() {
+	if (numa_node_count() == 1)
+		return 0;
+	static unsigned char* nodes = read_cpu_nodes();
+	// rseq costs a load, sched_getcpu goes through the vDSO, neither is a system call
+	int cpu = rseq_current_cpu();
+	if (cpu < 0)
+		cpu = sched_getcpu();
+	return nodes && cpu >= 0 && cpu < cpu_count() ? nodes[cpu] : 0;
+}
+
+bool shark::numa_bind(void* addr, size_t size, int node) {
+	if (node < 0 || numa_node_count() == 1)
+		return false;
+	#ifdef SYS_mbind
+	unsigned long mask = 1UL << node;
+	// the kernel reads maxnode - 1 bits of the mask
+	return syscall(SYS_mbind, addr, size, MPOL_BIND, &mask, sizeof(mask)*8 + 1, MPOL_MF_MOVE) == 0;
+	#else
+	return false;
+	#endif
+}
@@ -0,0 +1,24 @@
+#ifndef SHARK_NUMA_H
+#define SHARK_NUMA_H
+#include <stddef.h>
+
+namespace shark
+{
+
+/*
+ * Thin NUMA layer on top of the raw system calls, so there is no libnuma dependency.
+ * On machines (or kernels) without NUMA support there is a single node 0 and
+ * numa_bind does nothing.
+ */
+const int MAX_NUMA_NODES = 64;
+
+// number of possible nodes, 1 when the topology can't be read
+int numa_node_count();
+// node of the cpu the calling thread is running on
+int numa_current_node();
+// bind [addr, addr+size) to node, pages already touched are migrated
+bool numa_bind(void* addr, size_t size, int node);
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#include "numa_heap.h"
+#include "page_map.h"
+using namespace shark;
+
+NumaHeap::NumaHeap() : mNodeCount(numa_node_count())
+{
+	for (int i = 0; i < mNodeCount; i++) {
+		mHeaps[i] = heap_create();
+		if (mNodeCount > 1)
+			mHeaps[i]->set_node(i);
+	}
+}
+
+NumaHeap::~NumaHeap()
+{
+	for (int i = 0; i < mNodeCount; i++)
+		delete mHeaps[i];
+}
+
+// bound heaps register their pages in the page map, no heap has to be searched
+HeapAllocator* NumaHeap::owner(void* ptr) const {
+	if (mNodeCount == 1)
+		return mHeaps[0];
+	void* heap = page_map_get(ptr);
+	for (int i = 0; i < mNodeCount; i++) {
+		if (mHeaps[i] == heap)
+			return mHeaps[i];
+	}
+	assert(!"pointer not allocated from this NumaHeap");
+	return NULL;
+}
+
+void* NumaHeap::realloc(void* ptr, size_t size) {
+	if (ptr == NULL)
+		return alloc(size);
+	HeapAllocator* heap = owner(ptr);
+	return heap ? heap->realloc(ptr, size) : NULL;
+}
+
+void NumaHeap::free(void* ptr) {
+	if (ptr == NULL)
+		return;
+	if (HeapAllocator* heap = owner(ptr))
+		heap->free(ptr);
+}
+
+void NumaHeap::purge() {
+	for (int i = 0; i < mNodeCount; i++)
+		mHeaps[i]->purge();
+}
+
+void NumaHeap::decay() {
+	for (int i = 0; i < mNodeCount; i++)
+		mHeaps[i]->decay();
+}
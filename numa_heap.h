@@ -0,0 +1,44 @@
+#ifndef SHARK_NUMA_HEAP_H
+#define SHARK_NUMA_HEAP_H
+#include "heap_alloc.h"
+#include "numa.h"
+
+namespace shark
+{
+
+/*
+ * One independent HeapAllocator per NUMA node.
+ * Allocations are served by the heap of the node the calling thread runs on,
+ * and that heap binds its pages and segments to its node. Frees go back to
+ * the heap which owns the memory, whatever node the freeing thread is on.
+ * With a single node this is a plain HeapAllocator without any binding.
+ */
+class NumaHeap {
+	NumaHeap(const NumaHeap&);
+	NumaHeap& operator=(const NumaHeap&);
+	HeapAllocator* mHeaps[MAX_NUMA_NODES];
+	int mNodeCount;
+
+	HeapAllocator* local_heap() const {
+		return mNodeCount == 1 ? mHeaps[0] : mHeaps[numa_current_node()];
+	}
+	// heap whose page map entry covers ptr, NULL (asserting in debug builds) for foreign memory
+	HeapAllocator* owner(void* ptr) const;
+public:
+	NumaHeap();
+	~NumaHeap();
+
+	int node_count() const {return mNodeCount;}
+	HeapAllocator* heap(int node) const {return node >= 0 && node < mNodeCount ? mHeaps[node] : NULL;}
+
+	void* alloc(size_t size) {return local_heap()->alloc(size);}
+	void* alloc(size_t size, size_t alignment) {return local_heap()->alloc(size, alignment);}
+	void* realloc(void* ptr, size_t size);
+	void free(void* ptr);
+	void purge();
+	void decay();
+};
+
+}
+
+#endif
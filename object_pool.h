@@ -0,0 +1,156 @@
+#ifndef SHARK_OBJECT_POOL_H
+#define SHARK_OBJECT_POOL_H
+#include <assert.h>
+#include <new>
+#include <utility>
+#include "heap_alloc.h"
+#include "intrusive_list.h"
+#include "mutex.h"
+
+namespace shark
+{
+
+/*
+ * Fixed size object pool for a single type.
+ * Pages use the same layout as the bucket system: VIRTUAL_PAGE_SIZE aligned
+ * memory cut into equally sized slots, free slots chained through free_link,
+ * and the page header stored at the end of the page. Keeping a type in its
+ * own pages gives better locality than sharing a size class bucket.
+ *
+ * Lock = NullLock gives a pool without any synchronisation, local() returns
+ * such a pool per thread. Objects of a thread local pool must be destroyed by
+ * the thread which created them, and before that thread exits.
+ */
+template<class T, class Lock = MutexLock>
+class ObjectPool {
+	ObjectPool(const ObjectPool&);
+	ObjectPool& operator=(const ObjectPool&);
+
+	struct free_link {
+		free_link* mNext;
+	};
+	struct page : intrusive_list<page>::node {
+		page(free_link* freeList) : mFreeList(freeList), mUseCount(0) {}
+		free_link* mFreeList;
+		size_t mUseCount;
+		bool empty() const {return mUseCount == 0;}
+	};
+	typedef intrusive_list<page> page_list;
+
+	static const size_t ALIGNMENT = __alignof__(T) > sizeof(free_link) ? __alignof__(T) : sizeof(free_link);
+	static const size_t PAGE_SIZE = VIRTUAL_PAGE_SIZE;
+	static page* ptr_get_page(void* ptr) {
+		return (page*)(align_down((char*)ptr, PAGE_SIZE) + (PAGE_SIZE - sizeof(page)));
+	}
+
+	// pages with free slots are kept in front, full pages at the back
+	page_list mPageList;
+	size_t mPageCount;
+	mutable Lock mLock;
+
+	page* grow() {
+		void* mem = system_alloc(PAGE_SIZE);
+		if (!mem)
+			return NULL;
+		size_t n = SLOTS_PER_PAGE * ELEM_SIZE;
+		size_t i = 0;
+		for (; i < n-ELEM_SIZE; i += ELEM_SIZE)
+			((free_link*)((char*)mem + i))->mNext = (free_link*)((char*)mem + i + ELEM_SIZE);
+		((free_link*)((char*)mem + i))->mNext = NULL;
+		page* p = ptr_get_page(mem);
+		new (p) page((free_link*)mem);
+		mPageCount++;
+		return p;
+	}
+public:
+	static const size_t ELEM_SIZE = (sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	static const size_t SLOTS_PER_PAGE = (PAGE_SIZE - sizeof(page)) / ELEM_SIZE;
+	static_assert(SLOTS_PER_PAGE > 0, "T doesn't fit a pool page, allocate it from a HeapAllocator");
+
+	ObjectPool() : mPageCount(0) {}
+	// all objects must have been destroyed, remaining pages are given back
+	~ObjectPool() {
+		while (!mPageList.empty()) {
+			page* p = &mPageList.front();
+			assert(p->empty());
+			p->unlink();
+			system_free(align_down((char*)p, PAGE_SIZE));
+		}
+	}
+
+	static ObjectPool& local() {
+		static thread_local ObjectPool pool;
+		return pool;
+	}
+
+	void* alloc() {
+		BasicScopeLock<Lock> lock(mLock);
+		page* p = mPageList.empty() ? NULL : &mPageList.front();
+		if (!p || !p->mFreeList) {
+			p = grow();
+			if (!p)
+				return NULL;
+			mPageList.push_front(p);
+		}
+		free_link* free = p->mFreeList;
+		p->mFreeList = free->mNext;
+		p->mUseCount++;
+		if (!p->mFreeList) {
+			p->unlink();
+			mPageList.push_back(p);
+		}
+		return free;
+	}
+
+	void free(void* ptr) {
+		assert(ptr);
+		BasicScopeLock<Lock> lock(mLock);
+		page* p = ptr_get_page(ptr);
+		assert(p->mUseCount > 0);
+		free_link* free = p->mFreeList;
+		free_link* lnk = (free_link*)ptr;
+		lnk->mNext = free;
+		p->mFreeList = lnk;
+		p->mUseCount--;
+		if (!free) {
+			p->unlink();
+			mPageList.push_front(p);
+		}
+	}
+
+	template<class... Args> T* create(Args&&... args) {
+		void* mem = alloc();
+		if (!mem)
+			return NULL;
+		return new (mem) T(std::forward<Args>(args)...);
+	}
+
+	void destroy(T* obj) {
+		if (obj) {
+			obj->~T();
+			free(obj);
+		}
+	}
+
+	// release pages which hold no objects
+	void purge() {
+		BasicScopeLock<Lock> lock(mLock);
+		for (page* p = mPageList.begin(); p != mPageList.end(); ) {
+			if (p->mFreeList == NULL)
+				break;
+			page* next = p->next();
+			if (p->empty()) {
+				p->unlink();
+				system_free(align_down((char*)p, PAGE_SIZE));
+				mPageCount--;
+			}
+			p = next;
+		}
+	}
+
+	size_t page_count() const {return mPageCount;}
+};
+
+}
+
+#endif
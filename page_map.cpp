@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <sys/mman.h>
+#include "heap_alloc.h"
+#include "page_map.h"
+using namespace shark;
+
+namespace
+{
+const unsigned ADDRESS_BITS = 48;
+const unsigned LEAF_BITS = 15;
+const unsigned ROOT_BITS = ADDRESS_BITS - VIRTUAL_PAGE_SIZE_LOG2 - LEAF_BITS;
+const size_t LEAF_SIZE = sizeof(void*) << LEAF_BITS;
+
+void** sRoot[(size_t)1 << ROOT_BITS];
+
+void** leaf_of(size_t page, bool create) {
+	void*** slot = &sRoot[page >> LEAF_BITS];
+	void** leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (leaf || !create)
+		return leaf;
+	void* mem = mmap(NULL, LEAF_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	// another thread may have published a leaf meanwhile
+	if (!__atomic_compare_exchange_n(slot, &leaf, (void**)mem, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		munmap(mem, LEAF_SIZE);
+		return leaf;
+	}
+	return (void**)mem;
+}
+}
+
+void shark::page_map_set(void* addr, size_t size, void* owner) {
+	assert(((size_t)addr & (VIRTUAL_PAGE_SIZE - 1)) == 0 && (size & (VIRTUAL_PAGE_SIZE - 1)) == 0);
+	size_t first = (size_t)addr >> VIRTUAL_PAGE_SIZE_LOG2;
+	size_t end = first + (size >> VIRTUAL_PAGE_SIZE_LOG2);
+	if (((size_t)addr >> ADDRESS_BITS) != 0)
+		return;
+	for (size_t page = first; page < end; page++) {
+		void** leaf = leaf_of(page, owner != NULL);
+		if (leaf)
+			__atomic_store_n(&leaf[page & (((size_t)1 << LEAF_BITS) - 1)], owner, __ATOMIC_RELEASE);
+	}
+}
+
+void* shark::page_map_get(const void* addr) {
+	if (((size_t)addr >> ADDRESS_BITS) != 0)
+		return NULL;
+	size_t page = (size_t)addr >> VIRTUAL_PAGE_SIZE_LOG2;
+	void** leaf = leaf_of(page, false);
+	return leaf ? __atomic_load_n(&leaf[page & (((size_t)1 << LEAF_BITS) - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef SHARK_PAGE_MAP_H
+#define SHARK_PAGE_MAP_H
+#include <stddef.h>
+
+namespace shark
+{
+
+/*
+ * Process wide map from VIRTUAL_PAGE_SIZE pages to the heap which took them
+ * from the system, a two level radix table over the 48 bit user address
+ * space. Lookups are two loads without a lock, so a NumaHeap finds the owner
+ * of any pointer in constant time. Leaves are mmapped on first use and never
+ * released. Only heaps bound to a node (set_node) register their memory.
+ */
+// records owner for [addr, addr+size), NULL clears; both must be VIRTUAL_PAGE_SIZE aligned
+void page_map_set(void* addr, size_t size, void* owner);
+// owner of the page holding addr, NULL when it was never registered
+void* page_map_get(const void* addr);
+
+}
+
+#endif
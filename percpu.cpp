@@ -0,0 +1,12 @@
+#include <unistd.h>
+#include "percpu.h"
+using namespace shark;
+
+int shark::cpu_count() {
+	static int count = 0;
+	if (count == 0) {
+		long n = sysconf(_SC_NPROCESSORS_CONF);
+		count = n > 0 ? (int)n : 1;
+	}
+	return count;
+}
@@ -0,0 +1,45 @@
+#ifndef SHARK_PERCPU_H
+#define SHARK_PERCPU_H
+#include <stddef.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define SHARK_HAS_RSEQ
+#endif
+#endif
+
+namespace shark
+{
+
+/*
+ * cpu number of the calling thread read from the restartable sequence area
+ * glibc registers for every thread, which costs a single load instead of a
+ * getcpu system call. Returns -1 when rseq is not registered (old kernel or
+ * glibc, or disabled through glibc.pthread.rseq=0), callers then have to
+ * take their locked path.
+ */
+inline int rseq_current_cpu() {
+	#ifdef SHARK_HAS_RSEQ
+	if (__rseq_size == 0)
+		return -1;
+	const struct rseq* rs = (const struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	return (int)(*(volatile const unsigned*)&rs->cpu_id);
+	#else
+	return -1;
+	#endif
+}
+
+inline bool rseq_available() {
+	#ifdef SHARK_HAS_RSEQ
+	return __rseq_size != 0;
+	#else
+	return false;
+	#endif
+}
+
+// number of configured cpus, cpu numbers returned by rseq_current_cpu are below it
+int cpu_count();
+
+}
+
+#endif
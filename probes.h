@@ -0,0 +1,40 @@
+#ifndef SHARK_PROBES_H
+#define SHARK_PROBES_H
+
+/*
+ * USDT static tracepoints of the allocator slow paths, provider "shark".
+ * With systemtap's sys/sdt.h every probe is a single nop plus an ELF note,
+ * perf and bpftrace attach to them at runtime, e.g.
+ *	bpftrace -e 'usdt:./app:shark:tree_grow { @[arg1] = count(); }'
+ * Without the header (or with SHARK_NO_PROBES) the probes compile to nothing
+ * and their arguments are not evaluated.
+ *
+ *	bucket_grow(elem_size, page)		a bucket took a fresh page
+ *	bucket_page_free(page)			a bucket page went back to the system
+ *	tree_grow(request, segment_size, segment)	the tree took a new segment
+ *	tree_extract_miss(size, alignment)	no free block fits, the tree has to grow
+ *	coalesce(block, size)			a freed block merged with its neighbours
+ *	quick_flush(count)			deferred frees merged into the tree in one batch
+ *	tree_purge_block(segment, size)		a free segment went back to the system
+ *	lock_wait(lock), lock_acquired(lock)	an AdaptiveLock acquisition had to spin or sleep
+ *	rt_breach(kind, level)			a real-time reserve (0 pages, 1 segments) fell below its low watermark
+ *	rt_miss(kind)				a real-time reserve had nothing fitting, the grow went to the system
+ */
+#if !defined(SHARK_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SHARK_HAS_PROBES
+#endif
+#endif
+
+#ifdef SHARK_HAS_PROBES
+#define SHARK_PROBE1(name, a)		DTRACE_PROBE1(shark, name, a)
+#define SHARK_PROBE2(name, a, b)	DTRACE_PROBE2(shark, name, a, b)
+#define SHARK_PROBE3(name, a, b, c)	DTRACE_PROBE3(shark, name, a, b, c)
+#else
+#define SHARK_PROBE1(name, a)		((void)sizeof(a))
+#define SHARK_PROBE2(name, a, b)	((void)sizeof(a), (void)sizeof(b))
+#define SHARK_PROBE3(name, a, b, c)	((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
+#endif
@@ -20,12 +20,12 @@ void intrusive_multi_rbtree_base::insert_fixup(node_base* node) {
 		} else {
 			if (cur == p->child(o)) {
 				cur = p;
-				cur->rotate(s);
+				rotate(cur, s);
 				p = cur->parent();
 			}
 			p->make_black();
 			pp->make_red();
-			pp->rotate(o);
+			rotate(pp, o);
 		} 
 	}
 	mHead.child(LEFT)->make_black();
@@ -44,7 +44,7 @@ void intrusive_multi_rbtree_base::erase_fixup(node_base* node) {
 			w->make_black();
 			p->make_red();
 			w = w->child(s);
-			p->rotate(s);
+			rotate(p, s);
 		}
 		assert(w != &mHead);
 		if (w->child(LEFT)->black() && w->child(RIGHT)->black()) { 
@@ -55,7 +55,7 @@ void intrusive_multi_rbtree_base::erase_fixup(node_base* node) {
 				w->child(s)->make_black();
 				w->make_red();
 				node_base* c = w->child(s);
-				w->rotate(o);
+				rotate(w, o);
 				w = c;
 				assert(w != &mHead);
 			}
@@ -63,13 +63,27 @@ void intrusive_multi_rbtree_base::erase_fixup(node_base* node) {
 			w->make_red_black(p->red_black());
 			p->make_black();
 			w->child(o)->make_black();
-			p->rotate(s);
+			rotate(p, s);
 			cur = mHead.child(LEFT);
 		}
 	}
 	cur->make_black();
 }
 
+void intrusive_multi_rbtree_base::rotate(node_base* node, side s) {
+	node->rotate(s);
+	// node went down, its old child took its place above it
+	if (mAugment) {
+		mAugment(node);
+		mAugment(node->parent());
+	}
+}
+
+void intrusive_multi_rbtree_base::augment_path(node_base* node) {
+	for (; node != &mHead; node = node->parent())
+		mAugment(node);
+}
+
 #ifdef DEBUG_MULTI_RBTREE
 unsigned intrusive_multi_rbtree_base::check_height(node_base* node) const {
 	if (node == &mHead)
@@ -19,11 +19,15 @@ public:
 		ptr_bits<node_base,NUM_BITS> mParent;
 	public:
 		node_base() {
+			reset();
+		}
+		void reset() {
 			mChildren[LEFT] = this;
 			mChildren[RIGHT] = this;
 			mNeighbours[LEFT] = this;
 			mNeighbours[RIGHT] = this;
 			mParent = this;
+			mParent.clear_bits();
 		}
 		node_base* parent() const {return mParent;}
 		node_base* child(side s) const {return mChildren[s];}
@@ -152,17 +156,32 @@ public:
 		}
 	};
 
-	intrusive_multi_rbtree_base() {}
-	intrusive_multi_rbtree_base(const intrusive_multi_rbtree_base&) {}
+	/*
+	 * Optional subtree augmentation: the callback recomputes a node's summary
+	 * from its own value and its children's summaries (children may be nil).
+	 * The tree calls it bottom up on every path it changes, so a search can
+	 * skip whole subtrees in O(log n). Only the first node of a run of equal
+	 * keys is part of the tree, augmented trees should order strictly.
+	 */
+	typedef void (*augment_fn)(node_base* node);
+	explicit intrusive_multi_rbtree_base(augment_fn augment = NULL) : mAugment(augment) {}
+	intrusive_multi_rbtree_base(const intrusive_multi_rbtree_base& rhs) : mAugment(rhs.mAugment) {}
 	bool empty() const {return mHead.child(LEFT) == &mHead;}
+	// forget all nodes at once without erasing them one by one, 
+	// only valid when the memory of the nodes is released as a whole.
+	void reset() {mHead.reset();}
 	#ifdef DEBUG_MULTI_RBTREE
 	void check() const;
 	#endif
 
 protected:
 	node_base mHead;
+	augment_fn mAugment;
 	void insert_fixup(node_base* node);
 	void erase_fixup(node_base* node);
+	void rotate(node_base* node, side s);
+	// refresh the summaries from node up to the root
+	void augment_path(node_base* node);
 private:
 	#ifdef DEBUG_MULTI_RBTREE
 	unsigned check_height(node_base* node) const;
@@ -269,7 +288,7 @@ public:
 	const_iterator maximum() const {return const_iterator(root_multi_rbnode()->maximum());}
 	iterator maximum() {return iterator(root_multi_rbnode()->maximum());}
 
-	intrusive_multi_rbtree() : intrusive_multi_rbtree_base() {}
+	explicit intrusive_multi_rbtree(augment_fn augment = NULL) : intrusive_multi_rbtree_base(augment) {}
 	~intrusive_multi_rbtree() {clear();}
 	iterator insert(T* node) {
 		this->do_insert(node);
@@ -336,6 +355,8 @@ protected:
 			curNode = curNode->child(s);
 		}
 		node->attach_to(lastNode, s);
+		if (mAugment)
+			augment_path(node);
 		insert_fixup(node);
 		#ifdef DEBUG_MULTI_RBTREE
 		check();
@@ -356,6 +377,8 @@ protected:
 			assert(repl->child(RIGHT) == NULL);
 			repl->switch_with(node);
 			node->unlink();
+			if (mAugment)
+				augment_path(repl);
 			return;
 		}
 		T* endNode = nil_multi_rbnode();
@@ -372,9 +395,13 @@ protected:
 		assert(repl->child((side)(1-s)) == endNode);
 		bool red = repl->red();
 		T* replChild = repl->child(s);
+		// lowest node whose subtree changed
+		node_base* changed = repl == node ? node->parent() : repl->parent() == node ? repl : repl->parent();
 		repl->substitute_with(replChild);
 		if (repl != node)
 			repl->switch_with(node);
+		if (mAugment)
+			augment_path(changed);
 		if (!red) 
 			erase_fixup(replChild);
 		#ifdef DEBUG_MULTI_RBTREE
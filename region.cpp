@@ -0,0 +1,83 @@
+#include "region.h"
+using namespace shark;
+
+Region::Region() : mChunk(NULL), mSpare(NULL), mCursor(NULL), mReserved(0)
+{
+}
+
+Region::~Region()
+{
+	release();
+}
+
+void Region::push_chunk(size_t size) {
+	assert(size / VIRTUAL_PAGE_SIZE * VIRTUAL_PAGE_SIZE == size);
+	chunk* c = NULL;
+	if (size == CHUNK_SIZE && mSpare) {
+		c = mSpare;
+		mSpare = NULL;
+	} else {
+		c = (chunk*)system_alloc(size);
+		if (!c)
+			return;
+		mReserved += size;
+	}
+	c->mPrev = mChunk;
+	c->mSize = size;
+	mChunk = c;
+	mCursor = c->begin();
+}
+
+void Region::pop_chunk() {
+	chunk* c = mChunk;
+	assert(c);
+	mChunk = c->mPrev;
+	mCursor = mChunk ? mChunk->end() : NULL;
+	if (c->mSize == CHUNK_SIZE && !mSpare) {
+		mSpare = c;
+		return;
+	}
+	mReserved -= c->mSize;
+	system_free(c);
+}
+
+void* Region::alloc_slow(size_t size, size_t alignment) {
+	// the tail of the current chunk is abandoned, requests that don't fit 
+	// a standard chunk get a dedicated one
+	size_t need = sizeof(chunk) + size + alignment;
+	if (need < size)
+		return NULL;
+	chunk* old = mChunk;
+	push_chunk(need <= CHUNK_SIZE ? CHUNK_SIZE : round_up(need, VIRTUAL_PAGE_SIZE));
+	if (mChunk == old)
+		return NULL;
+	char* p = align_up(mCursor, alignment);
+	assert(p + size <= mChunk->end());
+	mCursor = p + size;
+	return p;
+}
+
+Region::mark Region::get_mark() const {
+	mark m;
+	m.mChunk = mChunk;
+	m.mCursor = mCursor;
+	return m;
+}
+
+void Region::rewind(const mark& m) {
+	while (mChunk != m.mChunk)
+		pop_chunk();
+	mCursor = m.mCursor;
+}
+
+void Region::release() {
+	while (mChunk)
+		pop_chunk();
+	mCursor = NULL;
+	if (mSpare) {
+		mReserved -= mSpare->mSize;
+		system_free(mSpare);
+		mSpare = NULL;
+	}
+	assert(mReserved == 0);
+}
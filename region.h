@@ -0,0 +1,118 @@
+#ifndef SHARK_REGION_H
+#define SHARK_REGION_H
+#include <assert.h>
+#include <stddef.h>
+#include "heap_alloc.h"
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SHARK_HAS_PMR
+#endif
+#endif
+
+namespace shark
+{
+
+/*
+ * Monotonic region (arena) allocator.
+ * Memory is bump allocated out of VIRTUAL_PAGE_SIZE chunks taken from the
+ * same system layer as the bucket pages, there is no per-object free:
+ * everything allocated after a mark is dropped by rewind(), and release()
+ * gives all chunks back at once. A region is not thread safe, it is meant
+ * to be owned by a single request.
+ */
+class Region {
+	Region(const Region&);
+	Region& operator=(const Region&);
+
+	// header at the start of every chunk, chunks are stacked newest first
+	struct chunk {
+		chunk* mPrev;
+		size_t mSize;
+		char* begin() {return (char*)this + sizeof(chunk);}
+		char* end() {return (char*)this + mSize;}
+	};
+	chunk* mChunk;
+	chunk* mSpare;		// one standard chunk kept back so rewind/alloc cycles don't hit the system
+	char* mCursor;
+	size_t mReserved;
+
+	void* alloc_slow(size_t size, size_t alignment);
+	void push_chunk(size_t size);
+	void pop_chunk();
+public:
+	static const size_t CHUNK_SIZE = VIRTUAL_PAGE_SIZE;
+
+	// position in the region, rewinding to it frees everything allocated afterwards
+	class mark {
+		friend class Region;
+		chunk* mChunk;
+		char* mCursor;
+	public:
+		mark() : mChunk(NULL), mCursor(NULL) {}
+	};
+
+	Region();
+	~Region();
+
+	void* alloc(size_t size, size_t alignment = DEFAULT_ALIGNMENT) {
+		assert((alignment & (alignment-1)) == 0);
+		if (mChunk) {
+			char* p = align_up(mCursor, alignment);
+			if (p + size <= mChunk->end() && p + size >= p) {
+				mCursor = p + size;
+				return p;
+			}
+		}
+		return alloc_slow(size, alignment);
+	}
+	// NULL when count * sizeof(T) overflows
+	template<class T> T* alloc_array(size_t count) {
+		if (count > (size_t)-1 / sizeof(T))
+			return NULL;
+		return (T*)alloc(count * sizeof(T), __alignof__(T) > (size_t)DEFAULT_ALIGNMENT ? (size_t)__alignof__(T) : (size_t)DEFAULT_ALIGNMENT);
+	}
+
+	mark get_mark() const;
+	void rewind(const mark& m);
+	void release();
+
+	// bytes obtained from the system, spare chunk included
+	size_t reserved() const {return mReserved;}
+};
+
+// rewinds the region to where it was when the scope was entered
+class RegionScope {
+	RegionScope(const RegionScope&);
+	RegionScope& operator=(const RegionScope&);
+	Region& mRegion;
+	Region::mark mMark;
+public:
+	explicit RegionScope(Region& region) : mRegion(region), mMark(region.get_mark()) {}
+	~RegionScope() {mRegion.rewind(mMark);}
+};
+
+#ifdef SHARK_HAS_PMR
+// std::pmr adapter, deallocate is a no-op and memory goes away with the region
+class RegionResource : public std::pmr::memory_resource {
+	Region& mRegion;
+public:
+	explicit RegionResource(Region& region) : mRegion(region) {}
+	Region& region() const {return mRegion;}
+protected:
+	virtual void* do_allocate(size_t bytes, size_t alignment) {
+		void* p = mRegion.alloc(bytes, alignment < DEFAULT_ALIGNMENT ? (size_t)DEFAULT_ALIGNMENT : alignment);
+		if (!p)
+			throw std::bad_alloc();
+		return p;
+	}
+	virtual void do_deallocate(void*, size_t, size_t) {}
+	virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+		return this == &other;
+	}
+};
+#endif
+
+}
+
+#endif
@@ -0,0 +1,420 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared_heap.h"
+using namespace shark;
+
+/*
+ * Mapping layout: header, then blocks up to an end tag. Every block starts
+ * with its tag; free blocks continue with the offsets of their list neighbours.
+ */
+struct SharedHeap::block {
+	enum {USED = 1};
+	uint64 mPrevSize;	// size of the block in front, 0 for the first one
+	uint64 mSizeAndFlags;	// whole block including this tag, 0 for the end tag
+	uint64 mNextFree;	// free blocks only, offsets from the mapping start
+	uint64 mPrevFree;
+	uint64 size() const {return mSizeAndFlags & ~(uint64)(ALIGNMENT - 1);}
+	bool used() const {return (mSizeAndFlags & USED) != 0;}
+	void set(uint64 size, bool used) {mSizeAndFlags = size | (used ? USED : 0);}
+	void* mem() {return (char*)this + TAG_SIZE;}
+	block* next() {return (block*)((char*)this + size());}
+	block* prev() {return (block*)((char*)this - mPrevSize);}
+	static const uint64 TAG_SIZE = 16;
+	static const uint64 MIN_SIZE = 32;
+};
+
+struct SharedHeap::header {
+	uint64 mMagic;	// written last, once the heap is usable
+	uint32 mVersion;
+	uint32 mPoisoned;	// see rebuild_lists
+	uint64 mSize;
+	uint64 mRoot;
+	uint64 mFreeBytes;
+	uint64 mListMask[(NUM_LISTS + 63) / 64];
+	uint64 mLists[NUM_LISTS];
+	uint64 mLockBoot;	// boot_id() of the boot the lock was initialised in, see open_fd
+	ProcessSharedLock mLock;
+};
+
+namespace
+{
+const uint64 SHARED_HEAP_MAGIC = 0x7061656864726873ULL;	// "shrdheap"
+const uint32 SHARED_HEAP_VERSION = 3;
+const uint64 LOCK_BOOT_REINIT = 1;	// mLockBoot while one process reinitialises the lock
+
+inline uint64 round_up16(uint64 x) {return (x + 15) & ~(uint64)15;}
+
+// hash of the kernel's boot id, never 0 or LOCK_BOOT_REINIT; 0 when it can't be read
+uint64 boot_id()
+{
+	char id[64];
+	int fd = ::open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ssize_t n = read(fd, id, sizeof(id));
+	::close(fd);
+	if (n <= 0)
+		return 0;
+	uint64 hash = 14695981039346656037ULL;	// FNV-1a
+	for (ssize_t i = 0; i < n; i++)
+		hash = (hash ^ (unsigned char)id[i]) * 1099511628211ULL;
+	return hash > LOCK_BOOT_REINIT ? hash : hash + 2;
+}
+}
+
+// takes the heap lock, repairs the heap or poisons it when the last holder died with the lock
+class SharedHeap::heap_lock {
+	heap_lock(const heap_lock&);
+	heap_lock& operator=(const heap_lock&);
+	header* mHead;
+public:
+	explicit heap_lock(const SharedHeap* heap) : mHead(heap->head()) {
+		if (mHead->mLock.lock() && !mHead->mPoisoned && !const_cast<SharedHeap*>(heap)->rebuild_lists())
+			mHead->mPoisoned = 1;
+	}
+	~heap_lock() {mHead->mLock.unlock();}
+	bool poisoned() const {return mHead->mPoisoned != 0;}
+};
+
+SharedHeap::SharedHeap() : mBase(NULL), mSize(0)
+{
+}
+
+int SharedHeap::open_shm(const char* name, size_t size)
+{
+	if (mBase)
+		return EBUSY;
+	bool created = false;
+	int fd = -1;
+	if (size) {
+		fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+		created = fd >= 0;
+	}
+	if (fd < 0)
+		fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return errno;
+	return open_fd(fd, created, size);
+}
+
+int SharedHeap::open_file(const char* path, size_t size)
+{
+	if (mBase)
+		return EBUSY;
+	bool created = false;
+	int fd = -1;
+	if (size) {
+		fd = ::open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+		created = fd >= 0;
+	}
+	if (fd < 0)
+		fd = ::open(path, O_RDWR);
+	if (fd < 0)
+		return errno;
+	return open_fd(fd, created, size);
+}
+
+int SharedHeap::open_fd(int fd, bool created, size_t size)
+{
+	uint64 headerSize = round_up16(sizeof(header));
+	if (created) {
+		size &= ~(size_t)(ALIGNMENT - 1);
+		if (size < headerSize + 2 * block::MIN_SIZE || ftruncate(fd, size) != 0) {
+			int err = size < headerSize + 2 * block::MIN_SIZE ? EINVAL : errno;
+			::close(fd);
+			return err;
+		}
+	} else {
+		// the creator may still be sizing the object
+		struct stat st;
+		for (int tries = 0; ; tries++) {
+			if (fstat(fd, &st) != 0) {
+				int err = errno;
+				::close(fd);
+				return err;
+			}
+			if ((uint64)st.st_size >= headerSize || tries == 100)
+				break;
+			usleep(10000);
+		}
+		size = st.st_size;
+		if (size < headerSize) {
+			::close(fd);
+			return EINVAL;
+		}
+	}
+	void* mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mem == MAP_FAILED)
+		return errno;
+	mBase = (char*)mem;
+	mSize = size;
+
+	header* h = head();
+	if (created) {
+		memset((void*)h, 0, headerSize);
+		h->mVersion = SHARED_HEAP_VERSION;
+		h->mSize = size;
+		if (int err = h->mLock.init()) {
+			// without the magic other openers give up with EINVAL
+			close();
+			return err;
+		}
+		h->mLockBoot = boot_id();
+		// one free block over everything between the header and the end tag
+		block* first = block_at(headerSize);
+		first->mPrevSize = 0;
+		first->set(size - headerSize - block::TAG_SIZE, false);
+		block* end = first->next();
+		end->mPrevSize = first->size();
+		end->set(0, true);
+		list_insert(first);
+		__atomic_store_n(&h->mMagic, SHARED_HEAP_MAGIC, __ATOMIC_RELEASE);
+		return 0;
+	}
+	for (int tries = 0; __atomic_load_n(&h->mMagic, __ATOMIC_ACQUIRE) != SHARED_HEAP_MAGIC && tries < 100; tries++)
+		usleep(10000);
+	if (h->mMagic != SHARED_HEAP_MAGIC || h->mVersion != SHARED_HEAP_VERSION || h->mSize != size) {
+		close();
+		return EINVAL;
+	}
+	return check_lock_boot();
+}
+
+/*
+ * A file backed heap outlives the machine, and a crash may leave its lock
+ * held by a thread of an earlier boot which no robust list will ever release.
+ * The first process to open the heap in a new boot initialises the lock again
+ * and repairs the lists as after a dead holder; nobody in this boot can hold
+ * the lock yet, they all come through here first. The others wait for it.
+ */
+int SharedHeap::check_lock_boot()
+{
+	header* h = head();
+	uint64 boot = boot_id();
+	if (boot == 0)
+		return 0;
+	uint64 seen = __atomic_load_n(&h->mLockBoot, __ATOMIC_ACQUIRE);
+	if (seen == boot)
+		return 0;
+	if (seen != LOCK_BOOT_REINIT &&
+		__atomic_compare_exchange_n(&h->mLockBoot, &seen, LOCK_BOOT_REINIT, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		if (int err = h->mLock.init()) {
+			__atomic_store_n(&h->mLockBoot, seen, __ATOMIC_RELEASE);
+			close();
+			return err;
+		}
+		if (!h->mPoisoned && !rebuild_lists())
+			h->mPoisoned = 1;
+		__atomic_store_n(&h->mLockBoot, boot, __ATOMIC_RELEASE);
+		return 0;
+	}
+	for (int tries = 0; __atomic_load_n(&h->mLockBoot, __ATOMIC_ACQUIRE) != boot && tries < 100; tries++)
+		usleep(10000);
+	if (__atomic_load_n(&h->mLockBoot, __ATOMIC_ACQUIRE) != boot) {
+		close();
+		return EAGAIN;
+	}
+	return 0;
+}
+
+void SharedHeap::close()
+{
+	if (mBase) {
+		munmap(mBase, mSize);
+		mBase = NULL;
+		mSize = 0;
+	}
+}
+
+unsigned SharedHeap::list_index(uint64 size)
+{
+	assert(size >= block::MIN_SIZE);
+	if (size < block::MIN_SIZE + NUM_SMALL_LISTS * ALIGNMENT)
+		return (unsigned)((size - block::MIN_SIZE) / ALIGNMENT);
+	unsigned log2 = 63 - __builtin_clzll(size);
+	unsigned index = NUM_SMALL_LISTS + log2 - 10;	// 1056 bytes is in the 2^10 list
+	return index < NUM_LISTS ? index : NUM_LISTS - 1;
+}
+
+void SharedHeap::list_insert(block* b)
+{
+	header* h = head();
+	unsigned i = list_index(b->size());
+	uint64 offset = offset_of_block(b);
+	b->mPrevFree = 0;
+	b->mNextFree = h->mLists[i];
+	if (h->mLists[i])
+		block_at(h->mLists[i])->mPrevFree = offset;
+	h->mLists[i] = offset;
+	h->mListMask[i / 64] |= (uint64)1 << (i % 64);
+	h->mFreeBytes += b->size();
+}
+
+void SharedHeap::list_remove(block* b)
+{
+	header* h = head();
+	unsigned i = list_index(b->size());
+	if (b->mPrevFree)
+		block_at(b->mPrevFree)->mNextFree = b->mNextFree;
+	else
+		h->mLists[i] = b->mNextFree;
+	if (b->mNextFree)
+		block_at(b->mNextFree)->mPrevFree = b->mPrevFree;
+	if (!h->mLists[i])
+		h->mListMask[i / 64] &= ~((uint64)1 << (i % 64));
+	h->mFreeBytes -= b->size();
+}
+
+/*
+ * Walks the block tags from the header to the end tag and rebuilds the free
+ * lists from the free blocks found, the lists may have been left half spliced.
+ * Returns false when the tags themselves are inconsistent.
+ */
+bool SharedHeap::rebuild_lists()
+{
+	header* h = head();
+	memset(h->mListMask, 0, sizeof(h->mListMask));
+	memset(h->mLists, 0, sizeof(h->mLists));
+	h->mFreeBytes = 0;
+	uint64 offset = round_up16(sizeof(header));
+	uint64 prevSize = 0;
+	bool prevFree = false;
+	for (;;) {
+		if (offset + block::TAG_SIZE > mSize)
+			return false;
+		block* b = block_at(offset);
+		if (b->mPrevSize != prevSize)
+			return false;
+		uint64 size = b->size();
+		if (size == 0)
+			return b->used() && offset + block::TAG_SIZE == mSize;
+		if (size < block::MIN_SIZE || size > mSize - block::TAG_SIZE - offset)
+			return false;
+		// free neighbours are always merged
+		if (!b->used()) {
+			if (prevFree)
+				return false;
+			list_insert(b);
+		}
+		prevFree = !b->used();
+		prevSize = size;
+		offset += size;
+	}
+}
+
+// removes and returns a free block of at least size bytes, NULL if there is none
+SharedHeap::block* SharedHeap::list_take(uint64 size)
+{
+	header* h = head();
+	unsigned i = list_index(size);
+	// the first list may hold smaller blocks, later lists only larger ones
+	if (i >= NUM_SMALL_LISTS) {
+		for (uint64 o = h->mLists[i]; o; o = block_at(o)->mNextFree) {
+			if (block_at(o)->size() >= size) {
+				block* b = block_at(o);
+				list_remove(b);
+				return b;
+			}
+		}
+		i++;
+	}
+	for (unsigned w = i / 64; w < (NUM_LISTS + 63) / 64; w++) {
+		uint64 mask = h->mListMask[w];
+		if (w == i / 64)
+			mask &= ~(uint64)0 << (i % 64);
+		if (mask) {
+			block* b = block_at(h->mLists[w * 64 + __builtin_ctzll(mask)]);
+			list_remove(b);
+			return b;
+		}
+	}
+	return NULL;
+}
+
+void* SharedHeap::alloc(size_t size)
+{
+	assert(mBase);
+	uint64 need = round_up16(size + block::TAG_SIZE);
+	if (need < block::MIN_SIZE)
+		need = block::MIN_SIZE;
+	if (need < size)
+		return NULL;
+	heap_lock lock(this);
+	if (lock.poisoned())
+		return NULL;
+	block* b = list_take(need);
+	if (!b)
+		return NULL;
+	uint64 rest = b->size() - need;
+	if (rest >= block::MIN_SIZE) {
+		b->set(need, true);
+		block* r = b->next();
+		r->mPrevSize = need;
+		r->set(rest, false);
+		r->next()->mPrevSize = rest;
+		list_insert(r);
+	} else {
+		b->set(b->size(), true);
+	}
+	return b->mem();
+}
+
+void SharedHeap::free(void* ptr)
+{
+	if (!ptr)
+		return;
+	assert(owns(ptr));
+	heap_lock lock(this);
+	if (lock.poisoned())
+		return;
+	block* b = (block*)((char*)ptr - block::TAG_SIZE);
+	assert(b->used());
+	uint64 size = b->size();
+	block* next = b->next();
+	if (!next->used()) {
+		list_remove(next);
+		size += next->size();
+	}
+	if (b->mPrevSize && !b->prev()->used()) {
+		b = b->prev();
+		list_remove(b);
+		size += b->size();
+	}
+	b->set(size, false);
+	b->next()->mPrevSize = size;
+	list_insert(b);
+}
+
+size_t SharedHeap::usable_size(void* ptr) const
+{
+	block* b = (block*)((char*)ptr - block::TAG_SIZE);
+	return b->size() - block::TAG_SIZE;
+}
+
+void* SharedHeap::root() const
+{
+	return ptr_at(__atomic_load_n(&head()->mRoot, __ATOMIC_ACQUIRE));
+}
+
+void SharedHeap::set_root(void* ptr)
+{
+	__atomic_store_n(&head()->mRoot, (uint64)offset_of(ptr), __ATOMIC_RELEASE);
+}
+
+size_t SharedHeap::free_bytes() const
+{
+	heap_lock lock(this);
+	return lock.poisoned() ? 0 : head()->mFreeBytes;
+}
+
+bool SharedHeap::poisoned() const
+{
+	heap_lock lock(this);
+	return lock.poisoned();
+}
@@ -0,0 +1,112 @@
+#ifndef SHARK_SHARED_HEAP_H
+#define SHARK_SHARED_HEAP_H
+#include <stddef.h>
+#include "data_types.h"
+#include "mutex.h"
+
+namespace shark
+{
+
+/*
+ * Pointer stored as the distance from itself to its target, so it stays valid
+ * when the memory holding both is mapped at another address. Use it for the
+ * links of data structures built in a SharedHeap. An offset_ptr can't point
+ * at itself, that offset means NULL.
+ */
+template<class T>
+class offset_ptr {
+	ptrdiff_t mOffset;
+	void set(const T* p) {mOffset = p ? (const char*)p - (const char*)this : 0;}
+public:
+	offset_ptr() : mOffset(0) {}
+	offset_ptr(T* p) {set(p);}
+	offset_ptr(const offset_ptr& rhs) {set(rhs.get());}
+	offset_ptr& operator=(const offset_ptr& rhs) {set(rhs.get()); return *this;}
+	offset_ptr& operator=(T* p) {set(p); return *this;}
+	T* get() const {return mOffset ? (T*)((char*)this + mOffset) : NULL;}
+	T* operator->() const {return get();}
+	T& operator*() const {return *get();}
+	operator T*() const {return get();}
+};
+
+/*
+ * Heap inside a shared memory object (shm_open) or a file mapping, shared by
+ * all processes which open it. Nothing in the mapping holds an absolute
+ * address: blocks carry boundary tags with their own and their predecessor's
+ * size, free lists link by offsets from the mapping start, and the lock is a
+ * robust process-shared mutex. A file backed heap therefore comes back with
+ * its contents after a restart, its root object (set_root) is the entry
+ * point to whatever was built in it.
+ *
+ * Free blocks sit in segregated lists: exact 16 byte classes up to 1KB, then
+ * one list per power of two with first fit inside the list. Neighbouring free
+ * blocks coalesce at once. The mapping has a fixed size chosen at creation.
+ *
+ * When a process dies holding the heap lock, the next one to lock it walks
+ * the block tags and rebuilds the free lists from them. If the tags don't add
+ * up the dead process was in the middle of a split or merge, the heap is
+ * then poisoned for good: alloc returns NULL and free does nothing.
+ * A machine crash can't be seen that way, the lock of a file backed heap
+ * would stay held by a thread of the previous boot. The header records the
+ * boot the lock was initialised in, and the first open in a new boot
+ * initialises it again and repairs the lists the same way.
+ */
+class SharedHeap {
+	SharedHeap(const SharedHeap&);
+	SharedHeap& operator=(const SharedHeap&);
+public:
+	static const size_t ALIGNMENT = 16;
+
+	SharedHeap();
+	~SharedHeap() {close();}
+
+	// Open the shared memory object name ("/name") or the file path, creating it
+	// with size bytes when it doesn't exist and size > 0. Returns 0 or an errno value,
+	// EINVAL when an existing mapping isn't a SharedHeap of this version.
+	int open_shm(const char* name, size_t size);
+	int open_file(const char* path, size_t size);
+	// unmaps the heap, the contents stay in the shared memory object or file
+	void close();
+	bool is_open() const {return mBase != NULL;}
+
+	void* alloc(size_t size);
+	void free(void* ptr);
+	size_t usable_size(void* ptr) const;
+
+	// the object other processes and later runs start from, NULL until set
+	void* root() const;
+	void set_root(void* ptr);
+
+	// process independent handles: offsets from the mapping start, 0 for NULL
+	size_t offset_of(const void* ptr) const {return ptr ? (const char*)ptr - mBase : 0;}
+	void* ptr_at(size_t offset) const {return offset ? mBase + offset : NULL;}
+	bool owns(const void* ptr) const {return (const char*)ptr >= mBase && (const char*)ptr < mBase + mSize;}
+
+	size_t size() const {return mSize;}
+	size_t free_bytes() const;
+	// true once a process died in the middle of changing the block tags
+	bool poisoned() const;
+private:
+	struct header;
+	struct block;
+	class heap_lock;
+	static const unsigned NUM_SMALL_LISTS = 64;	// 32 .. 1024+16 bytes in 16 byte steps
+	static const unsigned NUM_LISTS = NUM_SMALL_LISTS + 48;
+	char* mBase;
+	size_t mSize;
+
+	int open_fd(int fd, bool created, size_t size);
+	int check_lock_boot();
+	header* head() const {return (header*)mBase;}
+	block* block_at(uint64 offset) const {return (block*)(mBase + offset);}
+	uint64 offset_of_block(const block* b) const {return (const char*)b - mBase;}
+	static unsigned list_index(uint64 size);
+	void list_insert(block* b);
+	void list_remove(block* b);
+	block* list_take(uint64 size);
+	bool rebuild_lists();
+};
+
+}
+
+#endif
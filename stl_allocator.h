@@ -0,0 +1,91 @@
+#ifndef SHARK_STL_ALLOCATOR_H
+#define SHARK_STL_ALLOCATOR_H
+#include <stddef.h>
+#include <new>
+#include "heap_alloc.h"
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SHARK_HAS_PMR
+#endif
+#endif
+
+namespace shark
+{
+
+/*
+ * Standard allocator routed through a HeapAllocator (the global one by default).
+ * Containers always give back the size they asked for, so deallocate uses the
+ * sized free and small nodes go straight to their bucket.
+ */
+template<class T>
+class stl_allocator {
+	template<class U> friend class stl_allocator;
+	HeapAllocator* mHeap;
+
+	static size_t alignment() {return __alignof__(T) > (size_t)DEFAULT_ALIGNMENT ? (size_t)__alignof__(T) : (size_t)DEFAULT_ALIGNMENT;}
+	// zero sized requests still get a unique pointer
+	static size_t bytes(size_t n) {return n ? n * sizeof(T) : 1;}
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<class U> struct rebind {typedef stl_allocator<U> other;};
+
+	stl_allocator() : mHeap(g_allocator) {}
+	explicit stl_allocator(HeapAllocator* heap) : mHeap(heap) {}
+	template<class U> stl_allocator(const stl_allocator<U>& rhs) : mHeap(rhs.mHeap) {}
+
+	HeapAllocator* heap() const {return mHeap;}
+	size_t max_size() const {return (size_t)-1 / sizeof(T);}
+
+	T* allocate(size_t n, const void* = 0) {
+		if (n > max_size())
+			throw std::bad_alloc();
+		void* p = alignment() > DEFAULT_ALIGNMENT ? mHeap->alloc(bytes(n), alignment()) : mHeap->alloc(bytes(n));
+		if (!p)
+			throw std::bad_alloc();
+		return (T*)p;
+	}
+	void deallocate(T* p, size_t n) {
+		mHeap->free(p, bytes(n), alignment());
+	}
+
+	template<class U> bool operator==(const stl_allocator<U>& rhs) const {return mHeap == rhs.mHeap;}
+	template<class U> bool operator!=(const stl_allocator<U>& rhs) const {return mHeap != rhs.mHeap;}
+};
+
+#ifdef SHARK_HAS_PMR
+// std::pmr adapter for a HeapAllocator, with sized and aligned deallocation
+class HeapResource : public std::pmr::memory_resource {
+	HeapAllocator* mHeap;
+public:
+	HeapResource() : mHeap(g_allocator) {}
+	explicit HeapResource(HeapAllocator* heap) : mHeap(heap) {}
+	HeapAllocator* heap() const {return mHeap;}
+protected:
+	virtual void* do_allocate(size_t bytes, size_t alignment) {
+		if (bytes == 0)
+			bytes = 1;
+		void* p = alignment > DEFAULT_ALIGNMENT ? mHeap->alloc(bytes, alignment) : mHeap->alloc(bytes);
+		if (!p)
+			throw std::bad_alloc();
+		return p;
+	}
+	virtual void do_deallocate(void* p, size_t bytes, size_t alignment) {
+		mHeap->free(p, bytes ? bytes : 1, alignment);
+	}
+	virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+		const HeapResource* rhs = dynamic_cast<const HeapResource*>(&other);
+		return rhs && rhs->mHeap == mHeap;
+	}
+};
+#endif
+
+}
+
+#endif
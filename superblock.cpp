@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "numa.h"
+#include "superblock.h"
+using namespace shark;
+
+SuperblockArena::SuperblockArena(unsigned pageSizeLog2) : mTable(NULL), mCount(0), mCapacity(0),
+	mPageSizeLog2(pageSizeLog2), mUsedPages(0), mCommittedPages(0), mNode(-1)
+{
+}
+
+SuperblockArena::~SuperblockArena()
+{
+	for (size_t i = mCount; i-- > 0; ) {
+		if (mTable[i].mUsed == 0)
+			release(&mTable[i]);
+	}
+	if (mTable && mCount == 0) {
+		munmap(mTable, mCapacity * sizeof(superblock));
+		mTable = NULL;
+		mCapacity = 0;
+	}
+}
+
+SuperblockArena::superblock* SuperblockArena::find(const void* ptr) const {
+	size_t lo = 0, hi = mCount;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if ((const char*)ptr < mTable[mid].mBase)
+			hi = mid;
+		else if ((const char*)ptr >= mTable[mid].mBase + superblock_size())
+			lo = mid + 1;
+		else
+			return &mTable[mid];
+	}
+	return NULL;
+}
+
+// lowest page index starting count free pages, -1 if there is none
+int SuperblockArena::find_run(uint64 used, unsigned count) {
+	uint64 starts = ~used;
+	for (unsigned k = 1; k < count && starts; k++)
+		starts &= ~used >> k;
+	if (count > 1)
+		starts &= ~(uint64)0 >> (count - 1);	// runs must not wrap past the last page
+	return starts ? __builtin_ctzll(starts) : -1;
+}
+
+SuperblockArena::superblock* SuperblockArena::reserve() {
+	if (mCount == mCapacity) {
+		size_t bytes = mCapacity ? mCapacity * 2 * sizeof(superblock) : page_size();
+		void* table = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (table == MAP_FAILED)
+			return NULL;
+		if (mTable) {
+			memcpy(table, mTable, mCount * sizeof(superblock));
+			munmap(mTable, mCapacity * sizeof(superblock));
+		}
+		mTable = (superblock*)table;
+		mCapacity = bytes / sizeof(superblock);
+	}
+	// reserve twice the size and cut it down to an aligned superblock
+	size_t size = superblock_size();
+	char* mem = (char*)mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	char* base = (char*)(((size_t)mem + size - 1) & ~(size - 1));
+	if (base > mem)
+		munmap(mem, base - mem);
+	if (base + size < mem + 2 * size)
+		munmap(base + size, mem + 2 * size - (base + size));
+	// the policy sticks to the range through the later commits and decommits
+	if (mNode >= 0)
+		numa_bind(base, size, mNode);
+
+	size_t i = 0;
+	while (i < mCount && mTable[i].mBase < base)
+		i++;
+	memmove(&mTable[i+1], &mTable[i], (mCount - i) * sizeof(superblock));
+	mCount++;
+	superblock* sb = &mTable[i];
+	sb->mBase = base;
+	sb->mUsed = 0;
+	sb->mCommitted = 0;
+	return sb;
+}
+
+void SuperblockArena::release(superblock* sb) {
+	assert(sb->mUsed == 0);
+	munmap(sb->mBase, superblock_size());
+	mCommittedPages -= sb->mCommitted;
+	size_t i = sb - mTable;
+	memmove(&mTable[i], &mTable[i+1], (mCount - i - 1) * sizeof(superblock));
+	mCount--;
+}
+
+bool SuperblockArena::commit(superblock* sb, unsigned end) {
+	if (end <= sb->mCommitted)
+		return true;
+	end = (end + COMMIT_STEP - 1) / COMMIT_STEP * COMMIT_STEP;
+	if (end > PAGES_PER_SUPERBLOCK)
+		end = PAGES_PER_SUPERBLOCK;
+	char* from = sb->mBase + ((size_t)sb->mCommitted << mPageSizeLog2);
+	if (mprotect(from, (size_t)(end - sb->mCommitted) << mPageSizeLog2, PROT_READ|PROT_WRITE) != 0)
+		return false;
+	mCommittedPages += end - sb->mCommitted;
+	sb->mCommitted = end;
+	return true;
+}
+
+void* SuperblockArena::alloc(size_t count) {
+	if (count == 0 || count > PAGES_PER_SUPERBLOCK)
+		return NULL;
+	// lowest address first keeps the high superblocks free to be unmapped
+	superblock* sb = NULL;
+	int index = -1;
+	for (size_t i = 0; i < mCount && index < 0; i++) {
+		index = find_run(mTable[i].mUsed, (unsigned)count);
+		sb = &mTable[i];
+	}
+	if (index < 0) {
+		sb = reserve();
+		if (!sb)
+			return NULL;
+		index = 0;
+	}
+	if (!commit(sb, index + (unsigned)count)) {
+		if (sb->mUsed == 0)
+			release(sb);
+		return NULL;
+	}
+	uint64 bits = count == 64 ? ~(uint64)0 : (((uint64)1 << count) - 1);
+	sb->mUsed |= bits << index;
+	mUsedPages += count;
+	return sb->mBase + ((size_t)index << mPageSizeLog2);
+}
+
+void SuperblockArena::free(void* ptr, size_t count) {
+	superblock* sb = find(ptr);
+	assert(sb);
+	size_t offset = (char*)ptr - sb->mBase;
+	assert((offset & (page_size() - 1)) == 0);
+	unsigned index = (unsigned)(offset >> mPageSizeLog2);
+	assert(index + count <= PAGES_PER_SUPERBLOCK);
+	uint64 bits = (count == 64 ? ~(uint64)0 : (((uint64)1 << count) - 1)) << index;
+	assert((sb->mUsed & bits) == bits);
+	sb->mUsed &= ~bits;
+	mUsedPages -= count;
+	// locked pages refuse MADV_DONTNEED, unlock them so the run comes back zero
+	if (madvise(ptr, count << mPageSizeLog2, MADV_DONTNEED) != 0) {
+		munlock(ptr, count << mPageSizeLog2);
+		madvise(ptr, count << mPageSizeLog2, MADV_DONTNEED);
+	}
+	if (sb->mUsed != 0)
+		return;
+	// keep one empty superblock around so a grow/free cycle doesn't remap
+	for (size_t i = 0; i < mCount; i++) {
+		if (&mTable[i] != sb && mTable[i].mUsed == 0) {
+			release(sb);
+			return;
+		}
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef SHARK_SUPERBLOCK_H
+#define SHARK_SUPERBLOCK_H
+#include <stddef.h>
+#include "data_types.h"
+
+namespace shark
+{
+
+/*
+ * Page source for a heap: 64 page superblocks reserved with one mmap each and
+ * committed in steps as pages are handed out, so a bucket page or a small tree
+ * segment costs a bitmap scan instead of a memalign call with its alignment
+ * padding. Superblocks are aligned to their own size; the descriptors live in a
+ * table sorted by address, which is small enough to binary search on free.
+ * Freed pages are given back to the kernel with MADV_DONTNEED, so every run
+ * alloc hands out reads as zero. Superblocks which run empty are unmapped
+ * except for one spare.
+ * Not synchronised, the owning heap serialises all calls.
+ */
+class SuperblockArena {
+	SuperblockArena(const SuperblockArena&);
+	SuperblockArena& operator=(const SuperblockArena&);
+public:
+	static const unsigned PAGES_PER_SUPERBLOCK = 64;
+	static const unsigned COMMIT_STEP = 8;	// pages made accessible at a time
+
+	explicit SuperblockArena(unsigned pageSizeLog2);
+	// superblocks which still hold pages stay mapped, like leaked memory would
+	~SuperblockArena();
+
+	// count contiguous pages, NULL when the run doesn't fit a superblock or mmap failed
+	void* alloc(size_t count);
+	// pages of a run returned by alloc, partial runs are allowed
+	void free(void* ptr, size_t count);
+	bool owns(const void* ptr) const {return find(ptr) != NULL;}
+	// superblocks reserved from now on are bound to node with one mbind, -1 for none
+	void set_node(int node) {mNode = node;}
+
+	size_t page_size() const {return (size_t)1 << mPageSizeLog2;}
+	size_t superblock_size() const {return page_size() * PAGES_PER_SUPERBLOCK;}
+	size_t superblock_count() const {return mCount;}
+	size_t used_pages() const {return mUsedPages;}
+	size_t committed_bytes() const {return mCommittedPages << mPageSizeLog2;}
+private:
+	struct superblock {
+		char* mBase;
+		uint64 mUsed;		// one bit per page
+		unsigned mCommitted;	// pages [0, mCommitted) are accessible
+	};
+	superblock* mTable;	// sorted by mBase
+	size_t mCount;
+	size_t mCapacity;
+	unsigned mPageSizeLog2;
+	size_t mUsedPages;
+	size_t mCommittedPages;
+	int mNode;
+
+	superblock* find(const void* ptr) const;
+	superblock* reserve();
+	void release(superblock* sb);
+	bool commit(superblock* sb, unsigned end);
+	static int find_run(uint64 used, unsigned count);
+};
+
+}
+
+#endif
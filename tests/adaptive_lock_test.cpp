@@ -0,0 +1,105 @@
+// regression tests for AdaptiveLock: mutual exclusion with and without
+// spinning, exact acquisition counts and the contention statistics
+#include <pthread.h>
+#include <unistd.h>
+#include "mutex.h"
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static const int THREADS = 4;
+static const int ROUNDS = 200000;
+
+static AdaptiveLock sLock;
+static volatile uint64 sCounter;
+
+static void* worker(void*)
+{
+	for (int i = 0; i < ROUNDS; i++) {
+		sLock.lock();
+		// read, wait a little and write back, lost updates show a broken lock
+		uint64 value = sCounter;
+		for (int k = 0; k < 20; k++)
+			__asm__ __volatile__("" ::: "memory");
+		sCounter = value + 1;
+		sLock.unlock();
+	}
+	return NULL;
+}
+
+static void run(unsigned spinCount)
+{
+	sCounter = 0;
+	uint64 before = sLock.stats().mAcquisitions;
+	uint64 contendedBefore = sLock.stats().mContended;
+	sLock.set_spin_count(spinCount);
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	CHECK(sCounter == (uint64)THREADS * ROUNDS);
+	const LockStats& stats = sLock.stats();
+	CHECK(stats.mAcquisitions - before == (uint64)THREADS * ROUNDS);
+	CHECK(stats.mContended - contendedBefore <= stats.mAcquisitions - before);
+	printf("spin %u: %llu of %llu acquisitions contended\n", spinCount,
+		(unsigned long long)(stats.mContended - contendedBefore), (unsigned long long)(stats.mAcquisitions - before));
+}
+
+static void* blocked_locker(void* lock)
+{
+	((AdaptiveLock*)lock)->lock();
+	((AdaptiveLock*)lock)->unlock();
+	return NULL;
+}
+
+// a thread which finds the lock held counts one contended acquisition and its wait
+static void test_contention()
+{
+	AdaptiveLock lock(10);
+	lock.lock();
+	pthread_t thread;
+	pthread_create(&thread, NULL, blocked_locker, &lock);
+	usleep(50000);
+	lock.unlock();
+	pthread_join(thread, NULL);
+	CHECK(lock.stats().mAcquisitions == 2);
+	CHECK(lock.stats().mContended == 1);
+	CHECK(lock.stats().mWaitNanos >= 10000000);
+}
+
+static void test_try_lock()
+{
+	AdaptiveLock lock;
+	CHECK(lock.try_lock());
+	CHECK(!lock.try_lock());
+	lock.unlock();
+	CHECK(lock.try_lock());
+	lock.unlock();
+	CHECK(lock.stats().mAcquisitions == 2 && lock.stats().mContended == 0);
+	NullLock none;
+	none.lock();
+	CHECK(none.try_lock());
+	none.unlock();
+	CHECK(none.stats().mAcquisitions == 0);
+}
+
+// the heap's own locks count their acquisitions
+static void test_heap_locks()
+{
+	HeapAllocator heap;
+	uint64 before = heap.tree_lock_stats().mAcquisitions;
+	void* big = heap.alloc(100000);
+	heap.free(big);
+	CHECK(heap.tree_lock_stats().mAcquisitions > before);
+}
+
+int main()
+{
+	run(0);
+	run(100);
+	test_contention();
+	test_try_lock();
+	test_heap_locks();
+	return check_result();
+}
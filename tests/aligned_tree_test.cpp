@@ -0,0 +1,114 @@
+// regression tests for aligned tree allocations: mixed alignments keep their
+// blocks intact, and the best fit is a block below size + alignment whose
+// offset to the next aligned address still leaves room, not a larger one
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+struct live_block {
+	unsigned char* mem;
+	size_t size;
+};
+
+static bool block_intact(const live_block& b)
+{
+	for (size_t i = 0; i < b.size; i += 97)
+		if (b.mem[i] != (unsigned char)b.size)
+			return false;
+	return true;
+}
+
+// mixed aligned tree allocations, every block keeps its alignment and contents
+static void test_aligned(HeapAllocator& heap)
+{
+	std::vector<live_block> live;
+	srand(9);
+	for (int round = 0; round < 200000; round++) {
+		if (live.size() < 2000 || rand() % 2) {
+			live_block b;
+			b.size = 5000 + (rand() % 4) * 1024;
+			size_t align = (size_t)1 << (4 + rand() % 10);
+			b.mem = (unsigned char*)heap.alloc(b.size, align);
+			CHECK(b.mem != NULL);
+			CHECK(((size_t)b.mem & (align - 1)) == 0);
+			memset(b.mem, (int)(b.size & 255), b.size);
+			live.push_back(b);
+		} else {
+			size_t i = rand() % live.size();
+			CHECK(block_intact(live[i]));
+			heap.free(live[i].mem);
+			live[i] = live.back();
+			live.pop_back();
+		}
+	}
+	for (size_t i = 0; i < live.size(); i++)
+		heap.free(live[i].mem);
+}
+
+// free blocks of slightly different sizes: the smallest one at least as large
+// as the request misses the alignment, a larger one still fits after moving
+// its start up, and has to win over the blocks large enough for any offset
+static const int BEST_FIT_BLOCKS = 6;
+
+static bool test_best_fit(size_t alignment)
+{
+	HeapAllocator heap;
+	char* blocks[BEST_FIT_BLOCKS];
+	size_t sizes[BEST_FIT_BLOCKS];
+	void* guards[BEST_FIT_BLOCKS + 2];
+	for (int i = 0; i < BEST_FIT_BLOCKS; i++) {
+		blocks[i] = (char*)heap.alloc(20000 + 16 * i);
+		sizes[i] = heap.usable_size(blocks[i]);
+		guards[i] = heap.alloc(1000);
+	}
+	void* large = heap.alloc(100000);
+	guards[BEST_FIT_BLOCKS] = heap.alloc(1000);
+	void* recent = heap.alloc(1000);
+	guards[BEST_FIT_BLOCKS + 1] = heap.alloc(1000);
+	for (int i = 0; i < BEST_FIT_BLOCKS; i++)
+		heap.free(blocks[i]);
+	heap.free(large);
+	// the most recently freed block is checked first, keep it too small
+	heap.free(recent);
+
+	// a request the smallest candidate can't take at its offset, but a later one can
+	bool tested = false;
+	for (int j = 1; j < BEST_FIT_BLOCKS && !tested; j++) {
+		size_t request = (sizes[j] - (align_up(blocks[j], alignment) - blocks[j])) & ~(size_t)15;
+		int first = -1, fit = -1;
+		for (int i = 0; i < BEST_FIT_BLOCKS; i++) {
+			if (sizes[i] < request)
+				continue;
+			if (first < 0)
+				first = i;
+			if (fit < 0 && sizes[i] >= request + (align_up(blocks[i], alignment) - blocks[i]))
+				fit = i;
+		}
+		if (first == fit || request + alignment <= sizes[fit])
+			continue;
+		tested = true;
+		char* mem = (char*)heap.alloc(request, alignment);
+		CHECK(mem != NULL && ((size_t)mem & (alignment - 1)) == 0);
+		CHECK(mem >= blocks[fit] && mem + request <= blocks[fit] + sizes[fit]);
+		heap.free(mem);
+	}
+	for (int i = 0; i < BEST_FIT_BLOCKS + 2; i++)
+		heap.free(guards[i]);
+	return tested;
+}
+
+int main()
+{
+	{
+		HeapAllocator heap;
+		test_aligned(heap);
+	}
+	int tested = 0;
+	for (size_t alignment = 64; alignment <= 8192; alignment *= 2)
+		tested += test_best_fit(alignment);
+	CHECK(tested > 0);
+	return check_result();
+}
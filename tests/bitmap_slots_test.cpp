@@ -0,0 +1,121 @@
+// regression tests for bucket page slot tracking: free list and bitmap pages
+// under random alloc/free, naturally aligned small blocks, and bitmaps sized
+// to their class so the last slot of a page never overlaps its bitmap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+template<class Heap>
+static void test_slots()
+{
+	Heap heap;
+	std::vector<unsigned char*> live;
+	srand(1);
+	for (int round = 0; round < 10; round++) {
+		for (int i = 0; i < 50000; i++) {
+			size_t size = rand() % 256 + 1;
+			unsigned char* mem = (unsigned char*)heap.alloc(size);
+			CHECK(mem != NULL);
+			memset(mem, (int)size, size);
+			mem[0] = (unsigned char)size;
+			live.push_back(mem);
+		}
+		for (size_t i = 0; i < live.size(); ) {
+			if (rand() % 2) {
+				CHECK(heap.size(live[i]) >= live[i][0]);
+				heap.free(live[i]);
+				live[i] = live.back();
+				live.pop_back();
+			} else {
+				i++;
+			}
+		}
+	}
+	size_t used = 0;
+	heap.ctl("stats.buckets.slots_used", &used);
+	CHECK(used == live.size());
+	for (size_t i = 0; i < live.size(); i++)
+		heap.free(live[i]);
+	for (size_t align = 16; align <= 4096; align *= 2) {
+		void* mem = heap.alloc(align / 2, align);
+		CHECK(mem != NULL && ((size_t)mem & (align - 1)) == 0);
+		heap.free(mem);
+	}
+	heap.ctl("stats.buckets.slots_used", &used);
+	CHECK(used == 0);
+	heap.purge();
+	size_t pages = 1;
+	heap.ctl("stats.bucket.3.pages", &pages);
+	CHECK(pages == 0);
+}
+
+static void test_slots_for()
+{
+	for (size_t elemSize = 8; elemSize <= 4096; elemSize += 8) {
+		size_t avail = 65536 - 64;
+		unsigned n = bitmap_slots::slots_for(avail, elemSize);
+		size_t words = (n + 63) / 64;
+		CHECK(n * elemSize + words * 8 <= avail);
+		// one more slot and its bit don't fit
+		CHECK((n + 1) * elemSize + (n + 64) / 64 * 8 > avail);
+		CHECK(free_list_slots::slots_for(avail, elemSize) == avail / elemSize);
+	}
+}
+
+// fills whole pages of the smallest and a large class and checks no slot overlaps the bitmap
+static void test_full_pages(size_t elemSize)
+{
+	BitmapHeapAllocator heap;
+	std::vector<size_t*> live;
+	size_t total = 0;
+	while (total == 0 || live.size() < total * 2) {
+		size_t* mem = (size_t*)heap.alloc(elemSize);
+		CHECK(mem != NULL);
+		for (size_t i = 0; i < elemSize / sizeof(size_t); i++)
+			mem[i] = (size_t)mem + i;
+		live.push_back(mem);
+		if (total == 0) {
+			char name[64];
+			snprintf(name, sizeof(name), "stats.bucket.%u.slots_total", (unsigned)(elemSize / 8 - 1));
+			if (heap.ctl(name, &total) != 0 || total == 0) {
+				CHECK(!"no slots_total for the class");
+				break;
+			}
+		}
+	}
+	std::vector<size_t*> sorted(live);
+	std::sort(sorted.begin(), sorted.end());
+	CHECK(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+	bool intact = true;
+	for (size_t n = 0; n < live.size(); n++) {
+		for (size_t i = 0; i < elemSize / sizeof(size_t); i++)
+			intact = intact && live[n][i] == (size_t)live[n] + i;
+	}
+	CHECK(intact);
+	for (size_t n = 0; n < live.size(); n += 2)
+		heap.free(live[n]);
+	for (size_t n = 0; n < live.size(); n += 2)
+		live[n] = (size_t*)heap.alloc(elemSize);
+	for (size_t n = 0; n < live.size(); n++)
+		heap.free(live[n]);
+	size_t used = 1;
+	heap.ctl("stats.buckets.slots_used", &used);
+	CHECK(used == 0);
+}
+
+int main()
+{
+	test_slots<HeapAllocator>();
+	test_slots<BitmapHeapAllocator>();
+	test_slots_for();
+	test_full_pages(8);
+	size_t maxSmall = 0;
+	BitmapHeapAllocator().ctl("config.max_small_allocation", &maxSmall);
+	test_full_pages(maxSmall);
+	return check_result();
+}
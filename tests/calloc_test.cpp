@@ -0,0 +1,85 @@
+// regression tests for calloc: overflow of count * size, and blocks handed out
+// without clearing (BL_ZERO) must really be zero, also after reuse and purge
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static bool all_zero(const char* mem, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		if (mem[i])
+			return false;
+	return true;
+}
+
+template<class Heap>
+static void test_calloc(Heap& heap)
+{
+	const size_t bigSize = 64 << 20;
+	CHECK(heap.calloc((size_t)-1 / 2, 3) == NULL);
+
+	char* big = (char*)heap.calloc(1024, 64 * 1024);
+	CHECK(big != NULL && all_zero(big, bigSize));
+	memset(big, 0xff, bigSize);
+	heap.free(big);
+	big = (char*)heap.calloc(1024, 64 * 1024);
+	CHECK(big != NULL && all_zero(big, bigSize));
+	heap.free(big);
+
+	std::vector<std::pair<char*, size_t> > live;
+	srand(1);
+	for (int round = 0; round < 100000; round++) {
+		if (live.size() < 500 && rand() % 3) {
+			size_t size = rand() % 3 ? rand() % 200000 + 1 : rand() % 3000 + 1;
+			char* mem = (char*)heap.calloc(1, size);
+			CHECK(mem != NULL && all_zero(mem, size));
+			memset(mem, 0xab, size);
+			live.push_back(std::make_pair(mem, size));
+		} else if (!live.empty()) {
+			size_t i = rand() % live.size();
+			if (rand() % 4 == 0) {
+				// dirty blocks through realloc and aligned allocs too
+				size_t size = rand() % 300000 + 1;
+				live[i].first = (char*)heap.realloc(live[i].first, size);
+				memset(live[i].first, 0xcd, size);
+				live[i].second = size;
+			} else if (rand() % 4 == 0) {
+				heap.free(live[i].first);
+				live[i].first = (char*)heap.alloc(rand() % 100000 + 1, 4096);
+				live[i].second = 1;
+			} else {
+				heap.free(live[i].first);
+				live[i] = live.back();
+				live.pop_back();
+			}
+		}
+		if (round == 50000)
+			heap.purge();
+	}
+	for (size_t i = 0; i < live.size(); i++)
+		heap.free(live[i].first);
+}
+
+int main()
+{
+	{
+		HeapAllocator heap;
+		test_calloc(heap);
+	}
+	{
+		HeapAllocator heap;
+		size_t quickMax = 32, hugeThreshold = 1 << 20;
+		CHECK(heap.ctl("tree.quick_list_max", NULL, &quickMax) == 0);
+		CHECK(heap.ctl("tree.huge_threshold", NULL, &hugeThreshold) == 0);
+		test_calloc(heap);
+	}
+	{
+		BitmapHeapAllocator heap;
+		test_calloc(heap);
+	}
+	return check_result();
+}
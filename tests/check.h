@@ -0,0 +1,25 @@
+#ifndef SHARK_TEST_CHECK_H
+#define SHARK_TEST_CHECK_H
+
+// minimal checks for the regression tests: a failed CHECK prints itself and is
+// counted, main returns check_result() so run_tests.sh sees the failure
+#include <stdio.h>
+
+static int sFailedChecks = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			sFailedChecks++; \
+		} \
+	} while (0)
+
+static inline int check_result()
+{
+	if (sFailedChecks)
+		printf("%d checks failed\n", sFailedChecks);
+	return sFailedChecks != 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+// regression tests for the per-cpu caches: changing the cache depth while
+// other threads use the caches must neither overflow a cache nor lose blocks
+#include <pthread.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static HeapAllocator* sHeap;
+static volatile bool sStopToggling;
+
+static void* worker(void*)
+{
+	std::vector<void*> live;
+	unsigned seed = 1;
+	for (int i = 0; i < 500000; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (live.size() < 200 && (seed >> 16) % 2) {
+			void* mem = sHeap->alloc(8 + (seed >> 20) % 256);
+			*(char*)mem = 1;
+			live.push_back(mem);
+		} else if (!live.empty()) {
+			sHeap->free(live.back());
+			live.pop_back();
+		}
+	}
+	for (size_t i = 0; i < live.size(); i++)
+		sHeap->free(live[i]);
+	return NULL;
+}
+
+static void* toggler(void*)
+{
+	static const unsigned depths[] = {0, 64, 4};
+	for (unsigned i = 0; !sStopToggling; i++)
+		sHeap->set_cpu_cache(depths[i % 3]);
+	return NULL;
+}
+
+int main()
+{
+	sHeap = new HeapAllocator();
+	if (!sHeap->set_cpu_cache(64)) {
+		printf("no rseq support, skipping the cpu cache test\n");
+		delete sHeap;
+		return 0;
+	}
+	size_t depth = 0;
+	CHECK(sHeap->ctl("cpu_cache.depth", &depth) == 0 && depth == 64);
+	pthread_t threads[5];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	pthread_create(&threads[4], NULL, toggler, NULL);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	sStopToggling = true;
+	pthread_join(threads[4], NULL);
+	sHeap->set_cpu_cache(0);
+	size_t used = 1;
+	sHeap->ctl("stats.buckets.slots_used", &used);
+	CHECK(used == 0);
+	delete sHeap;
+	return check_result();
+}
@@ -0,0 +1,147 @@
+// regression tests for ctl(): every knob reads back what was set, bad values
+// and names are rejected, statistics are read only, configure() parses
+// settings, and knobs can change while other threads use the heap
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+static int set(HeapAllocator& heap, const char* name, size_t value)
+{
+	return heap.ctl(name, NULL, &value);
+}
+
+static void test_knobs()
+{
+	HeapAllocator heap;
+	size_t pageSize = get(heap, "config.page_size");
+	CHECK(pageSize >= VIRTUAL_PAGE_SIZE);
+	static const char* const knobs[] = {"tree.huge_threshold", "tree.retain_bytes", "tree.quick_list_max",
+		"page_pool.max_pages", "page_pool.decay_ms", "rt.reserve_pages", "rt.reserve_segments",
+		"lifetime.sample_rate", "lifetime.short_us"};
+	for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); i++) {
+		size_t value = 3 * pageSize;
+		CHECK(set(heap, knobs[i], value) == 0);
+		CHECK(get(heap, knobs[i]) == value);
+	}
+	CHECK(set(heap, "latency.enabled", 5) == 0);
+	CHECK(get(heap, "latency.enabled") == 1);
+	CHECK(set(heap, "latency.enabled", 0) == 0);
+	CHECK(get(heap, "latency.enabled") == 0);
+	// rounded to their granularity
+	CHECK(set(heap, "tree.grow_size", 100000) == 0);
+	CHECK(get(heap, "tree.grow_size") == round_up((size_t)100000, VIRTUAL_PAGE_SIZE));
+	CHECK(set(heap, "rt.segment_size", 1) == 0);
+	CHECK(get(heap, "rt.segment_size") == pageSize);
+
+	CHECK(get(heap, "config.max_small_allocation") > 0);
+	CHECK(get(heap, "stats.buckets") > 0);
+	CHECK(get(heap, "stats.bucket.0.elem_size") > 0);
+	size_t used = get(heap, "stats.buckets.slots_used");
+	void* p = heap.alloc(24);
+	CHECK(get(heap, "stats.buckets.slots_used") == used + 1);
+	heap.free(p);
+}
+
+static void test_rejected()
+{
+	HeapAllocator heap;
+	size_t value = 0;
+	CHECK(heap.ctl("no.such.knob", &value) == ENOENT);
+	CHECK(heap.ctl("stats.bucket.100000.pages", &value) == ENOENT);
+	CHECK(set(heap, "stats.segments", 1) == EPERM);
+	CHECK(set(heap, "config.page_size", 1) == EPERM);
+	CHECK(set(heap, "tree.grow_size", 0) == EINVAL);
+	CHECK(set(heap, "tree.grow_size", (size_t)-1) == EINVAL);
+	CHECK(set(heap, "tree.huge_threshold", 100) == EINVAL);
+	CHECK(set(heap, "rt.segment_size", 0) == EINVAL);
+	CHECK(set(heap, "lifetime.sample_rate", (size_t)1 << 40) == EINVAL);
+	// a rejected value leaves the knob alone
+	CHECK(get(heap, "tree.grow_size") == get(heap, "config.page_size"));
+	CHECK(heap.alloc((size_t)-1 - 100) == NULL);
+}
+
+static void test_configure()
+{
+	HeapAllocator heap;
+	CHECK(heap.configure("tree.retain_bytes:1048576,page_pool.max_pages:0x10") == 0);
+	CHECK(get(heap, "tree.retain_bytes") == 1048576);
+	CHECK(get(heap, "page_pool.max_pages") == 16);
+	CHECK(heap.configure("tree.retain_bytes:12x") == EINVAL);
+	CHECK(heap.configure("tree.retain_bytes") == EINVAL);
+	CHECK(heap.configure("no.such.knob:1,page_pool.max_pages:3") == ENOENT);
+	// the valid setting after the bad one still applies
+	CHECK(get(heap, "page_pool.max_pages") == 3);
+}
+
+static HeapAllocator* sHeap;
+static volatile bool sStop;
+
+static void* worker(void*)
+{
+	std::vector<void*> live;
+	unsigned seed = 7;
+	for (int i = 0; i < 200000; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (live.size() < 100 && (seed >> 16) % 2) {
+			size_t size = (seed >> 20) % 8 ? 16 + (seed >> 8) % 500 : 5000 + (seed >> 8) % 300000;
+			live.push_back(sHeap->alloc(size));
+		} else if (!live.empty()) {
+			sHeap->free(live.back());
+			live.pop_back();
+		}
+	}
+	for (size_t i = 0; i < live.size(); i++)
+		sHeap->free(live[i]);
+	return NULL;
+}
+
+static void* tuner(void*)
+{
+	for (size_t i = 0; !sStop; i++) {
+		set(*sHeap, "tree.huge_threshold", i % 2 ? 0 : 256 * 1024);
+		set(*sHeap, "tree.grow_size", (i % 4 + 1) * VIRTUAL_PAGE_SIZE);
+		set(*sHeap, "tree.quick_list_max", i % 3 * 16);
+		set(*sHeap, "tree.retain_bytes", i % 2 * 1024 * 1024);
+		set(*sHeap, "page_pool.decay_ms", i % 5);
+		set(*sHeap, "latency.enabled", i % 2);
+		set(*sHeap, "lifetime.sample_rate", i % 3 * 10);
+		set(*sHeap, "lifetime.short_us", i % 100);
+	}
+	return NULL;
+}
+
+static void test_concurrent()
+{
+	sHeap = new HeapAllocator();
+	pthread_t threads[4];
+	for (int i = 0; i < 3; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	pthread_create(&threads[3], NULL, tuner, NULL);
+	for (int i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+	sStop = true;
+	pthread_join(threads[3], NULL);
+	sHeap->purge();
+	CHECK(get(*sHeap, "stats.buckets.slots_used") == 0);
+	delete sHeap;
+}
+
+int main()
+{
+	test_knobs();
+	test_rejected();
+	test_configure();
+	test_concurrent();
+	return check_result();
+}
@@ -0,0 +1,54 @@
+// regression tests for independent heaps: blocks stay with the heap that
+// handed them out, and heap_destroy releases a heap with live blocks in it
+#include <string.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static void test_independent()
+{
+	HeapAllocator* first = heap_create();
+	HeapAllocator* second = heap_create();
+	CHECK(first != second && first != g_allocator);
+	std::vector<void*> firstBlocks, secondBlocks;
+	for (size_t size = 8; size < 300000; size = size * 3 / 2 + 1) {
+		firstBlocks.push_back(first->alloc(size));
+		secondBlocks.push_back(second->alloc(size));
+		memset(firstBlocks.back(), 1, size);
+		memset(secondBlocks.back(), 2, size);
+	}
+	for (size_t i = 0; i < firstBlocks.size(); i++) {
+		CHECK(first->owns(firstBlocks[i]) && !second->owns(firstBlocks[i]));
+		CHECK(second->owns(secondBlocks[i]) && !first->owns(secondBlocks[i]));
+	}
+	for (size_t i = 0; i < firstBlocks.size(); i++)
+		first->free(firstBlocks[i]);
+	first->purge();
+	size_t segments = 1;
+	first->ctl("stats.segments", &segments);
+	CHECK(segments == 0);
+	// the second heap is untouched by the first one's purge
+	for (size_t i = 0; i < secondBlocks.size(); i++)
+		CHECK(*(char*)secondBlocks[i] == 2);
+	heap_destroy(first);
+	// live blocks go away with the heap
+	heap_destroy(second);
+}
+
+static void test_destroy_reuse()
+{
+	for (int round = 0; round < 20; round++) {
+		HeapAllocator* heap = heap_create();
+		for (int i = 0; i < 5000; i++)
+			CHECK(heap->alloc(i % 7 ? 48 : 20000) != NULL);
+		heap_destroy(heap);
+	}
+}
+
+int main()
+{
+	test_independent();
+	test_destroy_reuse();
+	return check_result();
+}
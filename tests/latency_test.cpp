@@ -0,0 +1,132 @@
+// regression tests for the latency histograms: values land within 1/16 of
+// their bucket, heap calls are counted per path and readable through ctl,
+// exited threads are kept, and latency_reset is safe while threads record
+#include <pthread.h>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+static void test_histogram()
+{
+	LatencyHistogram h;
+	CHECK(h.count() == 0);
+	CHECK(h.percentile(0.5) == 0);
+	for (uint64 v = 1; v <= 1000; v++)
+		h.record(v * 1000);
+	CHECK(h.count() == 1000);
+	uint64 p50 = h.percentile(0.5);
+	CHECK(p50 >= 500000 && p50 < 500000 + 500000 / 16);
+	uint64 max = h.max();
+	CHECK(max >= 1000000 && max < 1000000 + 1000000 / 16);
+	for (uint64 v = 0; v < 100000; v += 7) {
+		uint64 top = LatencyHistogram::highest_equivalent(LatencyHistogram::index_of(v));
+		CHECK(top >= v && top - v <= v / 16);
+	}
+	// clamped rather than out of range
+	CHECK(LatencyHistogram::index_of((uint64)-1) < LatencyHistogram::NUM_COUNTS);
+	h.reset();
+	CHECK(h.count() == 0);
+}
+
+static void test_heap_paths()
+{
+	HeapAllocator heap;
+	size_t one = 1;
+	CHECK(heap.ctl("latency.enabled", NULL, &one) == 0);
+	latency_reset();
+	CHECK(get(heap, "latency.alloc_bucket.count") == 0);
+	void* small[100];
+	for (int i = 0; i < 100; i++)
+		small[i] = heap.alloc(32);
+	for (int i = 0; i < 100; i++)
+		heap.free(small[i]);
+	void* big = heap.alloc(100000);
+	big = heap.realloc(big, 200000);
+	heap.free(big);
+	size_t bucketAllocs = get(heap, "latency.alloc_bucket.count") + get(heap, "latency.alloc_bucket_grow.count");
+	CHECK(bucketAllocs == 100);
+	CHECK(get(heap, "latency.free_bucket.count") == 100);
+	CHECK(get(heap, "latency.realloc.count") == 1);
+	CHECK(get(heap, "latency.alloc_bucket.p50") <= get(heap, "latency.alloc_bucket.p99"));
+	CHECK(get(heap, "latency.alloc_bucket.p99") <= get(heap, "latency.alloc_bucket.max"));
+	size_t value;
+	CHECK(heap.ctl("latency.no_such_path.count", &value) != 0);
+
+	size_t zero = 0;
+	CHECK(heap.ctl("latency.enabled", NULL, &zero) == 0);
+	heap.free(heap.alloc(32));
+	CHECK(get(heap, "latency.free_bucket.count") == 100);
+	latency_reset();
+	CHECK(get(heap, "latency.free_bucket.count") == 0);
+}
+
+static void* record_and_exit(void*)
+{
+	for (int i = 0; i < 10; i++)
+		latency_record(LATENCY_FREE_TREE, 100);
+	return NULL;
+}
+
+static void test_exited_thread()
+{
+	latency_reset();
+	pthread_t t;
+	pthread_create(&t, NULL, record_and_exit, NULL);
+	pthread_join(t, NULL);
+	LatencyHistogram h;
+	latency_snapshot(LATENCY_FREE_TREE, h);
+	CHECK(h.count() == 10);
+	latency_reset();
+	latency_snapshot(LATENCY_FREE_TREE, h);
+	CHECK(h.count() == 0);
+}
+
+static bool sStop;
+
+static void* record_loop(void*)
+{
+	while (!__atomic_load_n(&sStop, __ATOMIC_RELAXED))
+		latency_record(LATENCY_ALLOC_TREE, 50);
+	return NULL;
+}
+
+static void test_reset_while_recording()
+{
+	__atomic_store_n(&sStop, false, __ATOMIC_RELAXED);
+	pthread_t t[2];
+	for (int i = 0; i < 2; i++)
+		pthread_create(&t[i], NULL, record_loop, NULL);
+	LatencyHistogram h;
+	for (int i = 0; i < 2000; i++) {
+		latency_reset();
+		latency_snapshot(LATENCY_ALLOC_TREE, h);
+		// every record landed in the one bucket of 50
+		CHECK(h.count() == 0 || h.max() == LatencyHistogram::highest_equivalent(LatencyHistogram::index_of(50)));
+	}
+	__atomic_store_n(&sStop, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < 2; i++)
+		pthread_join(t[i], NULL);
+	// records of an older generation don't show up after a reset
+	latency_reset();
+	latency_snapshot(LATENCY_ALLOC_TREE, h);
+	CHECK(h.count() == 0);
+	latency_record(LATENCY_ALLOC_TREE, 50);
+	latency_snapshot(LATENCY_ALLOC_TREE, h);
+	CHECK(h.count() == 1);
+}
+
+int main()
+{
+	test_histogram();
+	test_heap_paths();
+	test_exited_thread();
+	test_reset_while_recording();
+	return check_result();
+}
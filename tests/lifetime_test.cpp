@@ -0,0 +1,93 @@
+// regression tests for lifetime sampling: every heap keeps its own sampling
+// countdown, sampling can be turned on while other threads allocate, and
+// destroy leaves no samples behind for the next blocks at the same addresses
+#include <pthread.h>
+#include <unistd.h>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static void test_per_heap_rate()
+{
+	HeapAllocator often, rarely;
+	size_t oftenRate = 2, rareRate = 1000;
+	CHECK(often.ctl("lifetime.sample_rate", NULL, &oftenRate) == 0);
+	CHECK(rarely.ctl("lifetime.sample_rate", NULL, &rareRate) == 0);
+	for (int i = 0; i < 200000; i++) {
+		void* a = often.alloc(32, "often.cpp", 1);
+		void* b = rarely.alloc(32, "rarely.cpp", 2);
+		often.free(a);
+		rarely.free(b);
+	}
+	size_t oftenSites = 0, rareSites = 0;
+	often.ctl("stats.lifetime.short_sites", &oftenSites);
+	rarely.ctl("stats.lifetime.short_sites", &rareSites);
+	CHECK(oftenSites == 1);
+	CHECK(rareSites == 1);
+}
+
+static HeapAllocator* sHeap;
+static bool sStop;
+
+static void* churn(void*)
+{
+	while (!__atomic_load_n(&sStop, __ATOMIC_RELAXED)) {
+		void* p[16];
+		for (int i = 0; i < 16; i++)
+			p[i] = sHeap->alloc(48, "churn.cpp", 7);
+		for (int i = 0; i < 16; i++)
+			sHeap->free(p[i]);
+	}
+	return NULL;
+}
+
+static void test_enable_while_allocating()
+{
+	HeapAllocator heap;
+	sHeap = &heap;
+	__atomic_store_n(&sStop, false, __ATOMIC_RELAXED);
+	pthread_t t[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&t[i], NULL, churn, NULL);
+	usleep(10000);
+	size_t rate = 1;
+	CHECK(heap.ctl("lifetime.sample_rate", NULL, &rate) == 0);
+	usleep(50000);
+	__atomic_store_n(&sStop, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; i++)
+		pthread_join(t[i], NULL);
+	size_t sites = 0;
+	heap.ctl("stats.lifetime.short_sites", &sites);
+	CHECK(sites == 1);
+}
+
+// samples left by destroy would credit the next blocks at their addresses to the leaking site
+static void test_destroy()
+{
+	HeapAllocator heap;
+	size_t rate = 1, shortUs = 10000000;
+	CHECK(heap.ctl("lifetime.sample_rate", NULL, &rate) == 0);
+	CHECK(heap.ctl("lifetime.short_us", NULL, &shortUs) == 0);
+	for (int i = 0; i < 100; i++)
+		heap.alloc(64, "leaked.cpp", 3);
+	heap.destroy();
+	for (int round = 0; round < 10; round++) {
+		void* p[100];
+		for (int i = 0; i < 100; i++)
+			p[i] = heap.alloc(64, "after.cpp", 4);
+		for (int i = 0; i < 100; i++)
+			heap.free(p[i]);
+	}
+	// only after.cpp, which frees at once
+	size_t sites = 0;
+	heap.ctl("stats.lifetime.short_sites", &sites);
+	CHECK(sites == 1);
+}
+
+int main()
+{
+	test_per_heap_rate();
+	test_enable_while_allocating();
+	test_destroy();
+	return check_result();
+}
@@ -0,0 +1,101 @@
+// regression tests for the NUMA layer: node queries, the page map, a heap
+// bound to a node registering its memory, and NumaHeap on this machine
+// (usually the single node fallback)
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+#include "numa_heap.h"
+#include "page_map.h"
+#include "check.h"
+using namespace shark;
+
+static void test_nodes()
+{
+	int count = numa_node_count();
+	CHECK(count >= 1 && count <= MAX_NUMA_NODES);
+	int node = numa_current_node();
+	CHECK(node >= 0 && node < count);
+}
+
+static void test_page_map()
+{
+	size_t size = VIRTUAL_PAGE_SIZE * 4;
+	char* mem = (char*)system_alloc(size);
+	int owner;
+	CHECK(page_map_get(mem) == NULL);
+	page_map_set(mem, size, &owner);
+	CHECK(page_map_get(mem) == &owner);
+	CHECK(page_map_get(mem + size - 1) == &owner);
+	CHECK(page_map_get(mem + size) != &owner);
+	page_map_set(mem + VIRTUAL_PAGE_SIZE, VIRTUAL_PAGE_SIZE, NULL);
+	CHECK(page_map_get(mem + VIRTUAL_PAGE_SIZE) == NULL);
+	CHECK(page_map_get(mem + 2 * VIRTUAL_PAGE_SIZE) == &owner);
+	page_map_set(mem, size, NULL);
+	CHECK(page_map_get(mem) == NULL);
+	// addresses outside the mapped leaves read as unowned
+	CHECK(page_map_get((void*)((size_t)1 << 46)) == NULL);
+	system_free(mem);
+}
+
+// a bound heap registers every page and segment it holds, and clears them again
+static void test_bound_heap()
+{
+	HeapAllocator heap;
+	heap.set_node(0);
+	CHECK(heap.node() == 0);
+	std::vector<void*> blocks;
+	for (size_t size = 16; size < 4 << 20; size *= 2) {
+		blocks.push_back(heap.alloc(size));
+		memset(blocks.back(), 1, size);
+		CHECK(page_map_get(blocks.back()) == &heap);
+	}
+	for (size_t i = 0; i < blocks.size(); i++)
+		heap.free(blocks[i]);
+	heap.purge();
+	for (size_t i = 0; i < blocks.size(); i++) {
+		void* owner = page_map_get(blocks[i]);
+		// a page can stay cached in the heap after purge, but never belongs to another
+		CHECK(owner == NULL || owner == &heap);
+	}
+}
+
+static void test_numa_heap()
+{
+	NumaHeap numa;
+	CHECK(numa.node_count() == numa_node_count());
+	CHECK(numa.heap(-1) == NULL && numa.heap(numa.node_count()) == NULL);
+	std::vector<char*> blocks;
+	for (int i = 0; i < 2000; i++) {
+		size_t size = (i * 37) % 20000 + 1;
+		char* p = (char*)numa.alloc(size);
+		CHECK(p != NULL);
+		memset(p, 5, size);
+		blocks.push_back(p);
+	}
+	char* aligned = (char*)numa.alloc(100, 4096);
+	CHECK(aligned && ((size_t)aligned & 4095) == 0);
+	memset(aligned, 5, 100);
+	blocks.push_back(aligned);
+	for (size_t i = 0; i < blocks.size(); i += 2) {
+		blocks[i] = (char*)numa.realloc(blocks[i], 50000);
+		CHECK(blocks[i] != NULL && blocks[i][0] == 5);
+	}
+	for (size_t i = 0; i < blocks.size(); i++) {
+		bool owned = false;
+		for (int n = 0; n < numa.node_count(); n++)
+			owned = owned || numa.heap(n)->owns(blocks[i]);
+		CHECK(owned);
+		numa.free(blocks[i]);
+	}
+	numa.free(NULL);
+	numa.purge();
+}
+
+int main()
+{
+	test_nodes();
+	test_page_map();
+	test_bound_heap();
+	test_numa_heap();
+	return check_result();
+}
@@ -0,0 +1,87 @@
+// regression tests for ObjectPool: construction and destruction through the
+// pool, page reuse, purge and the per-thread pool
+#include <pthread.h>
+#include <vector>
+#include "object_pool.h"
+#include "check.h"
+using namespace shark;
+
+struct tracked {
+	static int sLive;
+	int mValue;
+	char mPadding[40];
+	explicit tracked(int value) : mValue(value) {sLive++;}
+	~tracked() {sLive--;}
+};
+int tracked::sLive = 0;
+
+// one slot per page, the largest type the pool takes
+struct page_sized {
+	char mData[ObjectPool<char>::ELEM_SIZE * ObjectPool<char>::SLOTS_PER_PAGE - 64];
+};
+
+static void test_pool()
+{
+	ObjectPool<tracked> pool;
+	std::vector<tracked*> objects;
+	const size_t count = ObjectPool<tracked>::SLOTS_PER_PAGE * 3 + 1;
+	for (size_t i = 0; i < count; i++) {
+		tracked* obj = pool.create((int)i);
+		CHECK(obj != NULL && ((size_t)obj & (__alignof__(tracked) - 1)) == 0);
+		objects.push_back(obj);
+	}
+	CHECK(tracked::sLive == (int)count);
+	CHECK(pool.page_count() == 4);
+	for (size_t i = 0; i < count; i++)
+		CHECK(objects[i]->mValue == (int)i);
+	// freeing half of every page and refilling must not take new pages
+	for (size_t i = 0; i < count; i += 2)
+		pool.destroy(objects[i]);
+	for (size_t i = 0; i < count; i += 2)
+		objects[i] = pool.create(-1);
+	CHECK(pool.page_count() == 4);
+	for (size_t i = 0; i < count; i++)
+		pool.destroy(objects[i]);
+	CHECK(tracked::sLive == 0);
+	pool.purge();
+	CHECK(pool.page_count() == 0);
+
+	ObjectPool<page_sized> bigPool;
+	CHECK(ObjectPool<page_sized>::SLOTS_PER_PAGE == 1);
+	page_sized* a = bigPool.create();
+	page_sized* b = bigPool.create();
+	CHECK(a && b && bigPool.page_count() == 2);
+	bigPool.destroy(a);
+	bigPool.destroy(b);
+}
+
+typedef ObjectPool<tracked, NullLock> local_pool;
+
+static void* local_worker(void* mainPool)
+{
+	local_pool& pool = local_pool::local();
+	CHECK(&pool != mainPool);
+	std::vector<tracked*> objects;
+	for (int i = 0; i < 10000; i++)
+		objects.push_back(pool.create(i));
+	for (size_t i = 0; i < objects.size(); i++)
+		pool.destroy(objects[i]);
+	return NULL;
+}
+
+// every thread gets its own unlocked pool
+static void test_local()
+{
+	local_pool* mainPool = &local_pool::local();
+	CHECK(mainPool == &local_pool::local());
+	pthread_t thread;
+	pthread_create(&thread, NULL, local_worker, mainPool);
+	pthread_join(thread, NULL);
+}
+
+int main()
+{
+	test_pool();
+	test_local();
+	return check_result();
+}
@@ -0,0 +1,91 @@
+// regression tests for the shared page pool: empty pages of one size class
+// serve another, max_pages bounds the pool, pooled pages decay through
+// decay_ms only when decay() or a pool operation runs, and purge empties it
+#include <unistd.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+static int set(HeapAllocator& heap, const char* name, size_t value)
+{
+	return heap.ctl(name, NULL, &value);
+}
+
+// fills pages pages of 64 byte slots and frees them again, all but one land in the pool
+static void churn(HeapAllocator& heap, size_t pages)
+{
+	size_t count = pages * get(heap, "config.page_size") / 64;
+	std::vector<void*> live;
+	for (size_t i = 0; i < count; i++)
+		live.push_back(heap.alloc(64));
+	for (size_t i = 0; i < live.size(); i++)
+		heap.free(live[i]);
+}
+
+static void test_shared_between_classes()
+{
+	HeapAllocator heap;
+	CHECK(get(heap, "stats.page_pool.pages") == 0);
+	churn(heap, 4);
+	size_t pooled = get(heap, "stats.page_pool.pages");
+	CHECK(pooled >= 2);
+	void* p = heap.alloc(128);
+	CHECK(get(heap, "stats.page_pool.pages") == pooled - 1);
+	heap.free(p);
+	// the 128 byte bucket keeps its own empty page
+	CHECK(get(heap, "stats.page_pool.pages") == pooled - 1);
+	CHECK(set(heap, "page_pool.max_pages", 1) == 0);
+	CHECK(get(heap, "stats.page_pool.pages") == 1);
+	heap.purge();
+	CHECK(get(heap, "stats.page_pool.pages") == 0);
+}
+
+static void test_disabled()
+{
+	HeapAllocator heap;
+	CHECK(set(heap, "page_pool.max_pages", 0) == 0);
+	churn(heap, 4);
+	CHECK(get(heap, "stats.page_pool.pages") == 0);
+}
+
+static void test_decay()
+{
+	HeapAllocator heap;
+	CHECK(set(heap, "page_pool.decay_ms", 1) == 0);
+	churn(heap, 4);
+	CHECK(get(heap, "stats.page_pool.pages") >= 2);
+	usleep(20000);
+	// nothing touched the pool, its pages are still there
+	CHECK(get(heap, "stats.page_pool.pages") >= 2);
+	heap.decay();
+	CHECK(get(heap, "stats.page_pool.pages") == 0);
+
+	// decay keeps pages which are still young
+	CHECK(set(heap, "page_pool.decay_ms", 10000) == 0);
+	churn(heap, 4);
+	size_t pooled = get(heap, "stats.page_pool.pages");
+	CHECK(pooled >= 2);
+	heap.decay();
+	CHECK(get(heap, "stats.page_pool.pages") == pooled);
+	// a page handed to the pool trims the expired ones
+	CHECK(set(heap, "page_pool.decay_ms", 1) == 0);
+	usleep(20000);
+	churn(heap, 2);
+	CHECK(get(heap, "stats.page_pool.pages") <= 2 && pooled > 2);
+}
+
+int main()
+{
+	test_shared_between_classes();
+	test_disabled();
+	test_decay();
+	return check_result();
+}
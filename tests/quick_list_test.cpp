@@ -0,0 +1,84 @@
+// regression tests for deferred coalescing: freed tree blocks wait in the
+// quick lists and come back for the same size, the lists stay within
+// tree.quick_list_max, and purge merges them back into the free tree
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+static void test_reuse()
+{
+	HeapAllocator heap;
+	size_t quickMax = 16;
+	CHECK(heap.ctl("tree.quick_list_max", NULL, &quickMax) == 0);
+	void* keep = heap.alloc(3000);
+	void* a = heap.alloc(5000);
+	void* guard = heap.alloc(3000);
+	heap.free(a);
+	CHECK(get(heap, "stats.tree.quick_blocks") == 1);
+	// the same size takes the block back without coalescing
+	CHECK(heap.alloc(5000) == a);
+	CHECK(get(heap, "stats.tree.quick_blocks") == 0);
+	heap.free(a);
+	heap.free(keep);
+	heap.free(guard);
+	CHECK(get(heap, "stats.tree.quick_blocks") <= quickMax);
+	heap.purge();
+	CHECK(get(heap, "stats.tree.quick_blocks") == 0);
+
+	// off by default
+	HeapAllocator plain;
+	void* b = plain.alloc(5000);
+	plain.free(b);
+	CHECK(get(plain, "stats.tree.quick_blocks") == 0);
+}
+
+static void test_mixed()
+{
+	HeapAllocator heap;
+	size_t quickMax = 64;
+	CHECK(heap.ctl("tree.quick_list_max", NULL, &quickMax) == 0);
+	std::vector<void*> live;
+	srand(1);
+	size_t most = 0;
+	for (int round = 0; round < 100000; round++) {
+		if (live.size() < 500 || rand() % 2) {
+			size_t size = 300 + (rand() % 8) * 512;
+			void* mem = rand() % 5 ? heap.alloc(size) : heap.alloc(size, 64);
+			CHECK(mem != NULL);
+			memset(mem, 3, size);
+			live.push_back(mem);
+		} else {
+			size_t i = rand() % live.size();
+			heap.free(live[i]);
+			live[i] = live.back();
+			live.pop_back();
+		}
+		if (round % 1000 == 0) {
+			size_t quick = get(heap, "stats.tree.quick_blocks");
+			most = quick > most ? quick : most;
+		}
+	}
+	CHECK(most > 0 && most <= quickMax);
+	for (size_t i = 0; i < live.size(); i++)
+		heap.free(live[i]);
+	// purge merges everything waiting in the quick lists back into the tree
+	heap.purge();
+	CHECK(get(heap, "stats.tree.quick_blocks") == 0);
+}
+
+int main()
+{
+	test_reuse();
+	test_mixed();
+	return check_result();
+}
@@ -0,0 +1,75 @@
+// regression tests for Region: alignment, big requests, mark/rewind with the
+// spare chunk, alloc_array overflow and the pmr adapter
+#include <string.h>
+#include <vector>
+#include "region.h"
+#include "check.h"
+using namespace shark;
+
+static void test_alloc()
+{
+	Region region;
+	CHECK(region.reserved() == 0);
+	for (size_t align = 1; align <= 4096; align *= 2) {
+		char* p = (char*)region.alloc(align * 3 + 1, align);
+		CHECK(p != NULL && ((size_t)p & (align - 1)) == 0);
+		memset(p, 1, align * 3 + 1);
+	}
+	// larger than a chunk, gets its own
+	char* big = (char*)region.alloc(Region::CHUNK_SIZE * 3);
+	CHECK(big != NULL);
+	memset(big, 2, Region::CHUNK_SIZE * 3);
+	CHECK(region.reserved() >= Region::CHUNK_SIZE * 4);
+	CHECK(region.alloc_array<double>((size_t)-1 / 4) == NULL);
+	double* values = region.alloc_array<double>(1000);
+	CHECK(values != NULL && ((size_t)values & (__alignof__(double) - 1)) == 0);
+	region.release();
+	CHECK(region.reserved() == 0);
+}
+
+static void test_rewind()
+{
+	Region region;
+	void* first = region.alloc(100);
+	Region::mark start = region.get_mark();
+	void* second = region.alloc(100);
+	{
+		RegionScope scope(region);
+		for (int i = 0; i < 10000; i++)
+			region.alloc(1000);
+	}
+	// the scope dropped everything it allocated, bar one spare chunk
+	CHECK(region.reserved() == Region::CHUNK_SIZE * 2);
+	CHECK(region.alloc(100) == (char*)second + round_up(100, DEFAULT_ALIGNMENT));
+	region.rewind(start);
+	CHECK(region.alloc(100) == second);
+	// filling one more chunk reuses the spare instead of the system
+	size_t reserved = region.reserved();
+	for (int i = 0; i < 60; i++)
+		region.alloc(1000);
+	CHECK(region.reserved() == reserved);
+	CHECK(first != NULL);
+}
+
+#ifdef SHARK_HAS_PMR
+static void test_resource()
+{
+	Region region;
+	RegionResource resource(region);
+	std::pmr::vector<int> values(&resource);
+	for (int i = 0; i < 100000; i++)
+		values.push_back(i);
+	CHECK(values[99999] == 99999);
+	CHECK(region.reserved() >= 100000 * sizeof(int));
+}
+#endif
+
+int main()
+{
+	test_alloc();
+	test_rewind();
+	#ifdef SHARK_HAS_PMR
+	test_resource();
+	#endif
+	return check_result();
+}
@@ -0,0 +1,148 @@
+// regression tests for warm starts: memory reserved with RESERVE_POPULATE or
+// RESERVE_LOCK takes no page faults when it is handed out, reserved pages
+// count as free slots, and a dumped profile prewarms a fresh heap
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static long minor_faults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+// the stat of the smallest bucket holding size byte elements
+static size_t bucket_get(HeapAllocator& heap, size_t size, const char* field)
+{
+	char name[64];
+	for (unsigned bi = 0;; bi++) {
+		size_t elemSize = 0;
+		snprintf(name, sizeof(name), "stats.bucket.%u.elem_size", bi);
+		if (heap.ctl(name, &elemSize) != 0)
+			return 0;
+		if (elemSize >= size)
+			break;
+	}
+	*strrchr(name, '.') = 0;
+	snprintf(name + strlen(name), sizeof(name) - strlen(name), ".%s", field);
+	return get(heap, name);
+}
+
+static void test_populate()
+{
+	const size_t size = 100000;
+	const unsigned count = 40;
+	HeapAllocator heap;
+	CHECK(heap.reserve(size, count, HeapAllocator::RESERVE_POPULATE));
+	void* blocks[count];
+	long before = minor_faults();
+	for (unsigned i = 0; i < count; i++) {
+		blocks[i] = heap.alloc(size);
+		CHECK(blocks[i] != NULL);
+		memset(blocks[i], 1, size);
+	}
+	long faults = minor_faults() - before;
+	// about a thousand OS pages were touched, a few faults for bookkeeping are fine
+	printf("populated reserve: %ld faults\n", faults);
+	CHECK(faults <= (long)count);
+	for (unsigned i = 0; i < count; i++)
+		heap.free(blocks[i]);
+}
+
+static void test_lock()
+{
+	struct rlimit limit;
+	getrlimit(RLIMIT_MEMLOCK, &limit);
+	if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (4 << 20)) {
+		printf("RLIMIT_MEMLOCK too small, skipping RESERVE_LOCK\n");
+		return;
+	}
+	HeapAllocator heap;
+	CHECK(heap.reserve(4096, 64, HeapAllocator::RESERVE_LOCK));
+	long before = minor_faults();
+	void* mem = heap.alloc(4096 * 32);
+	CHECK(mem != NULL);
+	memset(mem, 1, 4096 * 32);
+	CHECK(minor_faults() - before <= 4);
+	heap.free(mem);
+}
+
+static void test_bucket_reserve()
+{
+	HeapAllocator heap;
+	CHECK(heap.reserve(48, 5000));
+	CHECK(get(heap, "stats.buckets.slots_used") == 0);
+	CHECK(bucket_get(heap, 48, "slots_total") >= 5000);
+	size_t pages = bucket_get(heap, 48, "pages");
+	// slots already free count towards the reservation
+	CHECK(heap.reserve(48, 5000));
+	CHECK(bucket_get(heap, 48, "pages") == pages);
+	heap.purge();
+	CHECK(bucket_get(heap, 48, "pages") == 0);
+}
+
+static void test_profile()
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/reserve_test.%d", (int)getpid());
+	size_t treeBytes;
+	{
+		HeapAllocator heap;
+		for (int i = 0; i < 3000; i++)
+			heap.alloc(100);
+		for (int i = 0; i < 5; i++)
+			heap.alloc(200000);
+		CHECK(heap.dump_profile(path) == 0);
+		treeBytes = get(heap, "stats.segment_bytes") - get(heap, "stats.tree.free_bytes");
+		heap.destroy();
+	}
+	FILE* file = fopen(path, "r");
+	CHECK(file != NULL);
+	char line[128];
+	int buckets = 0, trees = 0;
+	while (file && fgets(line, sizeof(line), file)) {
+		buckets += strncmp(line, "bucket ", 7) == 0;
+		trees += strncmp(line, "tree ", 5) == 0;
+	}
+	if (file)
+		fclose(file);
+	CHECK(buckets == 1 && trees == 1);
+	HeapAllocator heap;
+	CHECK(heap.prewarm(path, HeapAllocator::RESERVE_POPULATE) == 0);
+	CHECK(bucket_get(heap, 100, "slots_total") >= 3000);
+	CHECK(get(heap, "stats.tree.free_bytes") >= treeBytes);
+	long before = minor_faults();
+	void* blocks[5];
+	for (int i = 0; i < 5; i++) {
+		blocks[i] = heap.alloc(200000);
+		CHECK(blocks[i] != NULL);
+		memset(blocks[i], 1, 200000);
+	}
+	CHECK(minor_faults() - before <= 10);
+	for (int i = 0; i < 5; i++)
+		heap.free(blocks[i]);
+	unlink(path);
+	CHECK(heap.prewarm(path) == ENOENT);
+}
+
+int main()
+{
+	test_populate();
+	test_lock();
+	test_bucket_reserve();
+	test_profile();
+	return check_result();
+}
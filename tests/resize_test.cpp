@@ -0,0 +1,103 @@
+// regression tests for in place resizing: usable_size, try_expand and shrink
+// on bucket slots and tree blocks, on release and debug heaps
+#include <string.h>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static bool filled(const char* mem, size_t size, char value)
+{
+	for (size_t i = 0; i < size; i++)
+		if (mem[i] != value)
+			return false;
+	return true;
+}
+
+template<class Heap>
+static uint64 lock_acquisitions(Heap& heap)
+{
+	size_t buckets = 0;
+	heap.ctl("stats.buckets", &buckets);
+	uint64 total = heap.tree_lock_stats().mAcquisitions;
+	for (unsigned i = 0; i < buckets; i++)
+		total += heap.bucket_lock_stats(i).mAcquisitions;
+	return total;
+}
+
+template<class Heap>
+static void test_bucket(Heap& heap)
+{
+	char* p = (char*)heap.alloc(20);
+	size_t usable = heap.usable_size(p);
+	CHECK(usable >= 20);
+	memset(p, 7, usable);
+	// the slot's tail is usable as it is, a slot never grows beyond its size class
+	CHECK(heap.try_expand(p, usable, usable) == usable);
+	CHECK(heap.try_expand(p, 1 << 20, 1 << 20) == usable);
+	CHECK(heap.shrink(p, 8) <= usable);
+	CHECK(filled(p, 8, 7));
+	CHECK(heap.usable_size(NULL) == 0);
+	heap.free(p);
+}
+
+template<class Heap>
+static void test_tree(Heap& heap)
+{
+	// three neighbours in one segment
+	char* first = (char*)heap.alloc(20000);
+	char* second = (char*)heap.alloc(30000);
+	char* guard = (char*)heap.alloc(20000);
+	CHECK(first < second && second < guard && guard - first < 100000);
+	size_t usable = heap.usable_size(first);
+	CHECK(usable >= 20000);
+	memset(first, 3, 20000);
+	// second is in use, first can't grow into it
+	CHECK(heap.try_expand(first, usable + 1000, usable + 1000) == usable);
+	heap.free(second);
+	size_t grown = heap.try_expand(first, 40000, 45000);
+	CHECK(grown >= 40000 && grown <= 50000);
+	CHECK(heap.usable_size(first) == grown);
+	CHECK(filled(first, 20000, 3));
+	memset(first, 4, grown);
+	size_t shrunk = heap.shrink(first, 10000);
+	CHECK(shrunk >= 10000 && shrunk < grown);
+	CHECK(filled(first, 10000, 4));
+	// the tail went back to the tree and can be used again
+	char* tail = (char*)heap.alloc(30000);
+	CHECK(tail > first && tail < guard);
+	heap.free(tail);
+	heap.free(first);
+	heap.free(guard);
+}
+
+// usable_size must not touch any lock, debug builds included
+template<class Heap>
+static void test_lock_free(Heap& heap)
+{
+	void* small = heap.alloc(40);
+	void* big = heap.alloc(50000);
+	uint64 before = lock_acquisitions(heap);
+	size_t total = 0;
+	for (int i = 0; i < 1000; i++)
+		total += heap.usable_size(small) + heap.usable_size(big);
+	CHECK(total >= 1000 * 50040);
+	CHECK(lock_acquisitions(heap) == before);
+	heap.free(small);
+	heap.free(big);
+}
+
+template<class Heap>
+static void run()
+{
+	Heap heap;
+	test_bucket(heap);
+	test_tree(heap);
+	test_lock_free(heap);
+}
+
+int main()
+{
+	run<HeapAllocator>();
+	run<DebugHeapAllocator>();
+	return check_result();
+}
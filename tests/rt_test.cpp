@@ -0,0 +1,75 @@
+// regression tests for real-time mode: memory handed out of the pre-faulted
+// reserves takes no page faults, and stopping the mode gives the page pool
+// its own limit back
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static long minor_faults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+static size_t get(HeapAllocator& heap, const char* name)
+{
+	size_t value = (size_t)-1;
+	CHECK(heap.ctl(name, &value) == 0);
+	return value;
+}
+
+static int set(HeapAllocator& heap, const char* name, size_t value)
+{
+	return heap.ctl(name, NULL, &value);
+}
+
+static void test_rt_reserve()
+{
+	HeapAllocator heap;
+	CHECK(set(heap, "rt.enabled", 1) == 0);
+	usleep(200000);	//the refill thread fills the reserves in the background
+	long before = minor_faults();
+	void* mem = heap.alloc(500000);
+	CHECK(mem != NULL);
+	memset(mem, 1, 500000);
+	long faults = minor_faults() - before;
+	printf("rt reserve: %ld faults\n", faults);
+	CHECK(faults <= 10);
+	heap.free(mem);
+	CHECK(set(heap, "rt.enabled", 0) == 0);
+}
+
+static void test_pool_limit_restored()
+{
+	HeapAllocator heap;
+	CHECK(set(heap, "page_pool.max_pages", 8) == 0);
+	CHECK(set(heap, "rt.reserve_pages", 32) == 0);
+	CHECK(set(heap, "rt.enabled", 1) == 0);
+	CHECK(get(heap, "page_pool.max_pages") == 32);
+	// raising the reserve while running raises the pool with it
+	CHECK(set(heap, "rt.reserve_pages", 48) == 0);
+	CHECK(get(heap, "page_pool.max_pages") == 48);
+	usleep(100000);
+	CHECK(get(heap, "stats.page_pool.pages") > 8);
+	CHECK(set(heap, "rt.enabled", 0) == 0);
+	CHECK(get(heap, "page_pool.max_pages") == 8);
+	CHECK(get(heap, "stats.page_pool.pages") <= 8);
+
+	// a limit set while running is the one left behind
+	CHECK(set(heap, "rt.enabled", 1) == 0);
+	CHECK(set(heap, "page_pool.max_pages", 100) == 0);
+	CHECK(set(heap, "rt.enabled", 0) == 0);
+	CHECK(get(heap, "page_pool.max_pages") == 100);
+}
+
+int main()
+{
+	test_rt_reserve();
+	test_pool_limit_restored();
+	return check_result();
+}
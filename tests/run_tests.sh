@@ -0,0 +1,31 @@
+#!/bin/sh
+# builds the library sources into an archive, then builds and runs every
+# tests/*_test.cpp against it
+# usage: tests/run_tests.sh [extra compiler flags]
+cd "$(dirname "$0")/.." || exit 1
+CXX=${CXX:-g++}
+OUT=${TMPDIR:-/tmp}/heap_tests
+mkdir -p "$OUT/obj"
+rm -f "$OUT"/obj/*.o "$OUT/libheap.a"
+for src in $(ls *.cpp | grep -v '^main\.cpp$'); do
+	$CXX -O1 -g -I. "$@" -c "$src" -o "$OUT/obj/${src%.cpp}.o" || exit 1
+done
+ar rcs "$OUT/libheap.a" "$OUT"/obj/*.o || exit 1
+failed=0
+for test in tests/*_test.cpp; do
+	name=$(basename "$test" .cpp)
+	# a test may compile a library source itself to reach its internals,
+	# the archive member is only linked when nothing else defines it
+	if ! $CXX -O1 -g -I. "$@" "$test" -o "$OUT/$name" "$OUT/libheap.a" -lpthread -lrt; then
+		echo "$name: build failed"
+		failed=$((failed + 1))
+		continue
+	fi
+	if "$OUT/$name"; then
+		echo "$name: passed"
+	else
+		echo "$name: FAILED"
+		failed=$((failed + 1))
+	fi
+done
+exit $failed
@@ -0,0 +1,183 @@
+// regression tests for SharedHeap: several processes allocating in one heap,
+// reopening a file backed heap through offset_ptr links, recovery from a
+// process that died holding the heap lock, and from a lock left held by a
+// thread of an earlier boot.
+// The lock recovery test needs the private lock and block layout, so the test
+// compiles shared_heap.cpp itself instead of linking it.
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+#include "mutex.h"
+#define private public
+#include "shared_heap.cpp"
+#undef private
+#include "check.h"
+using namespace shark;
+
+struct list_node {
+	offset_ptr<list_node> next;
+	int value;
+};
+
+struct list_root {
+	offset_ptr<list_node> head;
+	int count;
+};
+
+static void test_processes_and_reopen(const char* path)
+{
+	unlink(path);
+	{
+		SharedHeap heap;
+		CHECK(heap.open_file(path, 8 << 20) == 0);
+		list_root* root = (list_root*)heap.alloc(sizeof(list_root));
+		root->head = NULL;
+		root->count = 0;
+		heap.set_root(root);
+		size_t freeBefore = heap.free_bytes();
+		for (int child = 0; child < 4; child++) {
+			if (fork() != 0)
+				continue;
+			SharedHeap mine;
+			if (mine.open_file(path, 0))
+				_exit(1);
+			std::vector<void*> live;
+			srand(child + 1);
+			for (int i = 0; i < 2000; i++) {
+				live.push_back(mine.alloc(rand() % 3000 + 1));
+				void* mem = mine.alloc(100);
+				if (!live.back() || !mem)
+					_exit(2);
+				mine.free(mem);
+			}
+			for (size_t i = 0; i < live.size(); i++)
+				mine.free(live[i]);
+			_exit(0);
+		}
+		for (int child = 0; child < 4; child++) {
+			int status;
+			wait(&status);
+			CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		}
+		CHECK(heap.free_bytes() == freeBefore);
+		for (int i = 0; i < 1000; i++) {
+			list_node* node = (list_node*)heap.alloc(sizeof(list_node));
+			node->value = i;
+			node->next = root->head;
+			root->head = node;
+			root->count++;
+		}
+	}
+	// the file is mapped again, most likely at another address
+	SharedHeap heap;
+	CHECK(heap.open_file(path, 0) == 0);
+	list_root* root = (list_root*)heap.root();
+	CHECK(root != NULL && root->count == 1000);
+	int expect = 999;
+	for (list_node* node = root->head; node; node = node->next)
+		CHECK(node->value == expect--);
+	CHECK(expect == -1);
+	while (root->head) {
+		list_node* node = root->head;
+		root->head = node->next;
+		heap.free(node);
+	}
+	heap.close();
+	unlink(path);
+}
+
+// a child takes the heap lock and exits without releasing it, after breaking
+// either only the free lists (repairable) or the block tags (poisons the heap)
+static void test_dead_owner(const char* name, bool breakTags)
+{
+	shm_unlink(name);
+	SharedHeap heap;
+	CHECK(heap.open_shm(name, 1 << 20) == 0);
+	void* first = heap.alloc(100);
+	void* second = heap.alloc(200);
+	heap.free(first);
+	pid_t pid = fork();
+	if (pid == 0) {
+		SharedHeap child;
+		if (child.open_shm(name, 0))
+			_exit(1);
+		new SharedHeap::heap_lock(&child);	//never released
+		if (breakTags) {
+			SharedHeap::block* b = child.block_at(round_up16(sizeof(SharedHeap::header)));
+			b->set(b->size() + 16, true);
+		} else {
+			for (unsigned i = 0; i < SharedHeap::NUM_LISTS; i++)
+				child.head()->mLists[i] = 12345;
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	void* mem = heap.alloc(64);
+	if (breakTags) {
+		CHECK(mem == NULL);
+		CHECK(heap.poisoned());
+		heap.free(second);
+	} else {
+		CHECK(mem != NULL);
+		CHECK(!heap.poisoned());
+		heap.free(mem);
+		heap.free(second);
+		// the rebuilt lists hold all free space again
+		mem = heap.alloc(1000000);
+		CHECK(mem != NULL);
+		heap.free(mem);
+	}
+	heap.close();
+	shm_unlink(name);
+}
+
+// the heap as a machine crash leaves it: the lock word names a thread of the
+// previous boot and the lists may be half spliced
+static void test_stale_boot(const char* name)
+{
+	shm_unlink(name);
+	SharedHeap heap;
+	CHECK(heap.open_shm(name, 1 << 20) == 0);
+	void* kept = heap.alloc(100);
+	size_t freeBytes = heap.free_bytes();
+	SharedHeap::header* h = heap.head();
+	CHECK(h->mLockBoot == boot_id());
+	h->mLockBoot = 12345;
+	*(int*)&h->mLock = 0x3ffffff0;	// glibc keeps the owner tid in the first word
+	for (unsigned i = 0; i < SharedHeap::NUM_LISTS; i++)
+		h->mLists[i] = 12345;
+	heap.close();
+
+	alarm(10);	// a stale lock would hang the alloc below
+	CHECK(heap.open_shm(name, 0) == 0);
+	CHECK(heap.head()->mLockBoot == boot_id());
+	CHECK(!heap.poisoned());
+	CHECK(heap.free_bytes() == freeBytes);
+	void* mem = heap.alloc(1000);
+	CHECK(mem != NULL);
+	heap.free(mem);
+	heap.free(kept);
+	alarm(0);
+	heap.close();
+	shm_unlink(name);
+}
+
+int main()
+{
+	char path[64], name[64];
+	snprintf(path, sizeof(path), "/tmp/shared_heap_test.%d", (int)getpid());
+	snprintf(name, sizeof(name), "/shared_heap_test.%d", (int)getpid());
+	test_processes_and_reopen(path);
+	test_dead_owner(name, false);
+	test_dead_owner(name, true);
+	test_stale_boot(name);
+	return check_result();
+}
@@ -0,0 +1,91 @@
+// regression tests for the STL adapters: containers on a private heap give
+// all their memory back, over-aligned types and huge counts are handled
+#include <list>
+#include <map>
+#include <new>
+#include <vector>
+#include "stl_allocator.h"
+#include "check.h"
+using namespace shark;
+
+struct alignas(64) wide {
+	char mData[64];
+};
+
+// live bucket slots plus tree bytes in use
+static size_t heap_usage(HeapAllocator& heap)
+{
+	size_t slots = 0, freeBytes = 0, segmentBytes = 0;
+	heap.ctl("stats.buckets.slots_used", &slots);
+	heap.ctl("stats.tree.free_bytes", &freeBytes);
+	heap.ctl("stats.segment_bytes", &segmentBytes);
+	return slots + (segmentBytes - freeBytes);
+}
+
+static void test_containers()
+{
+	HeapAllocator heap;
+	size_t idle = heap_usage(heap);
+	{
+		typedef stl_allocator<std::pair<const int, int> > pair_allocator;
+		std::less<int> less;
+		std::map<int, int, std::less<int>, pair_allocator> values(less, pair_allocator(&heap));
+		std::vector<int, stl_allocator<int> > numbers((stl_allocator<int>(&heap)));
+		std::list<wide, stl_allocator<wide> > wides((stl_allocator<wide>(&heap)));
+		for (int i = 0; i < 20000; i++) {
+			values[i] = i;
+			numbers.push_back(i);
+			wides.push_back(wide());
+			CHECK(((size_t)&wides.back() & 63) == 0);
+		}
+		CHECK(values.get_allocator().heap() == &heap);
+		CHECK(stl_allocator<int>(&heap) == numbers.get_allocator());
+		CHECK(stl_allocator<int>() != numbers.get_allocator());
+		CHECK(heap_usage(heap) > idle);
+		bool threw = false;
+		try {
+			numbers.get_allocator().allocate(numbers.get_allocator().max_size() + 1);
+		} catch (const std::bad_alloc&) {
+			threw = true;
+		}
+		CHECK(threw);
+	}
+	heap.purge();
+	CHECK(heap_usage(heap) == idle);
+}
+
+#ifdef SHARK_HAS_PMR
+static void test_resource()
+{
+	HeapAllocator heap;
+	HeapResource resource(&heap);
+	size_t idle = heap_usage(heap);
+	{
+		std::pmr::vector<int> numbers(&resource);
+		std::pmr::map<int, std::pmr::vector<char> > strings(&resource);
+		for (int i = 0; i < 20000; i++) {
+			numbers.push_back(i);
+			strings[i].resize(i % 300);
+		}
+		void* aligned = resource.allocate(1000, 256);
+		CHECK(((size_t)aligned & 255) == 0);
+		resource.deallocate(aligned, 1000, 256);
+		void* empty = resource.allocate(0, 1);
+		CHECK(empty != NULL);
+		resource.deallocate(empty, 0, 1);
+	}
+	CHECK(HeapResource(&heap) == resource);
+	CHECK(!(HeapResource() == resource));
+	heap.purge();
+	CHECK(heap_usage(heap) == idle);
+}
+#endif
+
+int main()
+{
+	test_containers();
+	#ifdef SHARK_HAS_PMR
+	test_resource();
+	#endif
+	return check_result();
+}
@@ -0,0 +1,99 @@
+// regression tests for SuperblockArena: runs are placed lowest address first
+// and never wrap, commits grow in COMMIT_STEP pages, freed runs read zero,
+// empty superblocks are released except for one spare, and the heap reports
+// the arena through ctl
+#include <string.h>
+#include "superblock.h"
+#include "heap_alloc.h"
+#include "check.h"
+using namespace shark;
+
+static const unsigned PAGE_LOG2 = 16;
+static const size_t PAGE = (size_t)1 << PAGE_LOG2;
+
+static void test_runs()
+{
+	SuperblockArena arena(PAGE_LOG2);
+	CHECK(arena.superblock_count() == 0);
+	CHECK(arena.alloc(0) == NULL);
+	CHECK(arena.alloc(SuperblockArena::PAGES_PER_SUPERBLOCK + 1) == NULL);
+
+	char* a = (char*)arena.alloc(1);
+	CHECK(a != NULL && ((size_t)a & (arena.superblock_size() - 1)) == 0);
+	CHECK(arena.superblock_count() == 1);
+	CHECK(arena.used_pages() == 1);
+	CHECK(arena.committed_bytes() == SuperblockArena::COMMIT_STEP * PAGE);
+	CHECK(arena.owns(a) && arena.owns(a + arena.superblock_size() - 1));
+	CHECK(!arena.owns(a + arena.superblock_size()));
+
+	char* b = (char*)arena.alloc(1);
+	char* c = (char*)arena.alloc(1);
+	CHECK(b == a + PAGE && c == b + PAGE);
+	// a hole of one page doesn't take a run of two
+	arena.free(b, 1);
+	char* d = (char*)arena.alloc(2);
+	CHECK(d == c + PAGE);
+	CHECK(arena.alloc(1) == b);
+	CHECK(arena.used_pages() == 5);
+
+	// committing past the first step
+	char* e = (char*)arena.alloc(8);
+	CHECK(e == d + 2 * PAGE);
+	CHECK(arena.committed_bytes() == 2 * SuperblockArena::COMMIT_STEP * PAGE);
+	memset(e, 0x5a, 8 * PAGE);
+	arena.free(e, 8);
+	char* f = (char*)arena.alloc(8);
+	CHECK(f == e);
+	bool zero = true;
+	for (size_t i = 0; i < 8 * PAGE; i += 4096)
+		zero = zero && f[i] == 0;
+	CHECK(zero);
+
+	// a run which doesn't fit the rest of the superblock takes a new one
+	char* g = (char*)arena.alloc(SuperblockArena::PAGES_PER_SUPERBLOCK);
+	CHECK(g != NULL && arena.superblock_count() == 2);
+	CHECK(arena.owns(g) && arena.owns(a));
+
+	// partial frees of a run are allowed
+	arena.free(g, 32);
+	arena.free(g + 32 * PAGE, 32);
+	// the emptied superblock stays as the spare while the first one is in use
+	CHECK(arena.superblock_count() == 2);
+	arena.free(a, 1);
+	arena.free(b, 1);
+	arena.free(c, 1);
+	arena.free(d, 2);
+	arena.free(f, 8);
+	CHECK(arena.used_pages() == 0);
+	// two empty superblocks, one is released
+	CHECK(arena.superblock_count() == 1);
+	CHECK(arena.committed_bytes() <= arena.superblock_size());
+}
+
+static void test_heap_stats()
+{
+	HeapAllocator heap;
+	size_t count = 1, used = 1;
+	CHECK(heap.ctl("stats.superblocks.count", &count) == 0);
+	CHECK(heap.ctl("stats.superblocks.used_pages", &used) == 0);
+	CHECK(used == 0);
+	void* p = heap.alloc(32);
+	CHECK(heap.ctl("stats.superblocks.used_pages", &used) == 0);
+	CHECK(used >= 1);
+	size_t committed = 0;
+	CHECK(heap.ctl("stats.superblocks.committed_bytes", &committed) == 0);
+	CHECK(committed > 0);
+	heap.free(p);
+	size_t zero = 0;
+	CHECK(heap.ctl("page_pool.max_pages", NULL, &zero) == 0);
+	heap.purge();
+	CHECK(heap.ctl("stats.superblocks.used_pages", &used) == 0);
+	CHECK(used == 0);
+}
+
+int main()
+{
+	test_runs();
+	test_heap_stats();
+	return check_result();
+}